@@ -3,9 +3,13 @@
 #include  <string.h>   //好像 用不了
 
 # include <libopencm3/stm32/common/gpio_common_f234.h>
+# include <libopencm3/stm32/dma.h>
 #include "sdio.h"
 #include "SD_Card.h"
 
+#define SD_DMA_RX_STREAM	DMA_STREAM3		//SDIO在DMA2上的通道4：Stream3读，Stream6写
+#define SD_DMA_TX_STREAM	DMA_STREAM6
+
 SDIO_InitTypeDef SDIO_InitStructure;
 SDIO_CmdInitTypeDef SDIO_CmdInitStructure;
 SDIO_DataInitTypeDef SDIO_DataInitStructure;
@@ -19,20 +23,36 @@ SD_Error CmdResp6Error(uint8_t cmd,uint16_t *prca);
 SD_Error SDEnWideBus(uint8_t enx);
 SD_Error IsCardProgramming(uint8_t *pstatus);
 SD_Error FindSCR(uint16_t rca,uint32_t *pscr);
+static SD_Error SD_WaitDMA(uint8_t stream,uint8_t stop);
 uint8_t convert_from_bytes_to_power_of_two(uint16_t NumberOfBytes);
 
 
 static uint8_t CardType=SDIO_STD_CAPACITY_SD_CARD_V1_1;
 static uint32_t CSD_Tab[4],CID_Tab[4],RCA=0;
-static uint8_t DeviceMode=SD_DMA_MODE;
+static uint8_t DeviceMode=SD_POLLING_MODE;     //SD_SetDeviceMode设置，重新初始化后保持
 static uint8_t StopCondition=0;
 volatile SD_Error TransferError=SD_OK;
 volatile uint8_t TransferEnd=0;
 SD_CardInfo SDCardInfo;
-
-#pragma pack (4)
-uint8_t SDIO_DATA_BUFFER[512];
-#pragma pack ()
+int (*SD_WaitHook)(void);       //DMA传输等待时调用，返回0表示无事可做；polling模式不调用：FIFO无流控，flash编程时取指停顿会导致溢出
+
+//未对齐的缓冲区经此中转；pack不对齐数组，必须用aligned
+uint8_t SDIO_DATA_BUFFER[512] __attribute__((aligned(4)));
+uint32_t SD_BounceReads;        //经SDIO_DATA_BUFFER中转读出的块数，正常应为0
+uint32_t SD_BounceWrites;       //经SDIO_DATA_BUFFER中转写入的块数
+
+//总线时钟档位：0为旁路分频的48MHz(需卡已切换到高速模式)，其后为SDIO_CK=48MHz/(div+2)
+static const uint8_t SD_ClockDiv[SD_CLOCK_STEPS]={0,0,2,6,14};
+static uint8_t SD_ClockStep;
+static uint8_t SD_ClockFloor;   //降档后允许的最快档位，重新SD_Init后保持
+uint32_t SD_ClockKHz;           //当前SDIO_CK
+uint8_t SD_HighSpeed;           //卡已由CMD6切换到高速模式
+uint8_t SD_SpeedClass;          //SD状态中的速度等级(2,4,6,10)，未知为0
+
+void SD_SetClockStep(uint8_t step);
+SD_Error SD_SwitchHighSpeed(void);
+void SD_ReadSpeedClass(void);
+SD_Error SD_ReadStatusBlock(uint8_t cmd,uint32_t arg,uint32_t *buf);
 
 void SDIO_Register_Deinit()
 {
@@ -65,7 +85,7 @@ SD_Error SD_Deinit(void)
 SD_Error SD_Init(void)
 {
 	SD_Error errorstatus=SD_OK;
-	uint8_t clkdiv=0;
+	uint8_t step;
 	rcc_peripheral_enable_clock( &RCC_AHB1ENR, RCC_AHB1ENR_IOPCEN |RCC_AHB1ENR_IOPDEN | RCC_AHB1ENR_DMA2EN);
 	rcc_peripheral_enable_clock( &RCC_APB2ENR, RCC_APB2ENR_SDIOEN );
 	rcc_peripheral_reset(&RCC_APB2RSTR, RCC_APB2RSTR_SDIORST);
@@ -90,17 +110,48 @@ SD_Error SD_Init(void)
    	if(errorstatus==SD_OK)errorstatus=SD_EnableWideBusOperation(SDIO_BusWide_4b);
   	if((errorstatus==SD_OK)||(SDIO_MULTIMEDIA_CARD==CardType))
 	{
+		//标准容量卡仍按原来的12MHz；SDHC/SDXC先在24MHz下用CMD6切换到高速模式，再去掉分频
+		step=SD_ClockFloor;
 		if(SDCardInfo.CardType==SDIO_STD_CAPACITY_SD_CARD_V1_1||SDCardInfo.CardType==SDIO_STD_CAPACITY_SD_CARD_V2_0)
 		{
-			clkdiv=SDIO_TRANSFER_CLK_DIV+2;
-		}else clkdiv=SDIO_TRANSFER_CLK_DIV;
-		SDIO_Clock_Set(clkdiv);
-		DeviceMode=SD_POLLING_MODE;
-		//errorstatus=SD_SetDeviceMode();
+			if(step<2)step=2;
+		}else if(SDCardInfo.CardType!=SDIO_HIGH_CAPACITY_SD_CARD)
+		{
+			if(step<1)step=1;
+		}
+		SD_HighSpeed=0;
+		SD_SetClockStep(step?step:1);
+		if(step==0&&SD_SwitchHighSpeed()!=SD_OK)step=1;
+		SD_SetClockStep(step);
+		if(CardType!=SDIO_MULTIMEDIA_CARD)SD_ReadSpeedClass();
  	}
 	return errorstatus;
 }
 
+void SD_SetClockStep(uint8_t step)
+{
+	if(step==0)
+	{
+		SDIO->CLKCR|=SDIO_ClockBypass_Enable;
+		SD_ClockKHz=SDIO_CLK_KHZ;
+	}else
+	{
+		SDIO->CLKCR&=~SDIO_ClockBypass_Enable;
+		SDIO_Clock_Set(SD_ClockDiv[step]);
+		SD_ClockKHz=SDIO_CLK_KHZ/(SD_ClockDiv[step]+2);
+	}
+	SD_ClockStep=step;
+}
+
+//disk_read/disk_write重试时降一档，之后的SD_Init也不再超过这一档；已是最慢档返回0
+uint8_t SD_ClockStepDown(void)
+{
+	if(SD_ClockStep+1>=SD_CLOCK_STEPS)return 0;
+	SD_ClockFloor=SD_ClockStep+1;
+	SD_SetClockStep(SD_ClockFloor);
+	return 1;
+}
+
 void SDIO_Clock_Set(uint8_t clkdiv)
 {
 	uint32_t tmpreg=SDIO->CLKCR;
@@ -481,6 +532,11 @@ SD_Error SD_SetDeviceMode(uint32_t Mode)
 	return errorstatus;
 }
 
+uint32_t SD_GetDeviceMode(void)
+{
+	return DeviceMode;
+}
+
 
 SD_Error SD_SelectDeselect(uint32_t addr)
 {
@@ -540,6 +596,11 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
 
 	}else return SD_INVALID_PARAMETER;
 
+	if(DeviceMode==SD_DMA_MODE)
+	{
+		SD_DMA_Config((uint32_t*)buf,blksize,DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+		SDIO->DCTRL|=1<<3;
+	}
 	  SDIO_DataInitStructure.SDIO_DataBlockSize= power<<4 ;
 	  SDIO_DataInitStructure.SDIO_DataLength= blksize ;
 	  SDIO_DataInitStructure.SDIO_DataTimeOut=SD_DATATIMEOUT ;
@@ -603,15 +664,7 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
 
 	}else if(DeviceMode==SD_DMA_MODE)
 	{
-// 		TransferError=SD_OK;
-//		StopCondition=0;
-//		TransferEnd=0;
-//		SDIO->MASK|=(1<<1)|(1<<3)|(1<<8)|(1<<5)|(1<<9);
-//	 	SDIO->DCTRL|=1<<3;
-//	    SD_DMA_Config((uint32_t*)buf,blksize,DMA_DIR_PeripheralToMemory);
-//		while(((DMA2->LISR&(1<<27))==RESET)&&(TransferEnd==0)&&(TransferError==SD_OK)&&timeout)timeout--;
-//		if(timeout==0)return SD_DATA_TIMEOUT;
-//		if(TransferError!=SD_OK)errorstatus=TransferError;
+		errorstatus=SD_WaitDMA(SD_DMA_RX_STREAM,0);
     }
  	return errorstatus;
 }
@@ -665,6 +718,11 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  	{
   	  	if(nblks*blksize>SD_MAX_DATA_LENGTH)return SD_INVALID_PARAMETER;
 
+ 		if(DeviceMode==SD_DMA_MODE)
+ 		{
+ 			SD_DMA_Config((uint32_t*)buf,nblks*blksize,DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+ 			SDIO->DCTRL|=1<<3;
+ 		}
  		   SDIO_DataInitStructure.SDIO_DataBlockSize= power<<4;
  			 SDIO_DataInitStructure.SDIO_DataLength= nblks*blksize ;
  			 SDIO_DataInitStructure.SDIO_DataTimeOut=SD_DATATIMEOUT ;
@@ -746,17 +804,7 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  	 		SDIO_ClearFlag(SDIO_STATIC_FLAGS);
   		}else if(DeviceMode==SD_DMA_MODE)
  		{
-// 	   		TransferError=SD_OK;
-// 			StopCondition=1;
-// 			TransferEnd=0;
-// 			SDIO->MASK|=(1<<1)|(1<<3)|(1<<8)|(1<<5)|(1<<9);
-// 		 	SDIO->DCTRL|=1<<3;
-//  //由于不会使用DMA模式，故注释掉。
-//  // 	 	    SD_DMA_Config((uint32_t*)buf,nblks*blksize,DMA_DIR_PeripheralToMemory);
-//  // 	 		while(((DMA2->LISR&(1<<27))==RESET)&&timeout)timeout--;
-// 			if(timeout==0)return SD_DATA_TIMEOUT;
-// 			while((TransferEnd==0)&&(TransferError==SD_OK));
-// 			if(TransferError!=SD_OK)errorstatus=TransferError;
+ 			errorstatus=SD_WaitDMA(SD_DMA_RX_STREAM,1);
  		}
    	}
  	return errorstatus;
@@ -855,6 +903,11 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
 
  	StopCondition=0;
 
+ 	if(DeviceMode==SD_DMA_MODE)
+ 	{
+ 		SD_DMA_Config((uint32_t*)buf,blksize,DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+ 		SDIO->DCTRL|=1<<3;
+ 	}
  	SDIO_DataInitStructure.SDIO_DataBlockSize= power<<4;
  	SDIO_DataInitStructure.SDIO_DataLength= blksize ;
  	SDIO_DataInitStructure.SDIO_DataTimeOut=SD_DATATIMEOUT ;
@@ -919,22 +972,8 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  		SDIO_ClearFlag(SDIO_STATIC_FLAGS);
  	}else if(DeviceMode==SD_DMA_MODE)
  	{
-//    		TransferError=SD_OK;
-// 		StopCondition=0;
-// 		TransferEnd=0;
-// 		SDIO->MASK|=(1<<1)|(1<<3)|(1<<8)|(1<<4)|(1<<9);
-// 		SD_DMA_Config((uint32_t*)buf,blksize,DMA_DIR_MemoryToPeripheral);
-//  	 	SDIO->DCTRL|=1<<3;
-//  		while(((DMA2->LISR&(1<<27))==RESET)&&timeout)timeout--;
-// 		if(timeout==0)
-// 		{
-//   			SD_Init();
-// 			return SD_DATA_TIMEOUT;
-//  		}
-// 		timeout=SDIO_DATATIMEOUT;
-// 		while((TransferEnd==0)&&(TransferError==SD_OK)&&timeout)timeout--;
-//  		if(timeout==0)return SD_DATA_TIMEOUT;
-//   		if(TransferError!=SD_OK)return TransferError;
+ 		errorstatus=SD_WaitDMA(SD_DMA_TX_STREAM,0);
+ 		if(errorstatus!=SD_OK)return errorstatus;
   	}
   	SDIO_ClearFlag(SDIO_STATIC_FLAGS);
   	errorstatus=IsCardProgramming(&cardstate);
@@ -1030,6 +1069,11 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
 
  		if(errorstatus!=SD_OK)return errorstatus;
 
+ 		if(DeviceMode==SD_DMA_MODE)
+ 		{
+ 			SD_DMA_Config((uint32_t*)buf,nblks*blksize,DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+ 			SDIO->DCTRL|=1<<3;
+ 		}
          SDIO_DataInitStructure.SDIO_DataBlockSize= power<<4;
  				SDIO_DataInitStructure.SDIO_DataLength= nblks*blksize ;
  				SDIO_DataInitStructure.SDIO_DataTimeOut=SD_DATATIMEOUT ;
@@ -1106,23 +1150,8 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  	 		SDIO_ClearFlag(SDIO_STATIC_FLAGS);
  	    }else if(DeviceMode==SD_DMA_MODE)
  		{
-// 	   	TransferError=SD_OK;
-// 			StopCondition=1;
-// 			TransferEnd=0;
-// 			SDIO->MASK|=(1<<1)|(1<<3)|(1<<8)|(1<<4)|(1<<9);
-// 			SD_DMA_Config((uint32_t*)buf,nblks*blksize,DMA_DIR_MemoryToPeripheral);
-// 	 	 	SDIO->DCTRL|=1<<3;
-// 			timeout=SDIO_DATATIMEOUT;
-// 	 		while(((DMA2->LISR&(1<<27))==RESET)&&timeout)timeout--;
-// 			if(timeout==0)
-// 			{
-//   				SD_Init();
-// 	 			return SD_DATA_TIMEOUT;
-// 	 		}
-// 			timeout=SDIO_DATATIMEOUT;
-// 			while((TransferEnd==0)&&(TransferError==SD_OK)&&timeout)timeout--;
-// 	 		if(timeout==0)return SD_DATA_TIMEOUT;
-// 	 		if(TransferError!=SD_OK)return TransferError;
+ 			errorstatus=SD_WaitDMA(SD_DMA_TX_STREAM,1);
+ 			if(errorstatus!=SD_OK)return errorstatus;
  		}
    	}
   	SDIO_ClearFlag(SDIO_STATIC_FLAGS);
@@ -1440,6 +1469,99 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  	else return (SDCardState)((resp1>>9) & 0x0F);
  }
 
+//读64字节的状态数据块：CMD6的切换状态，或ACMD13的SD状态；buf按线上字节顺序存放
+SD_Error SD_ReadStatusBlock(uint8_t cmd,uint32_t arg,uint32_t *buf)
+{
+	SD_Error errorstatus=SD_OK;
+	uint32_t index=0;
+
+	SDIO_CmdInitStructure.SDIO_Argument = 64;
+	SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_SET_BLOCKLEN;
+	SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+	SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+	SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+	SDIO_SendCommand(&SDIO_CmdInitStructure);
+	errorstatus=CmdResp1Error(SD_CMD_SET_BLOCKLEN);
+	if(errorstatus!=SD_OK)return errorstatus;
+
+	if(cmd==SD_CMD_SD_APP_STAUS)
+	{
+		SDIO_CmdInitStructure.SDIO_Argument = (uint32_t) RCA << 16;
+		SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_APP_CMD;
+		SDIO_SendCommand(&SDIO_CmdInitStructure);
+		errorstatus=CmdResp1Error(SD_CMD_APP_CMD);
+		if(errorstatus!=SD_OK)return errorstatus;
+	}
+
+	SDIO_DataInitStructure.SDIO_DataTimeOut = SD_DATATIMEOUT;
+	SDIO_DataInitStructure.SDIO_DataLength = 64;
+	SDIO_DataInitStructure.SDIO_DataBlockSize = SDIO_DataBlockSize_64b;
+	SDIO_DataInitStructure.SDIO_TransferDir = SDIO_TransferDir_ToSDIO;
+	SDIO_DataInitStructure.SDIO_TransferMode = SDIO_TransferMode_Block;
+	SDIO_DataInitStructure.SDIO_DPSM = SDIO_DPSM_Enable;
+	SDIO_DataConfig(&SDIO_DataInitStructure);
+
+	SDIO_CmdInitStructure.SDIO_Argument = arg;
+	SDIO_CmdInitStructure.SDIO_CmdIndex = cmd;
+	SDIO_SendCommand(&SDIO_CmdInitStructure);
+	errorstatus=CmdResp1Error(cmd);
+	if(errorstatus!=SD_OK)return errorstatus;
+
+	while(!(SDIO->STA&(SDIO_FLAG_RXOVERR|SDIO_FLAG_DCRCFAIL|SDIO_FLAG_DTIMEOUT|SDIO_FLAG_DBCKEND|SDIO_FLAG_STBITERR)))
+	{
+		if(SDIO_GetFlagStatus(SDIO_FLAG_RXDAVL) != RESET&&index<16)buf[index++]=SDIO->FIFO;
+	}
+	while(SDIO_GetFlagStatus(SDIO_FLAG_RXDAVL) != RESET&&index<16)buf[index++]=SDIO->FIFO;
+
+	if(SDIO_GetFlagStatus(SDIO_FLAG_DTIMEOUT) != RESET)errorstatus=SD_DATA_TIMEOUT;
+	else if(SDIO_GetFlagStatus(SDIO_FLAG_DCRCFAIL) != RESET)errorstatus=SD_DATA_CRC_FAIL;
+	else if(SDIO_GetFlagStatus(SDIO_FLAG_RXOVERR) != RESET)errorstatus=SD_RX_OVERRUN;
+	else if(SDIO_GetFlagStatus(SDIO_FLAG_STBITERR) != RESET)errorstatus=SD_START_BIT_ERR;
+	else if(index<16)errorstatus=SD_DATA_TIMEOUT;
+	SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+	return errorstatus;
+}
+
+//SCR表明支持CMD6(SD_SPEC>=1.10)时，查询功能组1并切换到高速模式(功能1，最高50MHz)
+SD_Error SD_SwitchHighSpeed(void)
+{
+	SD_Error errorstatus;
+	uint32_t scr[2]={0,0};
+	uint32_t status[16];
+	uint8_t *st=(uint8_t *)status;
+
+	errorstatus=FindSCR(RCA,scr);
+	if(errorstatus!=SD_OK)return errorstatus;
+	if(((scr[1]>>24)&0x0F)==0)return SD_REQUEST_NOT_APPLICABLE;
+
+	//查询模式：字节13的bit1为功能组1支持高速
+	errorstatus=SD_ReadStatusBlock(SD_CMD_HS_SWITCH,0x00FFFFF1,status);
+	if(errorstatus!=SD_OK)return errorstatus;
+	if(!(st[13]&0x02))return SD_REQUEST_NOT_APPLICABLE;
+
+	//切换模式：字节16的低4位为切换后的功能组1
+	errorstatus=SD_ReadStatusBlock(SD_CMD_HS_SWITCH,0x80FFFFF1,status);
+	if(errorstatus!=SD_OK)return errorstatus;
+	if((st[16]&0x0F)!=1)return SD_UNSUPPORTED_FEATURE;
+
+	SD_HighSpeed=1;
+	return SD_OK;
+}
+
+//ACMD13读SD状态，字节8为速度等级；读失败不影响使用
+void SD_ReadSpeedClass(void)
+{
+	static const uint8_t classes[]={0,2,4,6,10};
+	uint32_t status[16];
+	uint8_t *st=(uint8_t *)status;
+
+	SD_SpeedClass=0;
+	if(SD_ReadStatusBlock(SD_CMD_SD_APP_STAUS,0,status)==SD_OK&&st[8]<sizeof(classes))
+	{
+		SD_SpeedClass=classes[st[8]];
+	}
+}
+
  SD_Error FindSCR(uint16_t rca,uint32_t *pscr)
  {
  	uint32_t index = 0;
@@ -1529,37 +1651,83 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  	return count;
  }
 
+ //配置DMA2 Stream3(读)/Stream6(写)，通道4，由SDIO控制传输长度
  void SD_DMA_Config(uint32_t*mbuf,uint32_t bufsize,uint32_t dir)
  {
+ 	uint8_t stream=(dir==DMA_SxCR_DIR_PERIPHERAL_TO_MEM)?SD_DMA_RX_STREAM:SD_DMA_TX_STREAM;
+
+ 	(void)bufsize;
+ 	dma_disable_stream(DMA2,stream);
+ 	while(DMA_SCR(DMA2,stream)&DMA_SxCR_EN);
+ 	dma_stream_reset(DMA2,stream);
+
+ 	dma_channel_select(DMA2,stream,DMA_SxCR_CHSEL_4);
+ 	dma_set_peripheral_address(DMA2,stream,(uint32_t)&SDIO->FIFO);
+ 	dma_set_memory_address(DMA2,stream,(uint32_t)mbuf);
+ 	dma_set_transfer_mode(DMA2,stream,dir);
+ 	dma_enable_memory_increment_mode(DMA2,stream);
+ 	dma_set_peripheral_size(DMA2,stream,DMA_SxCR_PSIZE_32BIT);
+ 	dma_set_memory_size(DMA2,stream,DMA_SxCR_MSIZE_32BIT);
+ 	dma_set_priority(DMA2,stream,DMA_SxCR_PL_VERY_HIGH);
+ 	dma_enable_fifo_mode(DMA2,stream);
+ 	dma_set_fifo_threshold(DMA2,stream,DMA_SxFCR_FTH_4_4_FULL);
+ 	//INCR4突发不能跨越1KB边界，缓冲区未按16字节对齐时用单次传输
+ 	dma_set_memory_burst(DMA2,stream,((uint32_t)mbuf&15)?DMA_SxCR_MBURST_SINGLE:DMA_SxCR_MBURST_INCR4);
+ 	dma_set_peripheral_burst(DMA2,stream,DMA_SxCR_PBURST_INCR4);
+ 	dma_set_peripheral_flow_control(DMA2,stream);
+ 	dma_enable_stream(DMA2,stream);
+ }
 
- /*  DMA_InitTypeDef  DMA_InitStructure;
-
- 	while (DMA_GetCmdStatus(DMA2_Stream3) != DISABLE){}
-
-   DMA_DeInit(DMA2_Stream3);
-
-
-   DMA_InitStructure.DMA_Channel = DMA_Channel_4;
-   DMA_InitStructure.DMA_PeripheralBaseAddr = (uint32_t)&SDIO->FIFO;
-   DMA_InitStructure.DMA_Memory0BaseAddr = (uint32_t)mbuf;
-   DMA_InitStructure.DMA_DIR = dir;
-   DMA_InitStructure.DMA_BufferSize = 0;
-   DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
-   DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
-   DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
-   DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
-   DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
-   DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
-   DMA_InitStructure.DMA_FIFOMode = DMA_FIFOMode_Enable;
-   DMA_InitStructure.DMA_FIFOThreshold = DMA_FIFOThreshold_Full;
-   DMA_InitStructure.DMA_MemoryBurst = DMA_MemoryBurst_INC4;
-   DMA_InitStructure.DMA_PeripheralBurst = DMA_PeripheralBurst_INC4;
-   DMA_Init(DMA2_Stream3, &DMA_InitStructure);
+ //轮询等待DMA传输完成（bootloader不使用SDIO中断），等待期间调用SD_WaitHook
+ //stop=1时多块传输结束后发送CMD12
+ static SD_Error SD_WaitDMA(uint8_t stream,uint8_t stop)
+ {
+ 	SD_Error errorstatus=SD_OK;
+ 	uint32_t timeout=SDIO_DATATIMEOUT;
 
- 	DMA_FlowControllerConfig(DMA2_Stream3,DMA_FlowCtrl_Peripheral);
+ 	while(!(SDIO->STA&(SDIO_FLAG_DATAEND|SDIO_FLAG_DCRCFAIL|SDIO_FLAG_DTIMEOUT|SDIO_FLAG_TXUNDERR|SDIO_FLAG_RXOVERR|SDIO_FLAG_STBITERR)))
+ 	{
+ 		if(dma_get_interrupt_flag(DMA2,stream,DMA_TEIF)||(timeout==0))break;
+ 		timeout--;
+ 		if(SD_WaitHook)SD_WaitHook();
+ 	}
+ 	//读操作：DATAEND后DMA FIFO里可能还有数据
+ 	if((stream==SD_DMA_RX_STREAM)&&(SDIO->STA&SDIO_FLAG_DATAEND))
+ 	{
+ 		timeout=0X7FFFFF;
+ 		while(!dma_get_interrupt_flag(DMA2,stream,DMA_TCIF|DMA_TEIF)&&timeout)timeout--;
+ 	}
 
-   DMA_Cmd(DMA2_Stream3 ,ENABLE);*/
+ 	if(dma_get_interrupt_flag(DMA2,stream,DMA_TEIF))
+ 	{
+ 		DeviceMode=SD_POLLING_MODE;     //DMA出错，退回polling模式
+ 		errorstatus=SD_ERROR;
+ 	}else if(SDIO_GetFlagStatus(SDIO_FLAG_DTIMEOUT) != RESET)errorstatus=SD_DATA_TIMEOUT;
+ 	else if(SDIO_GetFlagStatus(SDIO_FLAG_DCRCFAIL) != RESET)errorstatus=SD_DATA_CRC_FAIL;
+ 	else if(SDIO_GetFlagStatus(SDIO_FLAG_RXOVERR) != RESET)errorstatus=SD_RX_OVERRUN;
+ 	else if(SDIO_GetFlagStatus(SDIO_FLAG_TXUNDERR) != RESET)errorstatus=SD_TX_UNDERRUN;
+ 	else if(SDIO_GetFlagStatus(SDIO_FLAG_STBITERR) != RESET)errorstatus=SD_START_BIT_ERR;
+ 	else if(SDIO_GetFlagStatus(SDIO_FLAG_DATAEND) == RESET)errorstatus=SD_DATA_TIMEOUT;
+
+ 	dma_disable_stream(DMA2,stream);
+ 	SDIO->DCTRL&=~(1<<3);
+
+ 	if(stop&&(SDIO_GetFlagStatus(SDIO_FLAG_DATAEND) != RESET))
+ 	{
+ 		if((SDIO_STD_CAPACITY_SD_CARD_V1_1==CardType)||(SDIO_STD_CAPACITY_SD_CARD_V2_0==CardType)||(SDIO_HIGH_CAPACITY_SD_CARD==CardType))
+ 		{
+ 			SDIO_CmdInitStructure.SDIO_Argument =0;
+ 			SDIO_CmdInitStructure.SDIO_CmdIndex = SD_CMD_STOP_TRANSMISSION;
+ 			SDIO_CmdInitStructure.SDIO_Response = SDIO_Response_Short;
+ 			SDIO_CmdInitStructure.SDIO_Wait = SDIO_Wait_No;
+ 			SDIO_CmdInitStructure.SDIO_CPSM = SDIO_CPSM_Enable;
+ 			SDIO_SendCommand(&SDIO_CmdInitStructure);
 
+ 			if(errorstatus==SD_OK)errorstatus=CmdResp1Error(SD_CMD_STOP_TRANSMISSION);
+ 		}
+ 	}
+ 	SDIO_ClearFlag(SDIO_STATIC_FLAGS);
+ 	return errorstatus;
  }
 
 
@@ -1574,7 +1742,9 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  	 	for(n=0;n<cnt;n++)
  		{
  		 	sta=SD_ReadBlock(SDIO_DATA_BUFFER,lsector+512*n,512);
+ 			if(sta!=SD_OK)break;
  			memcpy(buf,SDIO_DATA_BUFFER,512);
+ 			SD_BounceReads++;
  			buf+=512;
  		}
  	}else
@@ -1598,6 +1768,8 @@ SD_Error SD_ReadBlock(uint8_t *buf,long long addr,uint16_t blksize)
  		{
  			memcpy(SDIO_DATA_BUFFER,buf,512);
  		 	sta=SD_WriteBlock(SDIO_DATA_BUFFER,lsector+512*n,512);
+ 			if(sta!=SD_OK)break;
+ 			SD_BounceWrites++;
  			buf+=512;
  		}
  	}else
@@ -11,6 +11,8 @@
 
 #define SDIO_INIT_CLK_DIV        0x76
 #define SDIO_TRANSFER_CLK_DIV    0x00
+#define SDIO_CLK_KHZ             48000     //SDIOCLK，PLLQ输出
+#define SD_CLOCK_STEPS           5         //48(高速模式),24,12,6,3MHz
 #define SD_POLLING_MODE    	0
 #define SD_DMA_MODE    		1
 typedef enum
@@ -143,6 +145,12 @@ typedef struct
   uint8_t CardType;
 } SD_CardInfo;
 extern SD_CardInfo SDCardInfo;
+extern int (*SD_WaitHook)(void);
+extern uint32_t SD_BounceReads;
+extern uint32_t SD_BounceWrites;
+extern uint32_t SD_ClockKHz;
+extern uint8_t SD_HighSpeed;
+extern uint8_t SD_SpeedClass;
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #define SD_CMD_GO_IDLE_STATE                       ((uint8_t)0)
@@ -302,6 +310,7 @@ extern SD_CardInfo SDCardInfo;
 SD_Error SD_Deinit(void);
 SD_Error SD_Init(void);
 void SDIO_Clock_Set(uint8_t clkdiv);
+uint8_t SD_ClockStepDown(void);
 void Board_Deinit(void);
 SD_Error SD_PowerON(void);
 SD_Error SD_PowerOFF(void);
@@ -309,6 +318,7 @@ SD_Error SD_InitializeCards(void);
 SD_Error SD_GetCardInfo(SD_CardInfo *cardinfo);
 SD_Error SD_EnableWideBusOperation(uint32_t wmode);
 SD_Error SD_SetDeviceMode(uint32_t mode);
+uint32_t SD_GetDeviceMode(void);
 SD_Error SD_SelectDeselect(uint32_t addr);
 SD_Error SD_SendStatus(uint32_t *pcardstatus);
 SDCardState SD_GetState(void);
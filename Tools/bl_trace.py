@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+############################################################################
+#
+#   Copyright (C) 2016 PX4 Development Team. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in
+#    the documentation and/or other materials provided with the
+#    distribution.
+# 3. Neither the name PX4 nor the names of its contributors may be
+#    used to endorse or promote products derived from this software
+#    without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+# OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+# ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+############################################################################
+
+
+#
+# Fetch and decode the bootloader's boot-phase trace ring (trace.c).
+#
+#   Tools/bl_trace.py --port /dev/ttyACM0     read it with GET_DEVICE/TRACE
+#   Tools/bl_trace.py --file trace.bin        decode a saved dump
+#   Tools/bl_trace.py --port ... --sd         SD card retry counters instead
+#
+# Times are relative to the reset entry of each boot.  The cycle counter
+# runs at the clock in force before each entry, so the step up to the
+# "clock" entry is counted at the reset clock (16 MHz HSI).
+#
+
+import argparse
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from sim_upload import Link, GET_DEVICE, EOC  # noqa: E402
+
+DEVICE_TRACE = 8
+DEVICE_SD_ERRORS = 10
+TRACE_BL_REV = 9
+SD_ERRORS_BL_REV = 11
+TRACE_MAGIC = 0x42544231
+
+HEADER = struct.Struct('<IHHHHI')
+ENTRY = struct.Struct('<IBBH')
+
+# enum trace_id in trace.h
+NAMES = {
+    1: 'reset',
+    2: 'clock',
+    3: 'board',
+    4: 'sd power',
+    5: 'sd init',
+    6: 'sd mount',
+    7: 'sd absent',
+    8: 'upload',
+    9: 'upload done',
+    10: 'backup',
+    11: 'backup done',
+    12: 'bootloader',
+    13: 'jump',
+    14: 'verify',
+}
+
+# SD_Error in SD_Card.h, as counted by diskio.c; 0 is anything else
+SD_ERRORS = {
+    0: 'other',
+    1: 'cmd crc',
+    2: 'data crc',
+    3: 'cmd timeout',
+    4: 'data timeout',
+    5: 'tx underrun',
+    6: 'rx overrun',
+    7: 'start bit',
+    28: 'addr out of range',
+    38: 'invalid parameter',
+    41: 'error',
+}
+
+
+def fetch_sd(port):
+    link = Link(port, 10.0)
+    link.sync()
+    if link.get_device(1) < SD_ERRORS_BL_REV:
+        raise RuntimeError("bootloader has no SD error counters")
+    link.send([GET_DEVICE, DEVICE_SD_ERRORS, EOC])
+    length = int.from_bytes(link.recv(4), 'little')
+    data = link.recv(length)
+    link.get_sync()
+
+    retries, slowdowns, reinits, failed = struct.unpack_from('<4I', data)
+    print("retries %u, slowdowns %u, reinits %u%s" % (retries, slowdowns, reinits, ", given up" if failed else ""))
+    errors = struct.unpack_from('<%uH' % ((length - 16) // 2), data, 16)
+    for code, count in enumerate(errors):
+        if count:
+            print("  %-18s %u" % (SD_ERRORS.get(code, 'SD_Error %u' % code), count))
+
+
+def fetch(port):
+    link = Link(port, 10.0)
+    link.sync()
+    if link.get_device(1) < TRACE_BL_REV:
+        raise RuntimeError("bootloader has no trace")
+    link.send([GET_DEVICE, DEVICE_TRACE, EOC])
+    length = int.from_bytes(link.recv(4), 'little')
+    data = link.recv(length)
+    link.get_sync()
+    return data
+
+
+def decode(data):
+    magic, boot, head, count, size, _ = HEADER.unpack_from(data)
+    if magic != TRACE_MAGIC or count > size:
+        raise RuntimeError("no trace ring in the dump")
+    entries = []
+    for i in range(count):
+        index = (head - count + i) % size
+        entries.append(ENTRY.unpack_from(data, HEADER.size + index * ENTRY.size))
+
+    last_boot = None
+    for cycles, ident, mhz, b in entries:
+        if b != last_boot or ident == 1:
+            print("boot %u%s" % (b, " (current)" if b == boot else ""))
+            last_boot, t, prev_cycles, prev_mhz = b, 0.0, cycles, mhz
+        step = ((cycles - prev_cycles) & 0xffffffff) / prev_mhz / 1000.0
+        t += step
+        print("  %-12s %10.3f ms  +%.3f" % (NAMES.get(ident, 'id %u' % ident), t, step))
+        prev_cycles, prev_mhz = cycles, mhz
+
+
+def main():
+    parser = argparse.ArgumentParser(description="decode the bootloader boot-phase trace")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument('--port', help="bootloader serial port or simulation pty")
+    source.add_argument('--file', help="raw trace ring saved earlier")
+    parser.add_argument('--save', help="also write the raw ring to this file")
+    parser.add_argument('--sd', action='store_true', help="print the SD card retry counters instead")
+    args = parser.parse_args()
+
+    if args.sd:
+        if not args.port:
+            parser.error("--sd needs --port")
+        fetch_sd(args.port)
+        return
+
+    data = fetch(args.port) if args.port else open(args.file, 'rb').read()
+    if args.save:
+        open(args.save, 'wb').write(data)
+    decode(data)
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except RuntimeError as e:
+        print("bl_trace: %s" % e)
+        sys.exit(1)
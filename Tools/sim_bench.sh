@@ -0,0 +1,152 @@
+#!/usr/bin/env bash
+#
+# Run the bootloader host simulation through an SD update, updates from a
+# flaky and a dead card, a backup, an A/B rollback and confirm, image
+# digest checks, a compressed SD update, a copy onto the card in USB disk mode, a serial
+# upload, a delta upload of a one-byte change and plain, compressed and
+# lazily erased uploads over a 57600 baud link, printing the per-phase
+# timing report of each run, after the host flash access kernels.
+#
+# usage: Tools/sim_bench.sh [fw_kbytes]
+#
+
+set -e
+
+BL_BASE=$(cd "$(dirname "$0")/.." && pwd)
+SIM=$BL_BASE/px4sim_bl.elf
+FW_KB=${1:-1024}
+WORK=$(mktemp -d)
+
+trap 'kill $SIM_PID 2>/dev/null || true; rm -rf "$WORK"' EXIT
+
+[ -x "$SIM" ] || make -C "$BL_BASE" px4sim_bl
+
+# random image with a plausible vector table: stack in SRAM, reset in flash
+python3 - "$WORK/fw.bin" "$FW_KB" <<'EOF'
+import os, struct, sys
+size = int(sys.argv[2]) * 1024
+open(sys.argv[1], 'wb').write(struct.pack('<II', 0x20030000, 0x08008201) + os.urandom(size - 8))
+EOF
+
+cd "$WORK"
+
+echo "== flash access kernels"
+"$SIM" -f blank.bin flash 16 | grep -a "^flash "
+
+echo "== SD update"
+"$SIM" -c card.img -s 64 -f flash.bin put fw.bin fw.bin boot
+
+echo "== SD update, flaky card"
+# the card fails five accesses in a row, the retry ladder gets past them
+"$SIM" -c flaky.img -s 64 -f flaky.bin -E 10:5 put fw.bin fw.bin boot
+
+echo "== SD update, dead card"
+# the card is given up and the app flashed above still boots
+"$SIM" -c flaky.img -f flaky.bin -E 0:1000 put fw.bin fw.bin boot | tee dead.txt
+grep -aq "given up" dead.txt && grep -aq "jumps: 1" dead.txt
+
+echo "== backup"
+"$SIM" -c card.img -f flash.bin backup get backup.bin backup.bin
+cmp -n "$(stat -c %s fw.bin)" fw.bin backup.bin
+
+echo "== A/B slots"
+# an update nobody confirms is rolled back after three trial boots, a
+# confirmed one stays
+python3 - fw.bin fwb.bin <<'EOF'
+import sys
+d = bytearray(open(sys.argv[1], 'rb').read())
+d[len(d) // 3] ^= 0xff
+open(sys.argv[2], 'wb').write(d)
+EOF
+"$SIM" -c ab.img -s 64 -f abflash.bin put fw.bin fw.bin boot 2>&1 | grep -a "jump to app" | tee ab.txt
+"$SIM" -c ab.img -f abflash.bin put fwb.bin fw.bin boot boot boot boot 2>&1 | grep -a "jump to app" | tee -a ab.txt
+[ "$(head -n 1 ab.txt)" = "$(tail -n 1 ab.txt)" ]
+"$SIM" -c ab.img -f abflash.bin put fwb.bin fw.bin boot confirm boot boot boot boot 2>&1 | grep -a "jump to app" | tee -a ab.txt
+[ "$(tail -n 1 ab.txt)" != "$(head -n 1 ab.txt)" ]
+"$SIM" -c ab.img -f abflash.bin backup get backup.bin abbackup.bin > /dev/null
+cmp -n "$(stat -c %s fwb.bin)" fwb.bin abbackup.bin
+
+echo "== image digest"
+# a new image is hashed on its first boot only, a corrupted one is refused
+python3 "$BL_BASE/px_mkfw.py" --image fw.bin --digest fwd.bin > /dev/null
+"$SIM" -c dg.img -s 64 -f dgflash.bin put fwd.bin fw.bin boot boot | tee dg.txt
+grep -aq "jumps: 2" dg.txt
+python3 - fwd.bin fwbad.bin <<'EOF'
+import sys
+d = bytearray(open(sys.argv[1], 'rb').read())
+d[len(d) // 2] ^= 0x01
+open(sys.argv[2], 'wb').write(d)
+EOF
+"$SIM" -c dg.img -f dgflash.bin put fwbad.bin fw.bin boot | tee dg.txt
+grep -aq "jumps: 0" dg.txt
+# SET_DELAY after a serial upload does not break the digest, not even
+# once a cold boot has lost the verified flag
+python3 - fw.bin fwdly.bin <<'EOF'
+import struct, sys
+d = bytearray(open(sys.argv[1], 'rb').read())
+d[0x1a0:0x1a8] = struct.pack('<II', 0x92c2ecff, 0xc5057d5d)
+open(sys.argv[2], 'wb').write(d)
+EOF
+python3 "$BL_BASE/px_mkfw.py" --image fwdly.bin --digest fwdd.bin > /dev/null
+"$SIM" -c dly.img -s 16 -f dlyflash.bin -p link bl > dg.txt &
+SIM_PID=$!
+python3 "$BL_BASE/Tools/sim_upload.py" --port link --delay 1 fwdd.bin
+wait $SIM_PID
+"$SIM" -c dly.img -f dlyflash.bin boot >> dg.txt
+[ "$(grep -ac "jumps: 1" dg.txt)" = 2 ]
+
+echo "== compressed SD update"
+# random data does not compress; the simulator's own code stands in for firmware
+python3 - lz.bin "$FW_KB" "$SIM" <<'EOF'
+import struct, sys
+code = open(sys.argv[3], 'rb').read()
+size = int(sys.argv[2]) * 1024
+image = struct.pack('<II', 0x20030000, 0x08008201) + code * (size // len(code) + 1)
+open(sys.argv[1], 'wb').write(image[:size])
+EOF
+python3 "$BL_BASE/px_mkfw.py" --image lz.bin --lz fw.lz > /dev/null
+echo "fw.lz: $(stat -c %s fw.lz) of $(stat -c %s lz.bin) bytes"
+"$SIM" -c lz.img -s 64 -f lzflash.bin put fw.lz fw.lz boot
+"$SIM" -c lz.img -f lzflash.bin backup get backup.bin lzbackup.bin > /dev/null
+cmp -n "$(stat -c %s lz.bin)" lz.bin lzbackup.bin
+
+echo "== USB disk"
+# the host side builds the card it wants, the bootloader exposes its own
+"$SIM" -c usb.img -s 16 -f usbflash.bin put fw.bin fw.bin > /dev/null
+rm -f usbflash.bin
+"$SIM" -c msc.img -s 16 -f usbflash.bin -p link msc boot &
+SIM_PID=$!
+python3 "$BL_BASE/Tools/sim_msc.py" --port link usb.img
+wait $SIM_PID
+"$SIM" -c msc.img -f usbflash.bin backup get backup.bin usbbackup.bin > /dev/null
+cmp -n "$(stat -c %s fw.bin)" fw.bin usbbackup.bin
+
+echo "== serial upload"
+rm -f flash.bin
+"$SIM" -c card.img -f flash.bin -p link bl &
+SIM_PID=$!
+python3 "$BL_BASE/Tools/sim_upload.py" --port link fw.bin
+wait $SIM_PID
+
+echo "== delta serial upload"
+python3 - fw.bin <<'EOF'
+import sys
+d = bytearray(open(sys.argv[1], 'rb').read())
+d[len(d) // 2] ^= 0xff
+open(sys.argv[1], 'wb').write(d)
+EOF
+"$SIM" -c card.img -f flash.bin -p link bl &
+SIM_PID=$!
+python3 "$BL_BASE/Tools/sim_upload.py" --port link --delta fw.bin
+wait $SIM_PID
+
+# a 57600 baud radio link, 10 bits per byte; the later runs go over the
+# images the earlier ones left in the other slot
+for mode in "" --compress --lazy; do
+	echo "== serial upload at 57600 ${mode}"
+	[ -n "$mode" ] || rm -f flash.bin
+	"$SIM" -c card.img -f flash.bin -p link -C link=173611 bl &
+	SIM_PID=$!
+	python3 "$BL_BASE/Tools/sim_upload.py" --port link $mode lz.bin
+	wait $SIM_PID
+done
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+############################################################################
+#
+#   Copyright (C) 2016 PX4 Development Team. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in
+#    the documentation and/or other materials provided with the
+#    distribution.
+# 3. Neither the name PX4 nor the names of its contributors may be
+#    used to endorse or promote products derived from this software
+#    without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+# OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+# ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+############################################################################
+
+
+#
+# USB mass storage host for the bootloader simulation's "msc" mode.
+#
+# Speaks bulk-only transport over the pty created by
+# "px4sim_bl.elf -p <link> msc" and makes the simulated card match a card
+# image built on the host: the card is read in large READ(10)s, only the
+# chunks that differ are written with WRITE(10), and the disk is ejected
+# so the simulator goes on to SD_upload().
+#
+
+import argparse
+import os
+import struct
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from sim_upload import Link  # noqa: E402
+
+CBW_SIGNATURE = 0x43425355
+CSW_SIGNATURE = 0x53425355
+
+INQUIRY = 0x12
+START_STOP_UNIT = 0x1b
+READ_CAPACITY_10 = 0x25
+READ_10 = 0x28
+WRITE_10 = 0x2a
+SYNCHRONIZE_CACHE = 0x35
+
+BLOCK = 512
+CHUNK = 128             # blocks per READ(10)/WRITE(10), as a host would
+
+
+class Disk(object):
+
+    def __init__(self, link):
+        self.link = link
+        self.tag = 0
+
+    def command(self, cb, data_in=0, data_out=b''):
+        self.tag += 1
+        length = data_in or len(data_out)
+        flags = 0x80 if data_in else 0
+        cb = bytes(cb) + bytes(16 - len(cb))
+        self.link.send(struct.pack('<IIIBBB', CBW_SIGNATURE, self.tag, length, flags, 0, len(cb)) + cb)
+        data = b''
+        if data_in:
+            data = self.link.recv(data_in, 30.0)
+        elif data_out:
+            self.link.send(data_out)
+        signature, tag, residue, status = struct.unpack('<IIIB', self.link.recv(13, 30.0))
+        if signature != CSW_SIGNATURE or tag != self.tag:
+            raise RuntimeError("bad CSW for command 0x%02x" % cb[0])
+        if status:
+            raise RuntimeError("command 0x%02x failed" % cb[0])
+        return data[:len(data) - residue] if data_in else data
+
+    def read(self, lba, count):
+        return self.command(struct.pack('>BBIBH', READ_10, 0, lba, 0, count), data_in=count * BLOCK)
+
+    def write(self, lba, data):
+        self.command(struct.pack('>BBIBH', WRITE_10, 0, lba, 0, len(data) // BLOCK), data_out=data)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="copy a card image onto the bootloader simulation's USB disk")
+    parser.add_argument('--port', required=True, help="pty link created by px4sim_bl.elf -p")
+    parser.add_argument('image', help="card image the simulated card should end up as")
+    args = parser.parse_args()
+
+    image = open(args.image, 'rb').read()
+    disk = Disk(Link(args.port, 10.0))
+    start = time.time()
+
+    inquiry = disk.command([INQUIRY, 0, 0, 0, 36, 0], data_in=36)
+    last, size = struct.unpack('>II', disk.command([READ_CAPACITY_10] + [0] * 9, data_in=8))
+    print("%s: %u blocks of %u" % (inquiry[8:36].decode('ascii').strip(), last + 1, size))
+    if size != BLOCK or (last + 1) * BLOCK != len(image):
+        raise RuntimeError("the image is %u bytes, the card %u" % (len(image), (last + 1) * size))
+
+    written = 0
+    for lba in range(0, last + 1, CHUNK):
+        count = min(CHUNK, last + 1 - lba)
+        want = image[lba * BLOCK:(lba + count) * BLOCK]
+        if disk.read(lba, count) != want:
+            disk.write(lba, want)
+            written += len(want)
+
+    disk.command([SYNCHRONIZE_CACHE] + [0] * 9)
+    disk.command([START_STOP_UNIT, 0, 0, 0, 0x02, 0])
+    print("read %u bytes, wrote %u in %.3fs, ejected" % (len(image), written, time.time() - start))
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except RuntimeError as e:
+        print("sim_msc: %s" % e)
+        sys.exit(1)
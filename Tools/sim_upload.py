@@ -0,0 +1,308 @@
+#!/usr/bin/env python3
+############################################################################
+#
+#   Copyright (C) 2016 PX4 Development Team. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in
+#    the documentation and/or other materials provided with the
+#    distribution.
+# 3. Neither the name PX4 nor the names of its contributors may be
+#    used to endorse or promote products derived from this software
+#    without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+# OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+# ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+############################################################################
+
+#
+# Minimal bootloader protocol client for the host simulation (px4sim_bl).
+#
+# Talks to the pty created by "px4sim_bl.elf -p <link> bl"; needs nothing
+# beyond the python standard library so it can run in CI.
+#
+
+import argparse
+import os
+import select
+import sys
+import termios
+import time
+import tty
+import zlib
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from px_lz import lz_compress  # noqa: E402
+
+INSYNC = 0x12
+EOC = 0x20
+OK = 0x10
+FAILED = 0x11
+INVALID = 0x13
+
+GET_SYNC = 0x21
+GET_DEVICE = 0x22
+CHIP_ERASE = 0x23
+PROG_MULTI = 0x27
+GET_CRC = 0x29
+SET_DELAY = 0x2d
+BOOT = 0x30
+GET_SECTOR_CRC = 0x32
+ERASE_SECTOR = 0x33
+PROG_BULK = 0x34
+PROG_STREAM = 0x35
+PROG_COMPRESSED = 0x36
+LAZY_ERASE = 0x37
+
+DEVICE_BL_REV = 1
+DEVICE_BOARD_ID = 2
+DEVICE_FW_SIZE = 4
+DEVICE_PROG_BULK_MAX = 6
+DEVICE_STREAM_WINDOW = 7
+DEVICE_COMPRESSED = 9
+
+PROG_MULTI_MAX = 64
+
+DELTA_BL_REV = 6
+BULK_BL_REV = 7
+STREAM_BL_REV = 8
+COMPRESSED_BL_REV = 10
+LAZY_BL_REV = 12
+
+
+class Link(object):
+
+    def __init__(self, path, timeout):
+        deadline = time.time() + timeout
+        while not os.path.exists(path):
+            if time.time() > deadline:
+                raise RuntimeError("no link at %s" % path)
+            time.sleep(0.05)
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        termios.tcflush(self.fd, termios.TCIOFLUSH)
+        self.bulk_max = 0
+        self.window = 0
+        self.compress = False
+        self.sent = 0
+
+    def send(self, data):
+        self.sent += len(data)
+        os.write(self.fd, bytes(data))
+
+    def recv(self, count, timeout=5.0):
+        data = b''
+        deadline = time.time() + timeout
+        while len(data) < count:
+            left = deadline - time.time()
+            if left <= 0 or not select.select([self.fd], [], [], left)[0]:
+                raise RuntimeError("timeout, got %r" % data)
+            data += os.read(self.fd, count - len(data))
+        return data
+
+    def get_sync(self, timeout=5.0):
+        c = self.recv(2, timeout)
+        if c[0] != INSYNC:
+            raise RuntimeError("expected INSYNC, got 0x%02x" % c[0])
+        if c[1] == INVALID:
+            raise RuntimeError("bootloader reports INVALID")
+        if c[1] == FAILED:
+            raise RuntimeError("bootloader reports FAILED")
+        if c[1] != OK:
+            raise RuntimeError("expected OK, got 0x%02x" % c[1])
+
+    def sync(self):
+        # the bootloader may still be busy with a previous command
+        for _ in range(10):
+            self.send([GET_SYNC, EOC])
+            try:
+                self.get_sync(0.5)
+                return
+            except RuntimeError:
+                termios.tcflush(self.fd, termios.TCIFLUSH)
+        raise RuntimeError("cannot sync")
+
+    def get_device(self, param):
+        self.send([GET_DEVICE, param, EOC])
+        value = int.from_bytes(self.recv(4), 'little')
+        self.get_sync()
+        return value
+
+    def get_sector_crc(self, sector):
+        self.send([GET_SECTOR_CRC, sector, EOC])
+        crc = int.from_bytes(self.recv(4, 30.0), 'little')
+        size = int.from_bytes(self.recv(4), 'little')
+        self.get_sync()
+        return crc, size
+
+    def stream(self, data):
+        frames = [data[o:o + self.bulk_max] for o in range(0, len(data), self.bulk_max)]
+        acked = 0       # frames acknowledged
+        sent = 0        # frames sent
+        while acked < len(frames):
+            while sent < len(frames) and sent - acked < self.window:
+                chunk = frames[sent]
+                self.send(bytes([PROG_STREAM, sent & 0xff]) + len(chunk).to_bytes(2, 'little') + chunk +
+                          crc32(chunk).to_bytes(4, 'little') + bytes([EOC]))
+                sent += 1
+            seq, sync, status = self.recv(3, 30.0)
+            if sync != INSYNC:
+                raise RuntimeError("bad stream ack %02x %02x %02x" % (seq, sync, status))
+            index = acked + ((seq - acked) & 0xff)
+            if index > sent:
+                # stale ack for frames we have already gone back over
+                continue
+            if status == OK:
+                # cumulative: everything up to seq is programmed
+                acked = index + 1
+            elif status == INVALID:
+                # go back to the frame the bootloader expects
+                acked = sent = index
+            else:
+                raise RuntimeError("stream frame %u failed" % index)
+
+    def program(self, data):
+        if self.compress:
+            # one LZ stream per call, it starts over after any other command
+            packed = lz_compress(data)
+            for offset in range(0, len(packed), self.bulk_max):
+                chunk = packed[offset:offset + self.bulk_max]
+                self.send(bytes([PROG_COMPRESSED]) + len(chunk).to_bytes(2, 'little') + chunk +
+                          crc32(chunk).to_bytes(4, 'little') + bytes([EOC]))
+                self.get_sync(30.0)
+            return
+        if self.window:
+            self.stream(data)
+            return
+        if self.bulk_max:
+            for offset in range(0, len(data), self.bulk_max):
+                chunk = data[offset:offset + self.bulk_max]
+                self.send(bytes([PROG_BULK]) + len(chunk).to_bytes(2, 'little') + chunk +
+                          crc32(chunk).to_bytes(4, 'little') + bytes([EOC]))
+                self.get_sync()
+            return
+        for offset in range(0, len(data), PROG_MULTI_MAX):
+            chunk = data[offset:offset + PROG_MULTI_MAX]
+            self.send(bytes([PROG_MULTI, len(chunk)]) + chunk + bytes([EOC]))
+            self.get_sync()
+
+
+def crc32(data):
+    # bl.c starts from 0 and does not invert
+    return zlib.crc32(data, 0xffffffff) ^ 0xffffffff
+
+
+def main():
+    parser = argparse.ArgumentParser(description="upload firmware to the bootloader simulation")
+    parser.add_argument('--port', required=True, help="pty link created by px4sim_bl.elf -p")
+    parser.add_argument('--no-boot', action='store_true', help="leave the bootloader running")
+    parser.add_argument('--delta', action='store_true', help="only erase and program the sectors that differ")
+    parser.add_argument('--frame', type=int, default=None,
+                        help="PROG_BULK frame size, 0 for PROG_MULTI (default: the bootloader's maximum)")
+    parser.add_argument('--window', type=int, default=None,
+                        help="PROG_STREAM frames in flight, 0 for PROG_BULK (default: the bootloader's window)")
+    parser.add_argument('--compress', action='store_true', help="send LZ-compressed PROG_COMPRESSED frames")
+    parser.add_argument('--lazy', action='store_true', help="erase each sector as the upload reaches it")
+    parser.add_argument('--delay', type=int, default=None,
+                        help="set the boot delay in seconds; the image needs the boot delay signature at 0x1a0")
+    parser.add_argument('firmware', help="raw firmware binary")
+    args = parser.parse_args()
+
+    fw = open(args.firmware, 'rb').read()
+    fw += b'\xff' * (-len(fw) % 4)
+
+    link = Link(args.port, 10.0)
+    start = time.time()
+    link.sync()
+
+    rev = link.get_device(DEVICE_BL_REV)
+    board = link.get_device(DEVICE_BOARD_ID)
+    fw_size = link.get_device(DEVICE_FW_SIZE)
+    print("bl rev %u, board %u, fw_size %u" % (rev, board, fw_size))
+
+    if rev >= BULK_BL_REV and args.frame != 0:
+        link.bulk_max = link.get_device(DEVICE_PROG_BULK_MAX)
+        if args.frame is not None:
+            link.bulk_max = min(link.bulk_max, args.frame & ~3)
+
+    if rev >= STREAM_BL_REV and link.bulk_max and args.window != 0:
+        link.window = link.get_device(DEVICE_STREAM_WINDOW)
+        if args.window is not None:
+            link.window = min(link.window, args.window)
+
+    if args.compress and rev >= COMPRESSED_BL_REV and link.bulk_max:
+        link.compress = link.get_device(DEVICE_COMPRESSED) != 0
+
+    if len(fw) > fw_size:
+        raise RuntimeError("firmware too large")
+
+    if args.delta and rev >= DELTA_BL_REV:
+        image = fw + b'\xff' * (fw_size - len(fw))
+        sectors = []
+        offset = 0
+        while True:
+            crc, size = link.get_sector_crc(len(sectors))
+            if size == 0:
+                break
+            sectors.append((offset, size, crc32(image[offset:offset + size]) != crc))
+            offset += size
+
+        # sector 0 holds the vectors and always goes first
+        changed = [i for i, s in enumerate(sectors) if s[2]]
+        if changed and changed[0] != 0:
+            changed.insert(0, 0)
+        print("delta: %u of %u sectors changed" % (len(changed), len(sectors)))
+
+        for i in changed:
+            offset, size = sectors[i][0], sectors[i][1]
+            link.send([ERASE_SECTOR, i, EOC])
+            link.get_sync(60.0)
+            link.program(fw[offset:offset + size])
+    else:
+        lazy = args.lazy and rev >= LAZY_BL_REV
+        link.send([LAZY_ERASE if lazy else CHIP_ERASE, EOC])
+        link.recv(2, 60.0)		# backup response
+        link.get_sync(60.0)
+        link.program(fw)
+
+    link.send([GET_CRC, EOC])
+    crc = int.from_bytes(link.recv(4, 30.0), 'little')
+    link.get_sync()
+    expect = crc32(fw + b'\xff' * (fw_size - len(fw)))
+    if crc != expect:
+        raise RuntimeError("CRC mismatch: 0x%08x != 0x%08x" % (crc, expect))
+
+    if args.delay is not None:
+        link.send([SET_DELAY, args.delay, EOC])
+        link.get_sync()
+
+    if not args.no_boot:
+        link.send([BOOT, EOC])
+        link.get_sync()
+
+    print("uploaded %u bytes in %.3fs, crc 0x%08x, %u bytes sent" % (len(fw), time.time() - start, crc, link.sent))
+
+
+if __name__ == '__main__':
+    try:
+        main()
+    except RuntimeError as e:
+        print("sim_upload: %s" % e)
+        sys.exit(1)
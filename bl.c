@@ -53,7 +53,11 @@
 #include "bl.h"
 #include "cdcacm.h"
 #include "uart.h"
+#include "crc32.h"
+#include "lz.h"
+#include "trace.h"
 #include "ff.h"
+#include "diskio.h"
 #include "SD_Card.h"
 
 // bootloader flash update protocol.
@@ -80,8 +84,35 @@
 // GET_CRC		verify CRC of entire flashable area
 // RESET		finalise flash programming, reset chip and starts application
 //
+// A delta upload (protocol 6) replaces CHIP_ERASE with:
+//
+// GET_SECTOR_CRC	for each sector, compare with the new image
+// ERASE_SECTOR		sector 0 first, then every sector that differs
+// loop:
+//      PROG_MULTI      program the bytes of that sector
+//
+// Protocol 7 adds PROG_BULK, which can replace PROG_MULTI in either loop
+// when GET_DEVICE/PROG_BULK_MAX returns a non-zero frame size.  F1 returns
+// 0 and does not build it in.
+//
+// Protocol 8 adds PROG_STREAM for the same loops: the host keeps up to
+// GET_DEVICE/STREAM_WINDOW frames in flight and the bootloader
+// acknowledges them cumulatively while it programs.  A window of 0 (F1)
+// means PROG_STREAM is not built in.
+//
+// Protocol 10 adds PROG_COMPRESSED, frames of an LZ stream (lz.h) of the
+// image, when GET_DEVICE/COMPRESSED returns a non-zero window.
+//
+// Protocol 11 adds GET_DEVICE/SD_ERRORS, the SD card retry counters
+// (struct disk_stats in diskio.h).
+//
+// Protocol 12 adds LAZY_ERASE, which can replace CHIP_ERASE: each sector
+// is erased when the program address first reaches it, while the frame is
+// still coming in, and sectors past the image are only erased by GET_CRC
+// if they are not blank already.
+//
 
-#define BL_PROTOCOL_VERSION 		5		// The revision of the bootloader protocol
+#define BL_PROTOCOL_VERSION 		12		// The revision of the bootloader protocol
 // protocol bytes
 #define PROTO_INSYNC				0x12    // 'in sync' byte sent before status
 #define PROTO_EOC					0x20    // end of command
@@ -105,8 +136,52 @@
 #define PROTO_GET_CHIP_DES			0x2e    // read chip version In ASCII
 #define PROTO_BOOT					0x30    // boot the application
 #define PROTO_DEBUG					0x31    // emit debug information - format not defined
+#define PROTO_GET_SECTOR_CRC		0x32	// compute & return the CRC and size of one sector
+#define PROTO_ERASE_SECTOR			0x33	// erase one sector and set program address to its start
+#define PROTO_PROG_BULK				0x34	// write a CRC-checked frame at program address and increment
+#define PROTO_PROG_STREAM			0x35	// queue a sequence-numbered frame, acknowledged later
+#define PROTO_PROG_COMPRESSED		0x36	// decode a frame of an LZ stream at program address and increment
+#define PROTO_LAZY_ERASE			0x37	// reset program address, erase each sector as it is reached
 
 #define PROTO_PROG_MULTI_MAX    64	// maximum PROG_MULTI size
+#ifndef PROTO_PROG_BULK_MAX
+# if defined(STM32F1)
+#  define PROTO_PROG_BULK_MAX	0	// no room for a frame buffer on F1, hosts use PROG_MULTI
+# else
+#  define PROTO_PROG_BULK_MAX	4096	// maximum PROG_BULK size
+# endif
+#endif
+#ifndef PROTO_STREAM_WINDOW
+# if defined(STM32F1)
+#  define PROTO_STREAM_WINDOW	0	// no room for a frame ring on F1
+# else
+#  define PROTO_STREAM_WINDOW	4	// PROG_STREAM frames in flight
+# endif
+#endif
+#ifndef PROTO_COMPRESSED_WINDOW
+# if defined(STM32F1)
+#  define PROTO_COMPRESSED_WINDOW	0	// no room for the LZ window on F1
+# else
+#  define PROTO_COMPRESSED_WINDOW	LZ_WINDOW	// PROG_COMPRESSED match window
+# endif
+#endif
+#if (PROTO_STREAM_WINDOW || PROTO_COMPRESSED_WINDOW) && !PROTO_PROG_BULK_MAX
+# error PROG_STREAM and PROG_COMPRESSED receive into the PROG_BULK frame buffer
+#endif
+#ifndef BL_RX_BUF_SIZE
+# if defined(STM32F1)
+#  define BL_RX_BUF_SIZE	256	// USB receive ring, a power of two
+# else
+#  define BL_RX_BUF_SIZE	8192	// room for a whole PROG_BULK frame while the last one programs
+# endif
+#endif
+#if BL_RX_BUF_SIZE & (BL_RX_BUF_SIZE - 1)
+# error BL_RX_BUF_SIZE must be a power of two
+#endif
+#if defined(BOARD_USART_DMA) && \
+    UART_RX_RING < (PROTO_PROG_BULK_MAX + 8) * (PROTO_STREAM_WINDOW ? PROTO_STREAM_WINDOW : 1)
+# error UART_RX_RING must hold every PROG_STREAM frame the host may have in flight
+#endif
 #define PROTO_READ_MULTI_MAX    255	// size of the size field
 
 /* argument values for PROTO_GET_DEVICE */
@@ -115,6 +190,11 @@
 #define PROTO_DEVICE_BOARD_REV	3	// board revision
 #define PROTO_DEVICE_FW_SIZE	4	// size of flashable area
 #define PROTO_DEVICE_VEC_AREA	5	// contents of reserved vectors 7-10
+#define PROTO_DEVICE_PROG_BULK_MAX	6	// largest PROG_BULK frame
+#define PROTO_DEVICE_STREAM_WINDOW	7	// PROG_STREAM frames in flight
+#define PROTO_DEVICE_TRACE	8	// boot-phase trace ring, see trace.c
+#define PROTO_DEVICE_COMPRESSED	9	// PROG_COMPRESSED window, 0 if not supported
+#define PROTO_DEVICE_SD_ERRORS	10	// SD card retry counters, see diskio.c
 
 //自定义
 #define BACKUP_OK_RESPONSE 0x40        //backupok+ok   0x40+0x10
@@ -123,7 +203,6 @@
 
 static uint8_t bl_type;
 static uint8_t last_input;
-extern FIL backupfile;
 
 inline void cinit(void *config, uint8_t interface)
 {
@@ -205,12 +284,47 @@ inline void cout(uint8_t *buf, unsigned len)
 
 static const uint32_t	bl_proto_rev = BL_PROTOCOL_VERSION;	// value returned by PROTO_DEVICE_BL_REV
 
+static const uint32_t	prog_bulk_max = PROTO_PROG_BULK_MAX;	// value returned by PROTO_DEVICE_PROG_BULK_MAX
+static const uint32_t	stream_window = PROTO_STREAM_WINDOW;	// value returned by PROTO_DEVICE_STREAM_WINDOW
+static const uint32_t	compressed_window = PROTO_COMPRESSED_WINDOW;	// value returned by PROTO_DEVICE_COMPRESSED
+
 static unsigned head, tail;
-static uint8_t rx_buf[256];
+static uint8_t rx_buf[BL_RX_BUF_SIZE];
+
+#if PROTO_PROG_BULK_MAX
+/* PROG_STREAM ring; PROG_BULK uses the first slot once the ring is drained */
+static union {
+	uint8_t		c[PROTO_PROG_BULK_MAX];
+	uint32_t	w[PROTO_PROG_BULK_MAX / 4];
+} frame_buffer[PROTO_STREAM_WINDOW ? PROTO_STREAM_WINDOW : 1];
+#endif
+
+#if PROTO_STREAM_WINDOW
+static struct {
+	uint32_t	address;	// where the frame goes
+	uint32_t	crc;		// CRC of the flash once it is programmed
+	uint16_t	len;
+	uint16_t	done;		// bytes programmed so far
+	uint8_t		seq;
+} stream_frame[PROTO_STREAM_WINDOW];
+
+static unsigned stream_head, stream_tail;	// frames queued, frames programmed
+static unsigned stream_unacked;			// frames programmed since the last ack
+static uint8_t stream_seq;			// next sequence number expected
+static uint8_t stream_done_seq;			// last frame programmed
+static bool stream_failed;
+#endif
+
+#if PROTO_COMPRESSED_WINDOW
+static struct lz_state prog_lz;			// PROG_COMPRESSED decoder
+static unsigned prog_lz_tail;			// bytes decoded past the last whole word
+static bool prog_lz_dropped;			// a frame failed part way, refuse the rest of the stream
+#endif
 
 static enum led_state {LED_BLINK, LED_ON, LED_OFF} _led_state;
 
 void sys_tick_handler(void);
+static bool lazy_erase_step(uint32_t end);
 
 void
 buf_put(uint8_t b)
@@ -236,6 +350,14 @@ buf_get(void)
 	return ret;
 }
 
+/* bytes buf_put() can still take */
+unsigned
+buf_free(void)
+{
+	return (tail - head - 1) % sizeof(rx_buf);
+}
+
+#if !defined(TARGET_HW_PX4_SIM)
 static void
 do_jump(uint32_t stacktop, uint32_t entrypoint)
 {
@@ -247,12 +369,13 @@ do_jump(uint32_t stacktop, uint32_t entrypoint)
 	// just to keep noreturn happy
 	for (;;) ;
 }
+#endif
 
 void
 jump_to_app()
 {
 
-	const uint32_t *app_base = (const uint32_t *)APP_LOAD_ADDRESS;    //APP_LOAD_ADDRESS=0x8008000
+	const uint32_t *app_base = (const uint32_t *)(uintptr_t)slot_boot();    //APP_LOAD_ADDRESS=0x8008000, or slot B
 
 	/*
 	 * We refuse to program the first word of the app until the upload is marked
@@ -274,6 +397,13 @@ jump_to_app()
 		return;
 	}
 
+	/* an image with a digest trailer has to match it */
+	if (!image_verify(app_base)) {
+		return;
+	}
+
+	trace_point(TRACE_JUMP);
+	slot_count_boot();
 
 	/* just for paranoia's sake */
     flash_lock();
@@ -290,11 +420,25 @@ jump_to_app()
 	/* deinitialise the board */
 	board_deinit();
 
+#if defined(TARGET_HW_PX4_SIM)
+	/* the simulator reports the vector table instead of running it */
+	sim_jump(app_base);
+#else
 	/* switch exception handlers to the application */
 	SCB_VTOR = APP_LOAD_ADDRESS;
 
+#if defined(BOARD_AB_SLOTS)
+
+	/* slot B runs with the banks swapped, where it was linked */
+	if (app_base != (const uint32_t *)APP_LOAD_ADDRESS) {
+		slot_jump(app_base[0], app_base[1]);
+	}
+
+#endif
+
 	/* extract the stack and entrypoint from the app vector table and go */
 	do_jump(app_base[0], app_base[1]);
+#endif
 }
 
 volatile unsigned timer[NTIMERS];
@@ -412,6 +556,90 @@ failure_response(void)
 	cout(data, sizeof(data));
 }
 
+#if PROTO_STREAM_WINDOW
+/*
+ * PROG_STREAM frames are programmed a word at a time whenever the host has
+ * nothing for us, so programming overlaps with receiving the next frames.
+ */
+static void
+stream_step(void)
+{
+	if (stream_tail == stream_head || stream_failed) {
+		return;
+	}
+
+	unsigned slot = stream_tail % PROTO_STREAM_WINDOW;
+
+	if (!lazy_erase_step(stream_frame[slot].address + stream_frame[slot].len)) {
+		return;
+	}
+
+	flash_func_write_word(stream_frame[slot].address + stream_frame[slot].done,
+			      frame_buffer[slot].w[stream_frame[slot].done / 4]);
+	stream_frame[slot].done += 4;
+
+	if (stream_frame[slot].done < stream_frame[slot].len) {
+		return;
+	}
+
+	// verify the frame as a whole
+	if (crc32_flash(stream_frame[slot].address, stream_frame[slot].len, 0) != stream_frame[slot].crc) {
+		stream_failed = true;
+	}
+
+	stream_done_seq = stream_frame[slot].seq;
+	stream_unacked++;
+	stream_tail++;
+}
+
+/* cumulative ack: <seq>/INSYNC/OK covers every frame up to seq */
+static void
+stream_ack(void)
+{
+	if (stream_unacked == 0) {
+		return;
+	}
+
+	if (stream_failed) {
+		uint8_t data[] = { stream_done_seq, PROTO_INSYNC, PROTO_FAILED };
+
+		cout(data, sizeof(data));
+		stream_unacked = 0;
+		return;
+	}
+
+	// coalesce while the host is still streaming
+	if (stream_tail == stream_head || stream_unacked >= (PROTO_STREAM_WINDOW + 1) / 2) {
+		uint8_t data[] = { stream_done_seq, PROTO_INSYNC, PROTO_OK };
+
+		cout(data, sizeof(data));
+		stream_unacked = 0;
+	}
+}
+
+/* finish all queued frames before any other command; the next stream starts at 0 */
+static void
+stream_flush(void)
+{
+	while (stream_tail != stream_head && !stream_failed) {
+		stream_step();
+	}
+
+	stream_ack();
+
+	// and let an erase started for a frame that never came finish
+	while (flash_func_busy());
+
+	stream_head = stream_tail = 0;
+	stream_seq = 0;
+	stream_failed = false;
+}
+#else
+static inline void stream_step(void) {}
+static inline void stream_ack(void) {}
+static inline void stream_flush(void) {}
+#endif
+
 static volatile unsigned cin_count;
 
 static int
@@ -430,6 +658,8 @@ cin_wait(unsigned timeout)
 			break;
 		}
 
+		stream_step();
+
 	} while (timer[TIMER_CIN] > 0);
 
 	return c;
@@ -476,35 +706,109 @@ cin_word(uint32_t *wp, unsigned timeout)
 	return 0;
 }
 
+/*
+ * Per-sector CRC cache, so that GET_CRC after a delta upload (or a second
+ * GET_CRC) only reads the sectors that were erased or programmed since.
+ */
+#define SECTOR_CRC_MAX	32
+
+static uint32_t sector_crc[SECTOR_CRC_MAX];
+static uint32_t sector_crc_valid;
+
+/* forget the cached CRC of every sector touching [address, address + len) */
+static void
+sector_crc_invalidate(uint32_t address, uint32_t len)
+{
+	uint32_t start = 0;
+
+	for (int i = 0; i < SECTOR_CRC_MAX && flash_func_sector_size(i) != 0; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if (start < address + len && address < start + size) {
+			sector_crc_valid &= ~(1U << i);
+		}
+
+		start += size;
+	}
+}
+
+/* CRC of the flash as it will be after boot, i.e. with the deferred first word */
 static uint32_t
-crc32(const uint8_t *src, unsigned len, unsigned state)
+flash_crc(uint32_t address, uint32_t len, uint32_t first_word, uint32_t sum)
 {
-	static uint32_t crctab[256];
+	if (address == 0 && len >= 4 && first_word != 0xffffffff) {
+		sum = crc32((uint8_t *)&first_word, sizeof(first_word), sum);
+		address += 4;
+		len -= 4;
+	}
 
-	/*check whether we have generated the CRC table yet*/
-	/*this is much smaller than a static table*/
-	if (crctab[1] == 0) {
-		for (unsigned i = 0; i < 256; i++) {
-			uint32_t c = i;
+	return crc32_flash(address, len, sum);
+}
 
-			for (unsigned j = 0; j < 8; j++) {
-				if (c & 1) {
-					c = 0xedb88320U ^ (c >> 1);
+static uint32_t
+sector_crc_get(int sector, uint32_t start, uint32_t first_word)
+{
+	uint32_t size = flash_func_sector_size(sector);
 
-				} else {
-					c = c >> 1;
-				}
-			}
+	if (sector >= SECTOR_CRC_MAX) {
+		return flash_crc(start, size, first_word, 0);
+	}
 
-			crctab[i] = c;
-		}
+	if (!(sector_crc_valid & (1U << sector))) {
+		sector_crc[sector] = flash_crc(start, size, first_word, 0);
+		sector_crc_valid |= 1U << sector;
+	}
+
+	return sector_crc[sector];
+}
+
+/*
+ * LAZY_ERASE state: sectors below lazy_end are erased or being erased,
+ * lazy_sector is the next one.  Images are programmed from address 0 up,
+ * so that is all that needs tracking.
+ */
+static bool lazy_erase;
+static unsigned lazy_sector;
+static uint32_t lazy_end;
+
+/*
+ * Make sure the flash up to end is erased, starting the next sector's erase
+ * if needed.  Returns false while an erase is still running; callers that
+ * have nothing else to do spin on it.
+ */
+static bool
+lazy_erase_step(uint32_t end)
+{
+	if (flash_func_busy()) {
+		return false;
 	}
 
-	for (unsigned i = 0; i < len; i++) {
-		state = crctab[(state ^ src[i]) & 0xff] ^ (state >> 8);
+	if (!lazy_erase || end <= lazy_end) {
+		return true;
 	}
 
-	return state;
+	uint32_t size = flash_func_sector_size(lazy_sector);
+
+	if (size == 0) {
+		return true;
+	}
+
+	sector_crc_invalidate(lazy_end, size);
+	flash_func_start_erase(lazy_sector);
+	lazy_sector++;
+	lazy_end += size;
+	return false;
+}
+
+/* copy the sectors a delta upload left alone into the open slot, once */
+static void
+delta_complete(uint32_t *written)
+{
+	if (*written != ~0u) {
+		slot_fill(*written);
+		*written = ~0u;
+		sector_crc_valid = 0;
+	}
 }
 
 void
@@ -513,6 +817,9 @@ bootloader(unsigned timeout)
 	bl_type = NONE; // The type of the bootloader, whether loading from USB or USART, will be determined by on what port the bootloader recevies its first valid command.
 	uint32_t	address = board_info.fw_size;	/*force erase before upload will work*/
 	uint32_t	first_word = 0xffffffff;
+	bool		vectors_erased = false;	/* sector 0 erased, delta upload may go on */
+	uint32_t	slot_written = ~0u;	/* sectors a delta upload erased, see slot_fill() */
+	trace_point(TRACE_BOOTLOADER);
 	/*(re)start the timer system*/
 	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB);
 	systick_set_reload(board_info.systick_mhz * 1000);	 //1ms tick, magic number
@@ -540,10 +847,28 @@ bootloader(unsigned timeout)
 			}
 			// try to get a byte from the host
 			c = cin_wait(0);
+
+			if (c < 0) {
+				stream_ack();
+			}
 		} while (c < 0);
 
 		led_on(LED_ACTIVITY);
 
+		if (c != PROTO_PROG_STREAM) {
+			stream_flush();
+		}
+
+#if PROTO_COMPRESSED_WINDOW
+
+		if (c != PROTO_PROG_COMPRESSED) {
+			lz_init(&prog_lz);
+			prog_lz_tail = 0;
+			prog_lz_dropped = false;
+		}
+
+#endif
+
 		// handle the command byte
 		switch (c) {
 
@@ -569,6 +894,10 @@ bootloader(unsigned timeout)
 		// BOARD_REV reply:	<board rev:4>/INSYNC/EOC
 		// FW_SIZE reply:	<firmware size:4>/INSYNC/EOC
 		// VEC_AREA reply	<vectors 7-10:16>/INSYNC/EOC
+		// PROG_BULK_MAX reply:	<max frame:4>/INSYNC/EOC
+		// STREAM_WINDOW reply:	<frames:4>/INSYNC/EOC
+		// TRACE reply:		<len:4>/<trace ring:len>/INSYNC/EOC
+		// SD_ERRORS reply:	<len:4>/<struct disk_stats:len>/INSYNC/EOC
 		// bad arg reply:	INSYNC/INVALID
 		//
 		case PROTO_GET_DEVICE:
@@ -609,6 +938,32 @@ bootloader(unsigned timeout)
 
 				break;
 
+			case PROTO_DEVICE_PROG_BULK_MAX:
+				cout((uint8_t *)&prog_bulk_max, sizeof(prog_bulk_max));
+				break;
+
+			case PROTO_DEVICE_STREAM_WINDOW:
+				cout((uint8_t *)&stream_window, sizeof(stream_window));
+				break;
+
+			case PROTO_DEVICE_COMPRESSED:
+				cout((uint8_t *)&compressed_window, sizeof(compressed_window));
+				break;
+
+			case PROTO_DEVICE_TRACE: {
+					uint32_t len;
+					const uint8_t *ring = trace_buffer(&len);
+
+					cout_word(len);
+					cout((uint8_t *)ring, len);
+				}
+				break;
+
+			case PROTO_DEVICE_SD_ERRORS:
+				cout_word(sizeof(disk_stats));
+				cout((uint8_t *)&disk_stats, sizeof(disk_stats));
+				break;
+
 			default:
 				goto cmd_bad;
 			}
@@ -638,17 +993,19 @@ bootloader(unsigned timeout)
 			// clear the bootloader LED while erasing - it stops blinking at random
 			// and that's confusing
 			led_set(LED_ON);
-			//备份芯片数据至SD
-			if(f_open(&backupfile,"backup.bin",FA_READ)) {   //如果没有backup.bin,就backup一次。
-				read_chip_to_sd();
-				backupok_response();
-			} else {  //如果存在，就关闭它，继续擦除
-				f_close(&backupfile);
+			//备份芯片数据至SD，只写入有变化的sector
+			if(read_chip_to_sd()==0) {   //上次升级未完成，保留原有的backup.bin
 				backupalready_response();
+			} else {
+				backupok_response();
 			}
 			//备份芯片数据至SD
-			// erase all sectors
+			// erase all sectors of the slot that is not running
 			flash_unlock();
+			slot_open();
+			slot_written = ~0u;
+			sector_crc_valid = 0;
+			lazy_erase = false;
 
 			for (int i = 0; flash_func_sector_size(i) != 0; i++) {
 				flash_func_erase_sector(i);
@@ -658,17 +1015,132 @@ bootloader(unsigned timeout)
 			led_set(LED_OFF);
 
 			// verify the erase
-			for (address = 0; address < board_info.fw_size; address += 4)
-				if (flash_func_read_word(address) != 0xffffffff) {
-					goto cmd_fail;
-				}
+			if (!flash_func_is_blank(0, board_info.fw_size)) {
+				goto cmd_fail;
+			}
 
 			address = 0;
+			vectors_erased = true;
 
 			// resume blinking
 			led_set(LED_BLINK);
 			break;
 
+		// prepare for programming, erasing as the image comes in
+		//
+		// command:		LAZY_ERASE/EOC
+		// success reply:	INSYNC/OK
+		//
+		// Like CHIP_ERASE, including the SD backup and its reply, but nothing
+		// is erased yet: each program command first erases the sectors its
+		// data reaches, starting as soon as the frame header is in.  Sectors
+		// past the image are left until GET_CRC, which blank-checks them and
+		// erases those that are not, so the flash ends up as CHIP_ERASE would
+		// have left it.  Programmed data is verified as usual, which also
+		// catches an erase that failed.
+		//
+		case PROTO_LAZY_ERASE:
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+			if (check_silicon()) {
+				goto bad_silicon;
+			}
+
+#endif
+			led_set(LED_ON);
+
+			if (read_chip_to_sd() == 0) {
+				backupalready_response();
+
+			} else {
+				backupok_response();
+			}
+
+			flash_unlock();
+			slot_open();
+			slot_written = ~0u;
+			sector_crc_valid = 0;
+			lazy_erase = true;
+			lazy_sector = 0;
+			lazy_end = 0;
+			address = 0;
+			vectors_erased = false;
+			led_set(LED_BLINK);
+			break;
+
+		// erase one sector and program it next, for delta uploads
+		//
+		// command:			ERASE_SECTOR/<sector:1>/EOC
+		// success reply:	INSYNC/OK
+		// erase failure:	INSYNC/FAILURE
+		//
+		// Sector 0 holds the vectors and has to go first, so that an interrupted
+		// upload leaves nothing bootable.  The first erase also updates the SD
+		// backup, as CHIP_ERASE does.
+		//
+		case PROTO_ERASE_SECTOR:
+			arg = cin_wait(50);
+
+			if (arg < 0) {
+				goto cmd_bad;
+			}
+
+			if (!wait_for_eoc(2)) {
+				goto cmd_bad;
+			}
+
+			if (flash_func_sector_size(arg) == 0 || (arg != 0 && !vectors_erased)) {
+				goto cmd_bad;
+			}
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+			if (check_silicon()) {
+				goto bad_silicon;
+			}
+
+#endif
+			led_set(LED_ON);
+
+			if (!vectors_erased) {
+				read_chip_to_sd();
+				slot_open();
+				slot_written = 0;
+				sector_crc_valid = 0;
+			}
+
+			flash_unlock();
+			lazy_erase = false;
+			flash_func_erase_sector(arg);
+
+			if (arg < 32) {
+				slot_written |= 1U << arg;
+			}
+
+			address = 0;
+
+			for (int i = 0; i < arg; i++) {
+				address += flash_func_sector_size(i);
+			}
+
+			sector_crc_invalidate(address, flash_func_sector_size(arg));
+
+			if (!flash_func_is_blank(address, flash_func_sector_size(arg))) {
+				goto cmd_fail;
+			}
+
+			if (arg == 0) {
+				first_word = 0xffffffff;
+				vectors_erased = true;
+			}
+
+			led_set(LED_BLINK);
+			break;
+
 		// program bytes at current address
 		//
 		// command:		PROG_MULTI/<len:1>/<data:len>/EOC
@@ -711,6 +1183,10 @@ bootloader(unsigned timeout)
 				goto cmd_bad;
 			}
 
+			while (!lazy_erase_step(address + arg));
+
+			sector_crc_invalidate(address, arg);
+
 			if (address == 0) {
 
 #if defined(TARGET_HW_PX4_FMU_V4)
@@ -744,6 +1220,318 @@ bootloader(unsigned timeout)
 
 			break;
 
+#if PROTO_PROG_BULK_MAX
+
+		// program a large frame at current address
+		//
+		// command:		PROG_BULK/<len:2>/<data:len>/<crc:4>/EOC
+		// success reply:	INSYNC/OK
+		// invalid reply:	INSYNC/INVALID
+		// readback failure:	INSYNC/FAILURE
+		//
+		// <crc> is the CRC of <data> as GET_CRC computes it.  A frame that
+		// arrives damaged is rejected before anything is programmed and the
+		// address is not advanced, so it can be sent again.  The frame is
+		// verified once after programming rather than word by word.
+		//
+		case PROTO_PROG_BULK: {
+				uint32_t frame_crc;
+
+				arg = cin_wait(50);
+				c = cin_wait(50);
+
+				if (arg < 0 || c < 0) {
+					goto cmd_bad;
+				}
+
+				arg |= c << 8;
+
+				if (arg == 0 || (arg % 4) || arg > PROTO_PROG_BULK_MAX) {
+					goto cmd_bad;
+				}
+
+				if ((address + arg) > board_info.fw_size) {
+					goto cmd_bad;
+				}
+
+				// erase while the frame comes in
+				lazy_erase_step(address + arg);
+
+				for (int i = 0; i < arg; i++) {
+					c = cin_wait(1000);
+
+					if (c < 0) {
+						goto cmd_bad;
+					}
+
+					frame_buffer[0].c[i] = c;
+				}
+
+				if (cin_word(&frame_crc, 100) || !wait_for_eoc(200)) {
+					goto cmd_bad;
+				}
+
+				if (crc32(frame_buffer[0].c, arg, 0) != frame_crc) {
+					goto cmd_bad;
+				}
+
+				while (!lazy_erase_step(address + arg));
+
+				sector_crc_invalidate(address, arg);
+
+				if (address == 0) {
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+					if (check_silicon()) {
+						goto bad_silicon;
+					}
+
+#endif
+					// the first word is programmed at boot, as for PROG_MULTI
+					first_word = frame_buffer[0].w[0];
+					frame_buffer[0].w[0] = 0xffffffff;
+				}
+
+				uint32_t frame_start = address;
+
+				for (int i = 0; i < arg / 4; i++) {
+					flash_func_write_word(address, frame_buffer[0].w[i]);
+					address += 4;
+				}
+
+				if (flash_crc(frame_start, arg, first_word, 0) != frame_crc) {
+					goto cmd_fail;
+				}
+			}
+			break;
+
+#endif
+
+#if PROTO_STREAM_WINDOW
+
+		// queue a frame for programming at current address
+		//
+		// command:		PROG_STREAM/<seq:1>/<len:2>/<data:len>/<crc:4>/EOC
+		// no reply; frames are acknowledged once programmed and verified:
+		// ack:			<seq>/INSYNC/OK for every frame up to <seq>
+		// bad frame:		<expected seq>/INSYNC/INVALID
+		// readback failure:	<seq>/INSYNC/FAILED
+		//
+		// The host may have up to STREAM_WINDOW frames unacknowledged.  The
+		// first frame after any other command has sequence number 0.  After an
+		// INVALID every frame is dropped until the expected one arrives, so the
+		// host goes back to it and resends from there.
+		//
+		case PROTO_PROG_STREAM: {
+				uint32_t frame_crc;
+				int seq = cin_wait(50);
+
+				arg = cin_wait(50);
+				c = cin_wait(50);
+
+				if (seq < 0 || arg < 0 || c < 0) {
+					goto stream_bad;
+				}
+
+				arg |= c << 8;
+
+				if (arg == 0 || (arg % 4) || arg > PROTO_PROG_BULK_MAX) {
+					goto stream_bad;
+				}
+
+				// make room, in case the host overran the window
+				while (stream_head - stream_tail == PROTO_STREAM_WINDOW && !stream_failed) {
+					stream_step();
+				}
+
+				unsigned slot = stream_head % PROTO_STREAM_WINDOW;
+
+				// with nothing queued, erase while this frame comes in
+				if (stream_tail == stream_head && seq == stream_seq && address + arg <= board_info.fw_size) {
+					lazy_erase_step(address + arg);
+				}
+
+				for (int i = 0; i < arg; i++) {
+					c = cin_wait(1000);
+
+					if (c < 0) {
+						goto stream_bad;
+					}
+
+					frame_buffer[slot].c[i] = c;
+				}
+
+				if (cin_word(&frame_crc, 100) || !wait_for_eoc(200)) {
+					goto stream_bad;
+				}
+
+				if (seq != stream_seq || stream_failed) {
+					// sent before the host saw our INVALID or FAILED
+					goto cmd_streamed;
+				}
+
+				if (crc32(frame_buffer[slot].c, arg, 0) != frame_crc ||
+				    (address + arg) > board_info.fw_size) {
+					goto stream_bad;
+				}
+
+				sector_crc_invalidate(address, arg);
+
+				if (address == 0) {
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+					if (check_silicon()) {
+						goto bad_silicon;
+					}
+
+#endif
+					// the first word is programmed at boot, as for PROG_MULTI
+					first_word = frame_buffer[slot].w[0];
+					frame_buffer[slot].w[0] = 0xffffffff;
+					frame_crc = crc32(frame_buffer[slot].c, arg, 0);
+				}
+
+				stream_frame[slot].address = address;
+				stream_frame[slot].crc = frame_crc;
+				stream_frame[slot].len = arg;
+				stream_frame[slot].done = 0;
+				stream_frame[slot].seq = seq;
+				stream_head++;
+				stream_seq++;
+				address += arg;
+			}
+			goto cmd_streamed;
+
+#endif
+
+#if PROTO_COMPRESSED_WINDOW
+
+		// decode a frame of an LZ stream at current address
+		//
+		// command:		PROG_COMPRESSED/<len:2>/<data:len>/<crc:4>/EOC
+		// success reply:	INSYNC/OK
+		// invalid reply:	INSYNC/INVALID
+		// readback failure:	INSYNC/FAILURE
+		//
+		// <data> is the next piece of one lz.h stream of the image from the
+		// current address on; the stream starts over with any other command.
+		// <crc> covers <data> and a damaged frame is rejected before anything
+		// is decoded, so it can be sent again.  The whole words decoded so far
+		// are programmed and verified before the reply; the image must be a
+		// multiple of 4 bytes long.  A frame that fails once decoding has
+		// started (corrupt stream, past the end of flash, readback) has moved
+		// the address and the decoder on, so the stream is dropped: every
+		// further PROG_COMPRESSED is INVALID and the host starts over with an
+		// erase.
+		//
+		case PROTO_PROG_COMPRESSED: {
+				uint32_t frame_crc;
+
+				arg = cin_wait(50);
+				c = cin_wait(50);
+
+				if (arg < 0 || c < 0) {
+					goto cmd_bad;
+				}
+
+				arg |= c << 8;
+
+				if (arg == 0 || arg > PROTO_PROG_BULK_MAX) {
+					goto cmd_bad;
+				}
+
+				for (int i = 0; i < arg; i++) {
+					c = cin_wait(1000);
+
+					if (c < 0) {
+						goto cmd_bad;
+					}
+
+					frame_buffer[0].c[i] = c;
+				}
+
+				if (cin_word(&frame_crc, 100) || !wait_for_eoc(200)) {
+					goto cmd_bad;
+				}
+
+				if (crc32(frame_buffer[0].c, arg, 0) != frame_crc || prog_lz_dropped) {
+					goto cmd_bad;
+				}
+
+				const uint8_t *in = frame_buffer[0].c;
+				const uint8_t *end = in + arg;
+
+				// decode into flash_buffer, a buffer full of words at a time
+				while (in != end) {
+					int len = lz_decode(&prog_lz, &in, end, &flash_buffer.c[prog_lz_tail],
+							    sizeof(flash_buffer.c) - prog_lz_tail);
+
+					if (len < 0) {
+						goto lz_drop;
+					}
+
+					len += prog_lz_tail;
+					prog_lz_tail = len % 4;
+					len -= prog_lz_tail;
+
+					if ((address + len) > board_info.fw_size) {
+						goto lz_drop;
+					}
+
+					if (len == 0) {
+						continue;
+					}
+
+					while (!lazy_erase_step(address + len));
+
+					sector_crc_invalidate(address, len);
+
+					if (address == 0) {
+
+#if defined(TARGET_HW_PX4_FMU_V4)
+
+						if (check_silicon()) {
+							goto bad_silicon;
+						}
+
+#endif
+						// the first word is programmed at boot, as for PROG_MULTI
+						first_word = flash_buffer.w[0];
+						flash_buffer.w[0] = 0xffffffff;
+					}
+
+					uint32_t chunk_start = address;
+					uint32_t chunk_crc = crc32(flash_buffer.c, len, 0);
+
+					for (int i = 0; i < len / 4; i++) {
+						flash_func_write_word(address, flash_buffer.w[i]);
+						address += 4;
+					}
+
+					if (crc32_flash(chunk_start, len, 0) != chunk_crc) {
+						prog_lz_dropped = true;
+						goto cmd_fail;
+					}
+
+					// keep the odd bytes for the next word
+					for (unsigned i = 0; i < prog_lz_tail; i++) {
+						flash_buffer.c[i] = flash_buffer.c[len + i];
+					}
+				}
+
+				break;
+
+lz_drop:
+				lz_init(&prog_lz);
+				prog_lz_tail = 0;
+				prog_lz_dropped = true;
+				goto cmd_bad;
+			}
+
+#endif
+
 		// fetch CRC of the entire flash area
 		//
 		// command:			GET_CRC/EOC
@@ -756,25 +1544,79 @@ bootloader(unsigned timeout)
 				goto cmd_bad;
 			}
 
-			// compute CRC of the programmed area
+			delta_complete(&slot_written);
+
+			// compute CRC of the programmed area, a sector at a time
 			uint32_t sum = 0;
+			uint32_t start = 0;
+
+			// let the last lazy erase finish before reading past it
+			while (!lazy_erase_step(0));
+
+			for (int i = 0; flash_func_sector_size(i) != 0; i++) {
+				uint32_t size = flash_func_sector_size(i);
 
-			for (unsigned p = 0; p < board_info.fw_size; p += 4) {
-				uint32_t bytes;
+				if (start + size > board_info.fw_size) {
+					break;
+				}
+
+				if (lazy_erase && start >= lazy_end) {
+					// past the image and never erased: erase what the
+					// old image left there, so it can count as blank
+					if (!flash_func_is_blank(start, size)) {
+						sector_crc_invalidate(start, size);
+						flash_func_erase_sector(i);
+					}
 
-				if ((p == 0) && (first_word != 0xffffffff)) {
-					bytes = first_word;
+					sum = crc32_erased(size, sum);
 
 				} else {
-					bytes = flash_func_read_word(p);
+					sum = crc32_combine(sum, sector_crc_get(i, start, first_word), size);
 				}
 
-				sum = crc32((uint8_t *)&bytes, sizeof(bytes), sum);
+				start += size;
+			}
+
+			if (start < board_info.fw_size) {
+				sum = flash_crc(start, board_info.fw_size - start, first_word, sum);
 			}
 
 			cout_word(sum);
 			break;
 
+		// fetch CRC and size of one flash sector; size is 0 past the last one
+		//
+		// command:			GET_SECTOR_CRC/<sector:1>/EOC
+		// reply:			<crc:4>/<size:4>/INSYNC/OK
+		//
+		case PROTO_GET_SECTOR_CRC: {
+				arg = cin_wait(50);
+
+				if (arg < 0) {
+					goto cmd_bad;
+				}
+
+				if (!wait_for_eoc(2)) {
+					goto cmd_bad;
+				}
+
+				uint32_t start = 0;
+				uint32_t size = flash_func_sector_size(arg);
+				uint32_t sum = 0;
+
+				for (int i = 0; i < arg; i++) {
+					start += flash_func_sector_size(i);
+				}
+
+				if (size != 0) {
+					sum = sector_crc_get(arg, start, first_word);
+				}
+
+				cout_word(sum);
+				cout_word(size);
+			}
+			break;
+
 		// read a word from the OTP
 		//
 		// command:			GET_OTP/<addr:4>/EOC
@@ -887,6 +1729,8 @@ bootloader(unsigned timeout)
 
 				uint32_t value = (BOOT_DELAY_SIGNATURE1 & 0xFFFFFF00) | boot_delay;
 				flash_func_write_word(BOOT_DELAY_ADDRESS, value);
+				sector_crc_invalidate(BOOT_DELAY_ADDRESS, 4);
+				image_invalidate();
 
 				if (flash_func_read_word(BOOT_DELAY_ADDRESS) != value) {
 					goto cmd_fail;
@@ -918,7 +1762,11 @@ bootloader(unsigned timeout)
 				// revert in case the flash was bad...
 				first_word = 0xffffffff;
 			}
-			f_unlink("backup.bin");
+
+			// the uploaded slot boots from now on
+			delta_complete(&slot_written);
+			slot_close(true);
+			SD_backup_release();        //升级完成，不再恢复backup.bin
 			// send a sync and wait for it to be collected
 			sync_response();
 			delay(100);
@@ -946,6 +1794,25 @@ bootloader(unsigned timeout)
 		// send the sync response for this command
 		sync_response();
 		continue;
+
+#if PROTO_STREAM_WINDOW
+cmd_streamed:
+		// PROG_STREAM frames are acknowledged once programmed
+		timeout = 0;
+
+		if (bl_type == NONE) {
+			bl_type = last_input;
+		}
+
+		continue;
+
+stream_bad: {
+			uint8_t data[] = { stream_seq, PROTO_INSYNC, PROTO_INVALID };
+
+			cout(data, sizeof(data));
+		}
+		continue;
+#endif
 cmd_bad:
 		// send an 'invalid' response but don't kill the timeout - could be garbage
 		invalid_response();
@@ -64,10 +64,21 @@ extern struct boardinfo board_info;
 extern void jump_to_app(void);
 extern void bootloader(unsigned timeout);
 extern void delay(unsigned msec);
-extern void read_chip_to_sd();
+extern int read_chip_to_sd(void);
+extern void SD_backup_release(void);
+extern void SD_upload(void);
+extern bool board_sd_mount(void);
+#if defined(TARGET_HW_PX4_SIM)
+extern void sim_jump(const uint32_t *vectors) __attribute__((noreturn));
+extern void sim_flash_read(unsigned words);
+extern void sim_hash(unsigned blocks);
+extern uint32_t sim_slot_reg;
+extern uint32_t sim_image_reg;
+#endif
 
 
 #define BL_WAIT_MAGIC	0x19710317		/* magic number in PWR regs to wait in bootloader */
+#define SLOT_CONFIRM_SIGNATURE	0x5107c0de	/* the app writes it to RTC backup register 2 */
 
 /* generic timers */
 #define NTIMERS		4
@@ -80,6 +91,7 @@ extern volatile unsigned timer[NTIMERS];	/* each timer decrements every millisec
 /* generic receive buffer for async reads */
 extern void buf_put(uint8_t b);
 extern int buf_get(void);
+extern unsigned buf_free(void);
 
 /*****************************************************************************
  * Chip/board functions.
@@ -107,11 +119,39 @@ extern void board_deinit(void);
 extern void clock_deinit(void);
 extern uint32_t flash_func_sector_size(unsigned sector);
 extern void flash_func_erase_sector(unsigned sector);
+extern void flash_func_start_erase(unsigned sector);
 extern void flash_func_write_word(uint32_t address, uint32_t word);
+extern void flash_func_start_word(uint32_t address, uint32_t word);
+extern bool flash_func_busy(void);
 extern uint32_t flash_func_read_word(uint32_t address);
+/* block access, flash.c */
+extern void flash_func_read_block(uint32_t address, void *buf, unsigned len);
+extern bool flash_func_is_blank(uint32_t address, unsigned len);
+extern bool flash_func_compare(uint32_t address, const void *buf, unsigned len);
 extern uint32_t flash_func_read_otp(uint32_t address);
 extern uint32_t flash_func_read_sn(uint32_t address);
 
+/* A/B firmware slots, slots.c */
+struct flash_slot {
+	uint32_t	base;		/* flash address of offset 0 for flash_func_*() */
+	unsigned	first;		/* its first flash_sectors[] entry */
+	unsigned	sectors;	/* flash_sectors[] entries it spans */
+};
+extern struct flash_slot flash_slot;
+extern void slots_init(void);
+extern void slot_open(void);
+extern void slot_fill(uint32_t written);
+extern void slot_close(bool commit);
+extern uint32_t slot_boot(void);
+extern void slot_count_boot(void);
+#if defined(BOARD_AB_SLOTS) && !defined(TARGET_HW_PX4_SIM)
+extern void slot_jump(uint32_t stacktop, uint32_t entrypoint) __attribute__((noreturn));
+#endif
+
+/* image digest check, image.c */
+extern bool image_verify(const uint32_t *app_base);
+extern void image_invalidate(void);
+
 extern uint32_t get_mcu_id(void);
 int get_mcu_desc(int max, uint8_t *revstr);
 extern int check_silicon(void);
@@ -30,6 +30,7 @@
  */
 #include "hw_config.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 
 #include <libopencm3/stm32/rcc.h>
@@ -44,6 +45,15 @@
 
 #define USB_CDC_REQ_GET_LINE_CODING			0x21 // Not defined in libopencm3
 
+#define CDC_PACKET_SIZE		64
+
+#ifndef USB_TX_BUF_SIZE
+# define USB_TX_BUF_SIZE	512	// replies queued for the IN endpoint, a power of two
+#endif
+#if USB_TX_BUF_SIZE & (USB_TX_BUF_SIZE - 1)
+# error USB_TX_BUF_SIZE must be a power of two
+#endif
+
 
 /* Provide the stings for the Index 1-n as a requested index of 0 is used for the supported langages
  *  and is hard coded in the usb lib. The array below is indexed by requested index-1, therefore
@@ -61,6 +71,18 @@ static usbd_device *usbd_dev;
 /* Buffer to be used for control requests. */
 static uint8_t usbd_control_buffer[128];
 
+/*
+ * usb_cout() queues into tx_buf and returns; the IN endpoint completion
+ * sends the next packet.  The OUT endpoint is NAKed while the receive ring
+ * could not take another packet, so the host waits instead of bytes being
+ * dropped.
+ */
+static uint8_t tx_buf[USB_TX_BUF_SIZE];
+static volatile unsigned tx_head, tx_tail;	// bytes queued, bytes handed to the endpoint
+static volatile bool tx_busy;			// a packet is on the IN endpoint
+static bool tx_zlp;				// the last packet was full, end the transfer
+static volatile bool rx_naked;
+
 static const struct usb_device_descriptor dev = {
 	.bLength = USB_DT_DEVICE_SIZE,
 	.bDescriptorType = USB_DT_DEVICE,	/**< Specifies he descriptor type */
@@ -243,21 +265,81 @@ static void cdcacm_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
 	(void)ep;
 
-	char buf[64];
+	char buf[CDC_PACKET_SIZE];
 	unsigned i;
-	unsigned len = usbd_ep_read_packet(usbd_dev, 0x01, buf, sizeof(buf));
+	unsigned len;
+
+	/* this packet fits; NAK the next one unless it will too */
+	if (buf_free() < 2 * sizeof(buf)) {
+		rx_naked = true;
+		usbd_ep_nak_set(usbd_dev, 0x01, 1);
+	}
+
+	len = usbd_ep_read_packet(usbd_dev, 0x01, buf, sizeof(buf));
 
 	for (i = 0; i < len; i++) {
 		buf_put(buf[i]);
 	}
 }
 
+/* hand the next packet to the IN endpoint, from its completion or with the USB interrupt masked */
+static void cdcacm_tx_next(void)
+{
+	uint32_t pkt[CDC_PACKET_SIZE / 4];	// the OTG FIFO is written in words
+	unsigned len = 0;
+
+	while (len < sizeof(pkt) && tx_tail != tx_head) {
+		((uint8_t *)pkt)[len++] = tx_buf[tx_tail % USB_TX_BUF_SIZE];
+		tx_tail++;
+	}
+
+	if (len == 0 && !tx_zlp) {
+		tx_busy = false;
+		return;
+	}
+
+	/* a transfer ending on a full packet needs a zero length one after it */
+	tx_zlp = (len == sizeof(pkt));
+	tx_busy = true;
+	usbd_ep_write_packet(usbd_dev, 0x82, pkt, len);
+}
+
+static void cdcacm_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	(void)usbd_dev;
+	(void)ep;
+
+	cdcacm_tx_next();
+}
+
+/* start sending if the IN endpoint is idle */
+static void usb_tx_kick(void)
+{
+#if defined(STM32F4)
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+#endif
+
+	if (!tx_busy) {
+		cdcacm_tx_next();
+	}
+
+#if defined(STM32F4)
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
+#endif
+}
+
 static void cdcacm_set_config(usbd_device *usbd_dev, uint16_t wValue)
 {
 	(void)wValue;
 
-	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
+	/* a new configuration starts with idle endpoints */
+	tx_tail = tx_head;
+	tx_busy = false;
+	tx_zlp = false;
+	rx_naked = false;
+
+	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, CDC_PACKET_SIZE, cdcacm_data_rx_cb);
+	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, CDC_PACKET_SIZE, cdcacm_data_tx_cb);
 	usbd_ep_setup(usbd_dev, 0x83, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
 	usbd_register_control_callback(
@@ -311,6 +393,14 @@ usb_cinit(void)
 void
 usb_cfini(void)
 {
+	/* let the last reply go out, but not wait for a host that stopped reading */
+	for (unsigned spins = 0; usbd_dev && (tx_busy || tx_tail != tx_head) && spins < 1000000; spins++) {
+#if defined(STM32F1)
+		usbd_poll(usbd_dev);
+#endif
+		usb_tx_kick();
+	}
+
 #if defined(STM32F4)
 	nvic_disable_irq(NVIC_OTG_FS_IRQ);
 #endif
@@ -337,26 +427,55 @@ usb_cfini(void)
 int
 usb_cin(void)
 {
+	int c;
+
 	if (usbd_dev == NULL) { return -1; }
 
 #if defined(STM32F1)
 	usbd_poll(usbd_dev);
 #endif
-	return buf_get();
+	c = buf_get();
+
+	/*
+	 * On F4 the OUT callback and set_config run from the OTG_FS interrupt
+	 * and touch rx_naked and the endpoint NAK too; mask it while deciding.
+	 */
+#if defined(STM32F4)
+	nvic_disable_irq(NVIC_OTG_FS_IRQ);
+#endif
+
+	if (rx_naked && buf_free() >= 2 * CDC_PACKET_SIZE) {
+		rx_naked = false;
+		usbd_ep_nak_set(usbd_dev, 0x01, 0);
+	}
+
+#if defined(STM32F4)
+	nvic_enable_irq(NVIC_OTG_FS_IRQ);
+#endif
+
+	return c;
 }
 
 void
 usb_cout(uint8_t *buf, unsigned count)
 {
-	if (usbd_dev) {
-		while (count) {
-			unsigned len = (count > 64) ? 64 : count;
-			unsigned sent;
-
-			sent = usbd_ep_write_packet(usbd_dev, 0x82, buf, len);
+	if (usbd_dev == NULL) {
+		return;
+	}
 
-			count -= sent;
-			buf += sent;
+	while (count) {
+		/* only waits when more than USB_TX_BUF_SIZE bytes are outstanding */
+		while (tx_head - tx_tail == USB_TX_BUF_SIZE) {
+#if defined(STM32F1)
+			usbd_poll(usbd_dev);
+#endif
+			usb_tx_kick();
 		}
+
+		tx_buf[tx_head % USB_TX_BUF_SIZE] = *buf++;
+		tx_head++;
+		count--;
 	}
+
+	usb_tx_kick();
 }
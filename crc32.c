@@ -0,0 +1,255 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/*
+ * CRC-32 engine for the bootloader.
+ *
+ * Data is processed a word at a time with slice-by-4 tables; on the F4 the
+ * CRC unit can do the flash instead.  It computes the non-reflected CRC-32
+ * with a fixed 0xffffffff seed, so words are fed bit-reversed, the result
+ * is reversed back and the seed is cancelled by a leading 0xffffffff word.
+ *
+ * Erased flash is not read at all: the CRC of n bytes of 0xff from state s
+ * is (s ^ F) * x^8n ^ F mod P, F being the fixed point of a 0xff byte.
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bl.h"
+#include "crc32.h"
+
+#if !defined(CRC32_USE_HW) && defined(STM32F4) && !defined(TARGET_HW_PX4_SIM)
+# define CRC32_USE_HW
+#endif
+
+#ifdef CRC32_USE_HW
+# include <libopencm3/stm32/rcc.h>
+# include <libopencm3/stm32/crc.h>
+#endif
+
+#define CRC32_POLY		0xedb88320U
+#define CRC32_ERASED_FIXED	0xb6d0fdc0U	/* F: crc32(&0xff, 1, F) == F */
+#define CRC32_FLASH_BLOCK	256		/* crc32_flash() stack buffer, bytes */
+
+static uint32_t crctab[4][256];
+static uint32_t x2n_table[32];		/* x^(2^n) mod P */
+
+static uint32_t multmodp(uint32_t a, uint32_t b);
+
+static void
+crc32_init(void)
+{
+	/* generated on first use, much smaller than static tables */
+	if (crctab[0][1] != 0) {
+		return;
+	}
+
+	for (unsigned i = 0; i < 256; i++) {
+		uint32_t c = i;
+
+		for (unsigned j = 0; j < 8; j++) {
+			c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+		}
+
+		crctab[0][i] = c;
+	}
+
+	for (unsigned i = 0; i < 256; i++) {
+		for (unsigned k = 1; k < 4; k++) {
+			crctab[k][i] = (crctab[k - 1][i] >> 8) ^ crctab[0][crctab[k - 1][i] & 0xff];
+		}
+	}
+
+	x2n_table[0] = 1U << 30;		/* x^1 */
+
+	for (unsigned n = 1; n < 32; n++) {
+		x2n_table[n] = multmodp(x2n_table[n - 1], x2n_table[n - 1]);
+	}
+
+#ifdef CRC32_USE_HW
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, RCC_AHB1ENR_CRCEN);
+#endif
+}
+
+/* one little-endian word */
+static inline uint32_t
+crc32_word(uint32_t state, uint32_t word)
+{
+	state ^= word;
+	return crctab[3][state & 0xff] ^ crctab[2][(state >> 8) & 0xff] ^
+	       crctab[1][(state >> 16) & 0xff] ^ crctab[0][state >> 24];
+}
+
+uint32_t
+crc32(const uint8_t *src, unsigned len, unsigned state)
+{
+	crc32_init();
+
+	while (len > 0 && ((uintptr_t)src & 3)) {
+		state = crctab[0][(state ^ *src++) & 0xff] ^ (state >> 8);
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, src += 4) {
+		state = crc32_word(state, *(const uint32_t *)src);
+	}
+
+	while (len-- > 0) {
+		state = crctab[0][(state ^ *src++) & 0xff] ^ (state >> 8);
+	}
+
+	return state;
+}
+
+/* a * b mod P, bit-reflected */
+static uint32_t
+multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+
+		m >>= 1;
+		b = (b & 1) ? ((b >> 1) ^ CRC32_POLY) : (b >> 1);
+	}
+
+	return p;
+}
+
+/* x^(8 * len) mod P */
+static uint32_t
+x8nmodp(unsigned len)
+{
+	uint32_t p = 1U << 31;		/* x^0 */
+	unsigned k = 3;
+
+	while (len) {
+		if (len & 1) {
+			p = multmodp(x2n_table[k & 31], p);
+		}
+
+		len >>= 1;
+		k++;
+	}
+
+	return p;
+}
+
+uint32_t
+crc32_erased(unsigned len, uint32_t state)
+{
+	crc32_init();
+	return multmodp(x8nmodp(len), state ^ CRC32_ERASED_FIXED) ^ CRC32_ERASED_FIXED;
+}
+
+uint32_t
+crc32_combine(uint32_t crc_a, uint32_t crc_b, unsigned len_b)
+{
+	crc32_init();
+	return multmodp(x8nmodp(len_b), crc_a) ^ crc_b;
+}
+
+#ifdef CRC32_USE_HW
+static inline uint32_t
+rbit(uint32_t x)
+{
+	uint32_t r;
+
+	__asm__("rbit %0, %1" : "=r"(r) : "r"(x));
+	return r;
+}
+#endif
+
+uint32_t
+crc32_flash(uint32_t address, unsigned len, uint32_t state)
+{
+	uint32_t end = address + len;
+	uint32_t buf[CRC32_FLASH_BLOCK / 4];
+
+	crc32_init();
+
+	/* the erased tail is folded in at the end without reading it twice */
+	while (end - address >= CRC32_FLASH_BLOCK && flash_func_is_blank(end - CRC32_FLASH_BLOCK, CRC32_FLASH_BLOCK)) {
+		end -= CRC32_FLASH_BLOCK;
+	}
+
+	while (end > address && flash_func_read_word(end - 4) == 0xffffffff) {
+		end -= 4;
+	}
+
+#ifdef CRC32_USE_HW
+
+	if (end > address) {
+		/* 0xffffffff cancels the seed, leaving the register at 0 */
+		CRC_CR = CRC_CR_RESET;
+		CRC_DR = 0xffffffff;
+
+		for (uint32_t p = address; p < end; p += sizeof(buf)) {
+			unsigned n = (end - p < sizeof(buf)) ? end - p : sizeof(buf);
+
+			flash_func_read_block(p, buf, n);
+
+			for (unsigned i = 0; i < n / 4; i++) {
+				CRC_DR = rbit(buf[i]);
+			}
+		}
+
+		state = crc32_combine(state, rbit(CRC_DR), end - address);
+	}
+
+#else
+
+	for (uint32_t p = address; p < end; p += sizeof(buf)) {
+		unsigned n = (end - p < sizeof(buf)) ? end - p : sizeof(buf);
+
+		flash_func_read_block(p, buf, n);
+
+		for (unsigned i = 0; i < n / 4; i++) {
+			state = crc32_word(state, buf[i]);
+		}
+	}
+
+#endif
+
+	return crc32_erased(address + len - end, state);
+}
@@ -9,10 +9,26 @@
 
 #include "diskio.h"
 
+#include <libopencm3/cm3/dwt.h>
+
+#include "bl.h"
 #include "SD_Card.h"
 
 #define SD_CARD 0
 
+/*
+ * Retry policy of disk_read()/disk_write(): a failed access is re-issued,
+ * then retried at the next lower bus clock, then after a full SD_Init(),
+ * and around again.  When DISK_TRIES accesses have failed or DISK_DEADLINE_MS
+ * has passed since the first failure the card is given up: this and every
+ * later access fail at once, FatFs returns errors and the bootloader goes on
+ * to boot the app instead of hanging on a flaky or pulled card.
+ */
+#define DISK_TRIES		9
+#define DISK_DEADLINE_MS	3000
+
+struct disk_stats disk_stats;
+
 /*-----------------------------------------------------------------------*/
 /* Get Drive Status                                                      */
 /*-----------------------------------------------------------------------*/
@@ -21,7 +37,7 @@ DSTATUS disk_status (
 	BYTE pdrv		/* Physical drive nmuber to identify the drive */
 )
 {
-	return 0;
+	return disk_stats.failed ? STA_NOINIT : 0;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -35,19 +51,80 @@ DSTATUS disk_initialize (
 	int result;
 	switch (pdrv) {
 		case SD_CARD :
-			result=SD_Init();
+			result=disk_stats.failed ? SD_ERROR : SD_Init();
 			break;
 		default :  
-			result=1;
+			result=SD_ERROR;
 			break;	
 	}
 	
-	if(result==1)
+	if(result!=SD_OK)
 	  return STA_NOINIT;
 	else
 		return 0;
 }
 
+/* one read or write with the retry policy above */
+static DRESULT
+disk_access(BYTE write, BYTE *buff, DWORD sector, UINT count)
+{
+	uint32_t start = 0;
+	SD_Error result;
+
+	if (disk_stats.failed) {
+		return RES_NOTRDY;
+	}
+
+	for (unsigned attempt = 0;; attempt++) {
+		result = write ? SD_WriteDisk(buff, sector, count) : SD_ReadDisk(buff, sector, count);
+
+		if (result == SD_OK) {
+			return RES_OK;
+		}
+
+		disk_stats.errors[(result < DISK_ERROR_KINDS) ? result : 0]++;
+
+		/* the request itself is wrong, trying again will not help */
+		if (result == SD_ADDR_OUT_OF_RANGE || result == SD_INVALID_PARAMETER) {
+			return RES_PARERR;
+		}
+
+		if (result == SD_WRITE_PROT_VIOLATION) {
+			return RES_WRPRT;
+		}
+
+		if (attempt == 0) {
+			start = dwt_read_cycle_counter();
+		}
+
+		if (attempt + 1 >= DISK_TRIES ||
+		    (dwt_read_cycle_counter() - start) / board_info.systick_mhz / 1000 >= DISK_DEADLINE_MS) {
+			disk_stats.failed = 1;
+			return RES_ERROR;
+		}
+
+		disk_stats.retries++;
+
+		switch (attempt % 3) {
+		case 0:
+			/* re-issue as it is */
+			break;
+
+		case 1:
+			if (SD_ClockStepDown()) {
+				disk_stats.slowdowns++;
+			}
+
+			break;
+
+		case 2:
+			disk_stats.reinits++;
+			SD_Init();
+			break;
+		}
+	}
+}
+
 /*-----------------------------------------------------------------------*/
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
@@ -59,27 +136,10 @@ DRESULT disk_read (
 	UINT count		/* Number of sectors to read */
 )
 {
-	int result;
-  if(!count)  return RES_PARERR;
-	switch (pdrv) 
-	{
-		case SD_CARD:
-			result=SD_ReadDisk(buff,sector,count);	 
-			while(result)//������
-			{
-				SD_Init();	//���³�ʼ��SD��
-				result=SD_ReadDisk(buff,sector,count);	
-			}
-			break;
-		default :
-			result=1;
-			break;
-	}
-	
-	if(result==0x00)
-		return RES_OK;	 
-	else 
-		return RES_ERROR;	
+	if (!count || pdrv != SD_CARD)
+		return RES_PARERR;
+
+	return disk_access(0, buff, sector, count);
 }
 
 
@@ -95,31 +155,10 @@ DRESULT disk_write (
 	UINT count			/* Number of sectors to write */
 )
 {
-	
-	int result;	
-	if (!count)
+	if (!count || pdrv != SD_CARD)
 		return RES_PARERR;
-	switch(pdrv)
-	{
-		case SD_CARD://SD��
-			result=SD_WriteDisk((uint8_t*)buff,sector,count);
-			while(result)//д����
-			{
-				SD_Init();	//���³�ʼ��SD��
-				result=SD_WriteDisk((uint8_t*)buff,sector,count);
-				//printf("sd wr error:%d\r\n",res);
-			}
-			break;
-	
-		default:
-			result=1; 
-		  break;
-	}
-    
-    if(result == 0x00)
-			return RES_OK;	 
-    else 
-			return RES_ERROR;	
+
+	return disk_access(1, (BYTE *)buff, sector, count);
 }
 
 
@@ -149,7 +188,7 @@ DRESULT disk_ioctl (
 							result = RES_OK;
 							break;	 
 					case GET_BLOCK_SIZE:
-					*(WORD*)buff = SDCardInfo.CardBlockSize;
+					*(DWORD*)buff = SDCardInfo.CardBlockSize;
 							result = RES_OK;
 							break;	 
 					case GET_SECTOR_COUNT:
@@ -170,7 +209,8 @@ DRESULT disk_ioctl (
 }
 
 
+/* no RTC: a fixed valid date (2016-01-01) rather than the invalid 0 */
 DWORD get_fattime (void)
-{				 
-	return 0;
-}	
+{
+	return ((DWORD)(2016 - 1980) << 25) | (1UL << 21) | (1UL << 16);
+}
@@ -36,6 +36,19 @@ DRESULT disk_write (BYTE pdrv, const BYTE* buff, DWORD sector, UINT count);
 DRESULT disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 
 
+/* SD errors seen by disk_read()/disk_write() (diskio.c), sent by GET_DEVICE/SD_ERRORS */
+#define DISK_ERROR_KINDS	42		/* SD_Error values; [0] counts any other */
+
+struct disk_stats {
+	DWORD	retries;			/* accesses repeated */
+	DWORD	slowdowns;			/* bus clock steps down */
+	DWORD	reinits;			/* SD_Init() by the retry policy */
+	DWORD	failed;				/* nonzero once the card was given up */
+	WORD	errors[DISK_ERROR_KINDS];	/* by SD_Error */
+};
+
+extern struct disk_stats disk_stats;
+
 /* Disk Status Bits (DSTATUS) */
 
 #define STA_NOINIT		0x01	/* Drive not initialized */
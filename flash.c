@@ -0,0 +1,130 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * Block access to the memory-mapped application flash.
+ *
+ * Blank checks, erase verify, compares and the CRC read flash through
+ * these instead of a flash_func_read_word() call per word: four words per
+ * iteration, so the loads go out as LDM/LDRD and the comparisons fold into
+ * one test.  Addresses are offsets into flash_slot as for the other
+ * flash_func_*() helpers; addresses, lengths and buffers are word aligned.
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bl.h"
+
+#if defined(TARGET_HW_PX4_SIM)
+# define FLASH_WORDS_READ(n)	sim_flash_read(n)
+#else
+# define FLASH_WORDS_READ(n)
+#endif
+
+static inline const uint32_t *
+flash_words(uint32_t address)
+{
+	return (const uint32_t *)(uintptr_t)(address + flash_slot.base);
+}
+
+void
+flash_func_read_block(uint32_t address, void *buf, unsigned len)
+{
+	const uint32_t *src = flash_words(address);
+	uint32_t *dst = buf;
+	unsigned n = len / 4;
+
+	FLASH_WORDS_READ(n);
+
+	for (; n >= 4; n -= 4, src += 4, dst += 4) {
+		uint32_t a = src[0], b = src[1], c = src[2], d = src[3];
+
+		dst[0] = a;
+		dst[1] = b;
+		dst[2] = c;
+		dst[3] = d;
+	}
+
+	while (n--) {
+		*dst++ = *src++;
+	}
+}
+
+bool
+flash_func_is_blank(uint32_t address, unsigned len)
+{
+	const uint32_t *p = flash_words(address);
+	const uint32_t *end = p + len / 4;
+	bool blank = true;
+
+	for (; end - p >= 4; p += 4) {
+		if ((p[0] & p[1] & p[2] & p[3]) != 0xffffffff) {
+			blank = false;
+			break;
+		}
+	}
+
+	for (; blank && p < end; p++) {
+		blank = (*p == 0xffffffff);
+	}
+
+	FLASH_WORDS_READ(len / 4 - (end - p));
+	return blank;
+}
+
+bool
+flash_func_compare(uint32_t address, const void *buf, unsigned len)
+{
+	const uint32_t *p = flash_words(address);
+	const uint32_t *end = p + len / 4;
+	const uint32_t *b = buf;
+	bool same = true;
+
+	for (; end - p >= 4; p += 4, b += 4) {
+		if ((p[0] ^ b[0]) | (p[1] ^ b[1]) | (p[2] ^ b[2]) | (p[3] ^ b[3])) {
+			same = false;
+			break;
+		}
+	}
+
+	for (; same && p < end; p++, b++) {
+		same = (*p == *b);
+	}
+
+	FLASH_WORDS_READ(len / 4 - (end - p));
+	return same;
+}
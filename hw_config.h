@@ -26,6 +26,7 @@
 # define BOARD_TYPE                     5
 # define BOARD_FLASH_SECTORS            11
 # define BOARD_FLASH_SIZE               (1024 * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
 
 # define OSC_FREQ                       24
 
@@ -47,6 +48,12 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPBEN
 
+# define BOARD_USART_DMA                DMA2            // USART1: RX stream 2, TX stream 7, channel 4
+# define BOARD_USART_DMA_CLOCK_BIT      RCC_AHB1ENR_DMA2EN
+# define BOARD_USART_DMA_CHANNEL        DMA_SxCR_CHSEL_4
+# define BOARD_USART_DMA_RX_STREAM      DMA_STREAM2
+# define BOARD_USART_DMA_TX_STREAM      DMA_STREAM7
+
 /*
  * Uncommenting this allows to force the bootloader through
  * the PPM-in pin. Some receivers pull their PPM output low
@@ -81,6 +88,13 @@
 # define _FLASH_KBYTES                  (*(uint16_t *)0x1fff7a22)
 # define BOARD_FLASH_SECTORS            ((_FLASH_KBYTES == 0x400) ? 10 : 22)   //共计24个sectors,由于前两个sectors用于BL,故需要操作的为22个sectors
 # define BOARD_FLASH_SIZE               (_FLASH_KBYTES * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
+/*
+ * A/B slots on 2 MB parts (slots.c): the app area drops to 992 KB, one
+ * bank each, and a new image boots on trial:
+ *
+ * # define BOARD_AB_SLOTS
+ */
 
 # define OSC_FREQ                       24
 
@@ -120,6 +134,55 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPDEN
 
+# define BOARD_USART_DMA                DMA1            // USART3: RX stream 1, TX stream 3, channel 4
+# define BOARD_USART_DMA_CLOCK_BIT      RCC_AHB1ENR_DMA1EN
+# define BOARD_USART_DMA_CHANNEL        DMA_SxCR_CHSEL_4
+# define BOARD_USART_DMA_RX_STREAM      DMA_STREAM1
+# define BOARD_USART_DMA_TX_STREAM      DMA_STREAM3
+
+/*
+ * Boot straight to the app without touching the SD card unless the app
+ * set the update-pending RTC flag, or there is no app to boot.  fw.bin
+ * is then only applied when the board stays in the bootloader (USB
+ * plugged in) and times out, so a card written on a PC is not picked up
+ * on a plain power cycle; opt in where the app sets the flag:
+ *
+ * # define BOARD_SD_LAZY_BOOT
+ */
+
+/*
+ * USB disk mode (msc.c): the card is exposed over USB when the app writes
+ * 0xb007d15c to RTC backup register 0 and resets; fw.bin copied onto it is
+ * applied once the host ejects the disk.  Boards with force-bootloader
+ * pins can also enter it with the pins strapped and USB connected.  Opt
+ * in where the bootloader's 32 KB still has room for it:
+ *
+ * # define BOARD_USB_MSC
+ * # define BOARD_USB_MSC_FORCE_PIN
+ */
+
+/*
+ * Images with a SHA-256 trailer (px_mkfw.py --digest) are hashed before
+ * they boot, once per new image (image.c).  Per policy, hash at every boot
+ * or refuse images without a trailer; F437/F439 parts can use the HASH
+ * processor.  Opt in where the bootloader's 32 KB still has room for it:
+ *
+ * # define BOARD_IMAGE_DIGEST
+ * # define BOARD_IMAGE_DIGEST_ALWAYS
+ * # define BOARD_IMAGE_DIGEST_REQUIRED
+ * # define BOARD_HASH
+ */
+
+/*
+ * A card-detect switch, if the board has one, skips SD_Init() when the
+ * slot is empty:
+ *
+ * # define BOARD_SD_DETECT_PORT           GPIOx
+ * # define BOARD_SD_DETECT_CLOCK_BIT      RCC_AHB1ENR_IOPxEN
+ * # define BOARD_SD_DETECT_PIN            GPIOn
+ * # define BOARD_SD_DETECT_STATE          0
+ */
+
 /*
  * Uncommenting this allows to force the bootloader through
  * a PWM output pin. As this can accidentally initialize
@@ -153,6 +216,7 @@
 # define _FLASH_KBYTES                  (*(uint16_t *)0x1fff7a22)
 # define BOARD_FLASH_SECTORS            ((_FLASH_KBYTES == 0x400) ? 11 : 23)
 # define BOARD_FLASH_SIZE               (_FLASH_KBYTES * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
 
 # define OSC_FREQ                       24
 
@@ -174,6 +238,12 @@
 # define BOARD_USART_PIN_CLOCK_REGISTER RCC_AHB1ENR
 # define BOARD_USART_PIN_CLOCK_BIT  	RCC_AHB1ENR_IOPBEN
 
+# define BOARD_USART_DMA                DMA2            // USART1: RX stream 2, TX stream 7, channel 4
+# define BOARD_USART_DMA_CLOCK_BIT      RCC_AHB1ENR_DMA2EN
+# define BOARD_USART_DMA_CHANNEL        DMA_SxCR_CHSEL_4
+# define BOARD_USART_DMA_RX_STREAM      DMA_STREAM2
+# define BOARD_USART_DMA_TX_STREAM      DMA_STREAM7
+
 /*
  * Uncommenting this allows to force the bootloader through
  * a PWM output pin. As this can accidentally initialize
@@ -205,6 +275,7 @@
 # define BOARD_TYPE                     6
 # define BOARD_FLASH_SECTORS            11
 # define BOARD_FLASH_SIZE               (1024 * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
 
 # define OSC_FREQ                       24
 
@@ -232,6 +303,7 @@
 # define BOARD_TYPE                     99
 # define BOARD_FLASH_SECTORS            11
 # define BOARD_FLASH_SIZE               (1024 * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
 
 # define OSC_FREQ                       8
 
@@ -305,6 +377,7 @@
 # define BOARD_TYPE                     98
 # define BOARD_FLASH_SECTORS            23
 # define BOARD_FLASH_SIZE               (2048 * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
 
 # define OSC_FREQ                       24
 
@@ -369,6 +442,32 @@
 # define BOARD_TYPE                     0x14
 # define FLASH_SECTOR_SIZE              0x400
 
+/****************************************************************************
+ * TARGET_HW_PX4_SIM
+ *
+ * Host simulation of an FMUv2-class F427 (see main_sim.c); flash, SD card
+ * and the bootloader link are emulated, UART7 goes to stderr.
+ ****************************************************************************/
+
+#elif  defined(TARGET_HW_PX4_SIM)
+
+# define APP_LOAD_ADDRESS               0x08008000
+# define BOOTLOADER_DELAY               5000
+# define BOARD_SIM
+# define INTERFACE_USB                  0
+# define INTERFACE_USART                1
+# define BOOT_DELAY_ADDRESS             0x000001a0
+
+# define BOARD_TYPE                     9
+# define BOARD_FLASH_SECTORS            22
+# define BOARD_FLASH_SIZE               (2048 * 1024)
+# define BOARD_FLASH_PROGRAM_WIDTH      4               // x32, see sd_upload.c
+# define BOARD_AB_SLOTS                                 // see slots.c
+# define BOARD_AB_BOOT_ATTEMPTS         3
+# define BOARD_IMAGE_DIGEST                             // see image.c
+
+# define OSC_FREQ                       24
+
 #else
 # error Undefined Target Hardware
 #endif
@@ -0,0 +1,197 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * Image digest check before boot (BOARD_IMAGE_DIGEST).
+ *
+ * px_mkfw.py --digest appends a trailer to the image,
+ * <"PXSH"><length:4><SHA-256:32>, and stores its offset, the length the
+ * digest covers, in the first reserved exception vector, which the core
+ * never reads.  jump_to_app() refuses an image whose digest does not match.
+ * The boot delay word, which SET_DELAY programs after the upload, is
+ * hashed as 0xffffffff on both sides.
+ *
+ * Hashing the image on every boot would cost up to a few hundred ms in
+ * software, so a match is remembered in RTC backup register 3 as a CRC of
+ * the first digest words, the trailer length and the slot; the next boots
+ * of the same image in the same slot skip it.  A new image has a new key
+ * and is hashed once, and image_invalidate() clears the register whenever
+ * an update starts writing a slot, so a stale match never outlives the
+ * image it was made for.
+ * BOARD_IMAGE_DIGEST_ALWAYS hashes at every boot, and with
+ * BOARD_IMAGE_DIGEST_REQUIRED images without a trailer no longer boot.
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(BOARD_IMAGE_DIGEST) && !defined(TARGET_HW_PX4_SIM)
+# include <libopencm3/stm32/rcc.h>
+# include <libopencm3/stm32/pwr.h>
+#endif
+
+#include "bl.h"
+#include "crc32.h"
+#include "sha256.h"
+#include "trace.h"
+
+#if defined(BOARD_IMAGE_DIGEST)
+
+#define IMAGE_TRAILER_VECTOR	7		/* first reserved exception vector */
+#define IMAGE_TRAILER_MAGIC	0x48535850	/* "PXSH" */
+#define IMAGE_VERIFIED_REG	MMIO32(RTC_BASE + 0x5c)	/* RTC backup register 3 */
+
+#ifdef BOOT_DELAY_ADDRESS
+# define IMAGE_SKIP_WORD	BOOT_DELAY_ADDRESS	/* written by SET_DELAY */
+#else
+# define IMAGE_SKIP_WORD	~0u
+#endif
+
+struct image_trailer {
+	uint32_t	magic;
+	uint32_t	length;
+	uint8_t		digest[SHA256_DIGEST_SIZE];
+};
+
+#if defined(BOARD_IMAGE_DIGEST_REQUIRED)
+# define IMAGE_UNSIGNED_BOOTS	false
+#else
+# define IMAGE_UNSIGNED_BOOTS	true
+#endif
+
+#if defined(TARGET_HW_PX4_SIM)
+# define image_verified_get()	(sim_image_reg)
+# define image_verified_set(v)	(sim_image_reg = (v))
+#else
+static uint32_t
+image_verified_get(void)
+{
+	/* enable the backup registers */
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	uint32_t value = IMAGE_VERIFIED_REG;
+
+	PWR_CR &= ~PWR_CR_DBP;
+	return value;
+}
+
+static void
+image_verified_set(uint32_t value)
+{
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	IMAGE_VERIFIED_REG = value;
+
+	PWR_CR &= ~PWR_CR_DBP;
+}
+#endif
+
+/* app_base is the slot flash_func_*() point at, see slot_boot() */
+bool
+image_verify(const uint32_t *app_base)
+{
+	uint32_t length = app_base[IMAGE_TRAILER_VECTOR];
+	const struct image_trailer *trailer;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	/* a handler address or anything else out of range: no trailer */
+	if (length <= IMAGE_TRAILER_VECTOR * 4 || (length & 3) ||
+	    length > board_info.fw_size - sizeof(*trailer)) {
+		return IMAGE_UNSIGNED_BOOTS;
+	}
+
+	trailer = (const struct image_trailer *)(uintptr_t)((uint32_t)(uintptr_t)app_base + length);
+
+	if (trailer->magic != IMAGE_TRAILER_MAGIC || trailer->length != length) {
+		return IMAGE_UNSIGNED_BOOTS;
+	}
+
+	/* the slot goes in too, the same image may sit in both */
+	uint32_t id[4];
+
+	memcpy(id, trailer->digest, 2 * sizeof(id[0]));
+	id[2] = length;
+	id[3] = (uint32_t)(uintptr_t)app_base;
+
+	uint32_t key = crc32((const uint8_t *)id, sizeof(id), 0);
+
+#if !defined(BOARD_IMAGE_DIGEST_ALWAYS)
+
+	if (image_verified_get() == key) {
+		return true;
+	}
+
+#endif
+
+	trace_point(TRACE_VERIFY);
+	uint32_t start = (uint32_t)(uintptr_t)app_base - flash_slot.base;
+
+	sha256_flash(start, length, start + IMAGE_SKIP_WORD, digest);
+
+	if (memcmp(digest, trailer->digest, sizeof(digest)) != 0) {
+		image_verified_set(0);
+		return false;
+	}
+
+	image_verified_set(key);
+	return true;
+}
+
+/* the slot is about to be written, forget what was verified */
+void
+image_invalidate(void)
+{
+	image_verified_set(0);
+}
+
+#else
+
+bool
+image_verify(const uint32_t *app_base)
+{
+	(void)app_base;
+	return true;
+}
+
+void
+image_invalidate(void)
+{
+}
+
+#endif
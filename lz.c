@@ -0,0 +1,182 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * LZ decoder for compressed firmware, see lz.h for the format.
+ *
+ * The decoder is a resumable state machine, so input can be fed in
+ * whatever pieces f_read() or the serial link deliver and output taken in
+ * whatever pieces the flash programming loop wants.
+ */
+
+#include <stdint.h>
+
+#include "lz.h"
+
+enum {
+	LZ_TOKEN = 0,
+	LZ_LITERAL_LENGTH,
+	LZ_LITERAL,
+	LZ_OFFSET_LOW,
+	LZ_OFFSET_HIGH,
+	LZ_MATCH_LENGTH,
+	LZ_MATCH,
+};
+
+#define LZ_MASK		(LZ_WINDOW - 1)
+
+void
+lz_init(struct lz_state *lz)
+{
+	lz->pos = 0;
+	lz->count = 0;
+	lz->state = LZ_TOKEN;
+}
+
+int
+lz_decode(struct lz_state *lz, const uint8_t **in, const uint8_t *end, uint8_t *out, unsigned len)
+{
+	const uint8_t *p = *in;
+	unsigned n = 0;
+
+	while (n < len) {
+		unsigned k;
+
+		switch (lz->state) {
+		case LZ_TOKEN:
+			if (p == end) {
+				goto done;
+			}
+
+			lz->token = *p++;
+			lz->count = lz->token >> 4;
+			lz->state = (lz->count == 15) ? LZ_LITERAL_LENGTH : LZ_LITERAL;
+			break;
+
+		case LZ_LITERAL_LENGTH:
+		case LZ_MATCH_LENGTH:
+			if (p == end) {
+				goto done;
+			}
+
+			lz->count += *p;
+
+			/* on to LZ_LITERAL or LZ_MATCH */
+			if (*p++ != 255) {
+				lz->state++;
+			}
+
+			break;
+
+		case LZ_LITERAL:
+			if (lz->count == 0) {
+				lz->state = LZ_OFFSET_LOW;
+				break;
+			}
+
+			if (p == end) {
+				goto done;
+			}
+
+			k = len - n;
+
+			if (k > lz->count) {
+				k = lz->count;
+			}
+
+			if (k > (unsigned)(end - p)) {
+				k = end - p;
+			}
+
+			lz->count -= k;
+
+			while (k--) {
+				lz->window[lz->pos++ & LZ_MASK] = out[n++] = *p++;
+			}
+
+			break;
+
+		case LZ_OFFSET_LOW:
+			if (p == end) {
+				goto done;
+			}
+
+			lz->offset = *p++;
+			lz->state = LZ_OFFSET_HIGH;
+			break;
+
+		case LZ_OFFSET_HIGH:
+			if (p == end) {
+				goto done;
+			}
+
+			lz->offset |= *p++ << 8;
+
+			if (lz->offset == 0 || lz->offset > LZ_WINDOW || lz->offset > lz->pos) {
+				return -1;
+			}
+
+			lz->count = (lz->token & 15) + LZ_MIN_MATCH;
+			lz->state = ((lz->token & 15) == 15) ? LZ_MATCH_LENGTH : LZ_MATCH;
+			break;
+
+		case LZ_MATCH:
+			if (lz->count == 0) {
+				lz->state = LZ_TOKEN;
+				break;
+			}
+
+			k = len - n;
+
+			if (k > lz->count) {
+				k = lz->count;
+			}
+
+			lz->count -= k;
+
+			/* byte by byte: the match may overlap what it produces */
+			while (k--) {
+				uint8_t c = lz->window[(lz->pos - lz->offset) & LZ_MASK];
+
+				lz->window[lz->pos++ & LZ_MASK] = out[n++] = c;
+			}
+
+			break;
+		}
+	}
+
+done:
+	*in = p;
+	return n;
+}
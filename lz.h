@@ -0,0 +1,72 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/**
+ * @file lz.h
+ *
+ * Streaming decoder for LZ-compressed firmware images.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Sequences of LZ4 block format: a token with literal and match length
+ * nibbles (15 continues in following bytes, 255 meaning more), the
+ * literals, a 16-bit little endian match offset and any match length
+ * bytes; matches are at least 4 bytes.  Offsets are limited to the
+ * window, so the decoder needs nothing but the last LZ_WINDOW bytes.
+ */
+#define LZ_WINDOW_BITS	12
+#define LZ_WINDOW	(1 << LZ_WINDOW_BITS)
+#define LZ_MIN_MATCH	4
+
+struct lz_state {
+	uint8_t		window[LZ_WINDOW];
+	uint32_t	pos;		/* bytes decoded */
+	uint32_t	count;		/* literals or match bytes still to go */
+	uint16_t	offset;
+	uint8_t		token;
+	uint8_t		state;
+};
+
+extern void lz_init(struct lz_state *lz);
+
+/*
+ * Decode up to len bytes into out from the input at *in, stopping early
+ * when the input runs out; *in is advanced past what was consumed.
+ * Returns the number of bytes decoded, or -1 on a corrupt stream.
+ */
+extern int lz_decode(struct lz_state *lz, const uint8_t **in, const uint8_t *end, uint8_t *out, unsigned len);
@@ -187,6 +187,19 @@ flash_func_erase_sector(unsigned sector)
 	}
 }
 
+/* pages erase in a few ms, there is nothing to overlap */
+void
+flash_func_start_erase(unsigned sector)
+{
+	flash_func_erase_sector(sector);
+}
+
+bool
+flash_func_busy(void)
+{
+	return false;
+}
+
 void
 flash_func_write_word(uint32_t address, uint32_t word)
 {
@@ -11,16 +11,18 @@
 #include <libopencm3/stm32/flash.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/stm32/pwr.h>
 # include <libopencm3/stm32/timer.h>
 
 #include "bl.h"
 #include "uart.h"
+#include "trace.h"
+#include "msc.h"
 //#include "sdio.h"
 #include "ff.h"
 #include "SD_Card.h"
 
-uint32_t blankFlag=0;
 /* flash parameters that we should not really know */
 static struct {
 	uint32_t	sector_number;
@@ -86,9 +88,6 @@ typedef struct mcu_des_t {
 } mcu_des_t;
 
 FATFS  Fatfs;
-FIL backupfile;
-FIL file;
-FIL oldfile;
 
 // The default CPU ID  of STM32_UNKNOWN is 0 and is in offset 0
 // Before a rev is known it is set to ?
@@ -146,15 +145,19 @@ struct boardinfo board_info = {
 };
 
 static void board_init(void);
-static void Fatfs_init();
-static void Fatfs_deinit();
+static bool Fatfs_init(void);
+static void Fatfs_deinit(void);
 static void UART7_init();
 static void UART7_deinit();
-static void SD_upload();
-void read_chip_to_sd();
 
 #define BOOT_RTC_SIGNATURE	0xb007b007
 #define BOOT_RTC_REG		MMIO32(RTC_BASE + 0x50)
+#define UPDATE_RTC_SIGNATURE	0x5d0bda7e	/* set by the app: fw.bin is waiting on the card */
+#define UPDATE_RTC_REG		MMIO32(RTC_BASE + 0x54)
+#define MSC_RTC_SIGNATURE	0xb007d15c	/* set by the app: come up as a USB disk */
+
+/* SD card and the UART7 console, brought up on first use */
+static enum { SD_IDLE, SD_MOUNTED, SD_ABSENT } sd_state;
 
 /* standard clocking for all F4 boards */
 static const clock_scale_t clock_setup = {
@@ -200,6 +203,27 @@ static void board_set_rtc_signature(uint32_t sig)
 	PWR_CR &= ~PWR_CR_DBP;
 }
 
+#if defined(BOARD_SD_LAZY_BOOT)
+/* read and clear the update-pending flag */
+static bool board_test_update_pending(void)
+{
+	/* enable the backup registers */
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	bool pending = (UPDATE_RTC_REG == UPDATE_RTC_SIGNATURE);
+
+	if (pending) {
+		UPDATE_RTC_REG = 0;
+	}
+
+	/* write-protect the backup domain again, leaving the RTC clock be */
+	PWR_CR &= ~PWR_CR_DBP;
+
+	return pending;
+}
+#endif
+
 static bool board_test_force_pin()
 {
 #if defined(BOARD_FORCE_BL_PIN_IN) && defined(BOARD_FORCE_BL_PIN_OUT)
@@ -351,8 +375,9 @@ static void board_init(void)
 
 #endif
 
-	UART7_init();
-	Fatfs_init();
+#if !defined(BOARD_SD_LAZY_BOOT)
+	board_sd_mount();
+#endif
 
 #if defined(BOARD_FORCE_BL_PIN_IN) && defined(BOARD_FORCE_BL_PIN_OUT)
 	/* configure the force BL pins */
@@ -386,6 +411,9 @@ static void board_init(void)
 
 	/* enable the power controller clock */
 	rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_PWREN);
+
+	/* A/B slots once fw_size is known, they need the backup registers */
+	slots_init();
 }
 
 void UART7_init(void)
@@ -435,8 +463,11 @@ void board_deinit(void)
 	gpio_mode_setup(BOARD_FORCE_BL_PORT, GPIO_MODE_INPUT, GPIO_PUPD_NONE, BOARD_FORCE_BL_PIN_IN);
 #endif
 //卸载文件系统，关闭串口7
-	UART7_deinit();
-	Fatfs_deinit();
+	if (sd_state != SD_IDLE) {
+		UART7_deinit();
+		Fatfs_deinit();
+		sd_state = SD_IDLE;
+	}
 //卸载文件系统，关闭串口7
 #if defined(BOARD_FORCE_BL_PIN)
 	/* deinitialise the force BL pin */
@@ -507,75 +538,90 @@ clock_deinit(void)
 uint32_t
 flash_func_sector_size(unsigned sector)
 {
-	if (sector < (BOARD_FLASH_SECTORS)) {
+	if (sector < flash_slot.sectors && flash_slot.first + sector < (BOARD_FLASH_SECTORS)) {
 	//if (sector < (BOARD_FLASH_SECTORS-1)) {  //这样ＯＫ
-		return flash_sectors[sector].size;
+		return flash_sectors[flash_slot.first + sector].size;
 	}
 
 	return 0;
 }
 
-void flash_func_read_sector(unsigned sector)
+static bool
+flash_sector_blank(unsigned sector)
 {
-	UINT bwn;
-	uint32_t chipData[1]={0};
-	if(sector >= BOARD_FLASH_SECTORS) {
-		return;    //如果要求读取的sector超过芯片固有的就返回
-	}
-
-	//得到sector的相对偏移地址
-	uint32_t address =0;
+	/* get the base address of the sector */
+	uint32_t address = 0;
 
 	for (unsigned i = 0; i < sector; i++) {
-		address +=flash_func_sector_size(i);
+		address += flash_func_sector_size(i);
 	}
 
-
-	uint32_t size = flash_func_sector_size(sector);    //得到当前sector的大小
-	//检查这个sector是否是空
-	if((flash_func_read_word(address)==0xffffffff)&&(flash_func_read_word(address+4)==0xffffffff)&&(flash_func_read_word(address+16)==0xffffffff)) {
-		blankFlag=1;
-		return;
-	}
-	for(uint32_t i=0; i <size;i += sizeof(uint32_t)) {
-		chipData[0]=flash_func_read_word(address+i);
-		f_write (&backupfile,chipData,4,&bwn);
-	}
+	return flash_func_is_blank(address, flash_func_sector_size(sector));
 }
+
 void
 flash_func_erase_sector(unsigned sector)
 {
-	if (sector >= BOARD_FLASH_SECTORS) {
+	if (flash_func_sector_size(sector) == 0) {
 		return;
 	}
 
-	/* get the base address of the sector */
-	uint32_t address = 0;
+	/* erase the sector if it failed the blank check */
+	if (!flash_sector_blank(sector)) {
+		flash_erase_sector(flash_sectors[flash_slot.first + sector].sector_number, FLASH_CR_PROGRAM_X32);
+	}
+}
 
-	for (unsigned i = 0; i < sector; i++) {
-		address += flash_func_sector_size(i);
+/*
+ * Start erasing a sector without waiting for it to complete; poll
+ * flash_func_busy() until it returns false before programming.  Code runs
+ * from the same flash, so on single-bank parts any fetch stalls until the
+ * erase is done; only what DMA and the USB FIFO take in goes on meanwhile.
+ */
+void
+flash_func_start_erase(unsigned sector)
+{
+	if (flash_func_sector_size(sector) == 0 || flash_sector_blank(sector)) {
+		return;
 	}
 
-	/* blank-check the sector */
-	unsigned size = flash_func_sector_size(sector);
-	bool blank = true;
+	while (FLASH_SR & FLASH_SR_BSY);
 
-	for (unsigned i = 0; i < size; i += sizeof(uint32_t)) {
-		if (flash_func_read_word(address + i) != 0xffffffff) {
-			blank = false;
-			break;
-		}
-	}
-	/* erase the sector if it failed the blank check */
-	if (!blank) {
-		flash_erase_sector(flash_sectors[sector].sector_number, FLASH_CR_PROGRAM_X32);
-	}
+	FLASH_CR &= ~(FLASH_CR_PROGRAM_X64 | (FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT));
+	FLASH_CR |= FLASH_CR_PROGRAM_X32 | FLASH_CR_SER |
+		    ((flash_sectors[flash_slot.first + sector].sector_number & FLASH_CR_SNB_MASK) << FLASH_CR_SNB_SHIFT);
+	FLASH_CR |= FLASH_CR_STRT;
 }
 
 void
 flash_func_write_word(uint32_t address, uint32_t word)
 {
-	flash_program_word(address + APP_LOAD_ADDRESS, word);
+	flash_program_word(address + flash_slot.base, word);
+}
+
+/*
+ * Start programming a word without waiting for it to complete; poll
+ * flash_func_busy() before issuing any other flash operation.
+ */
+void
+flash_func_start_word(uint32_t address, uint32_t word)
+{
+	while (FLASH_SR & FLASH_SR_BSY);
+
+	FLASH_CR &= ~FLASH_CR_PROGRAM_X64;
+	FLASH_CR |= FLASH_CR_PROGRAM_X32 | FLASH_CR_PG;
+	MMIO32(address + flash_slot.base) = word;
+}
+
+bool
+flash_func_busy(void)
+{
+	if (FLASH_SR & FLASH_SR_BSY) {
+		return true;
+	}
+
+	FLASH_CR &= ~(FLASH_CR_PG | FLASH_CR_SER | (FLASH_CR_SNB_MASK << FLASH_CR_SNB_SHIFT));
+	return false;
 }
 
 uint32_t
@@ -585,7 +631,7 @@ flash_func_read_word(uint32_t address)
 		return 0;
 	}
 
-	return *(uint32_t *)(address + APP_LOAD_ADDRESS);
+	return *(uint32_t *)(address + flash_slot.base);
 }
 
 
@@ -719,161 +765,110 @@ led_toggle(unsigned led)
 # define SCB_CPACR (*((volatile uint32_t *) (((0xE000E000UL) + 0x0D00UL) + 0x088)))
 #endif
 
+//串口报告SD_Init选定的总线时钟、是否高速模式和卡的速度等级
+static void sd_report_bus(void)
+{
+	uint8_t bus[]="SD bus      :    MHz";
+	uint8_t hs[]=" high speed";
+	uint8_t cls[]=", class   ";
+	uint8_t crlf[]="\r\n";
+	unsigned mhz = SD_ClockKHz / 1000;
+
+	bus[14] = (mhz >= 10) ? '0' + mhz / 10 : ' ';
+	bus[15] = '0' + mhz % 10;
+	uart7_cout(UART7, bus, sizeof(bus) - 1);
+
+	if (SD_HighSpeed) {
+		uart7_cout(UART7, hs, sizeof(hs) - 1);
+	}
+
+	if (SD_SpeedClass) {
+		cls[8] = (SD_SpeedClass >= 10) ? '0' + SD_SpeedClass / 10 : ' ';
+		cls[9] = '0' + SD_SpeedClass % 10;
+		uart7_cout(UART7, cls, sizeof(cls) - 1);
+	}
+
+	uart7_cout(UART7, crlf, sizeof(crlf) - 1);
+}
+
 //该函数主要作用是初始化SD卡，挂载FatFs文件系统
-void Fatfs_init()
+bool Fatfs_init(void)
 {
 
 	uint8_t Res=0;
 	uint8_t fail_mount[]="Fail to mount fatfs. Please try again  \r\n";
 	uint8_t sd_not_found[]="Fail to find SD Card . Please insert SD Card  \r\n";
 	//初始化SD卡，成功返回值0，失败进入循环处理（按需更改）
+#if defined(BOARD_SD_DETECT_PIN)
+	//卡座检测脚报告无卡时不再上电初始化，省去SD_Init的超时
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, BOARD_SD_DETECT_CLOCK_BIT);
+	gpio_mode_setup(BOARD_SD_DETECT_PORT, GPIO_MODE_INPUT, GPIO_PUPD_PULLUP, BOARD_SD_DETECT_PIN);
+
+	if (gpio_get(BOARD_SD_DETECT_PORT, BOARD_SD_DETECT_PIN) != BOARD_SD_DETECT_STATE) {
+		uart7_cout(UART7, sd_not_found, sizeof(sd_not_found));
+		return false;
+	}
+#endif
+	trace_point(TRACE_SD_POWER);
 	if(SD_Init()) {
 		uart7_cout(UART7, sd_not_found, sizeof(sd_not_found));
 		//jump_to_app();  //如果SD卡初始化失败，一般都是没有插入SD卡
 		//while(1);
+		return false;
 	} else {
+		trace_point(TRACE_SD_INIT);
+		sd_report_bus();
+		SD_SetDeviceMode(SD_DMA_MODE);    //DMA出错时SD_Card.c自动退回polling模式
 		//加载Fatfs文件系统，初始化盘符，默认为0
 		Res=f_mount(&Fatfs,"",1);
 		if(Res) {   //加载失败，处理函数按需更改
 			uart7_cout(UART7, fail_mount, sizeof(fail_mount));
 			//jump_to_app();
 			//while(1);
+			return false;
 		}
 	}
+
+	return true;
 }
 
-void Fatfs_deinit()
+void Fatfs_deinit(void)
 {
 	f_mount(0,"",1);                           //卸载文件系统
 	SD_Deinit();                              //关闭SD卡
 }
 
-void SD_upload()
+/*
+ * Power up the card and mount it the first time the SD code needs it; a
+ * card that is missing or fails to mount is not retried until the next
+ * boot.
+ */
+bool board_sd_mount(void)
 {
-	uint32_t  program_addr=0x8008000;
-	UINT   br;
-	uint8_t fatbuf[512];
-	uint8_t Res=0;
-	uint8_t backupRes=0;
-	uint8_t block[]={0xa1,0xf6};
-	uint8_t erase_setor[]="Find the file: fw.bin ,begin to upload this file \r\nErasing     : ";
-	uint8_t old_file[]="Find the file:old . to delete this file  \r\n";
-	uint8_t no_file[]="Fail to find the file:fw.bin . \r\n";
-	uint8_t fail_progm[]="Fail to read the file... \r\n ";
-	uint8_t finish[]="\r\nAll finished  ...   \r\n";
-	uint8_t  program[]="\r\nProgramming : ";
-	uint8_t Init_ok[]="Check SD card  ....   \r\n";
-
-	uint8_t backuperase[]="Find the file: backup.bin ,begin to upload this file \r\nErasing     :";
-	uint8_t backupnofile[]="Fail to find the file:backup.bin.\r\n";
-	uart7_cout(UART7, Init_ok, sizeof(Init_ok));
-	Res=f_open(&oldfile,"old",FA_READ);//检查是否能打开“old”文件，如打开成功，则删除
-	if(Res==0)
-	{
-		uart7_cout(UART7, old_file, sizeof(old_file));
-		f_close (&oldfile);
-		f_unlink("old");
-	}
-	backupRes=f_open(&backupfile,"backup.bin",FA_READ);//检查是否能打开“backup.bin”文件，如打开成功，更新后改名
-	if(backupRes==0) {
-		flash_unlock();            //关闭flash写保护
-		uart7_cout(UART7, backuperase, sizeof(backuperase));  //轮循擦除扇区，每擦除一个扇区，LED变化一次，并打印相应信息
-		for (unsigned i = 0; flash_func_sector_size(i) != 0; i++) {
-			flash_func_erase_sector(i);
-			led_toggle(LED_BOOTLOADER);
-			uart7_cout(UART7, block, sizeof(block));
-		}
-		Res=0;
-		uart7_cout(UART7, program, sizeof(program));      //开始写flash
-		do {
-			if(f_read(&backupfile,fatbuf ,512,&br)==0) {//读取成功
-				for(unsigned i=0;i<br;i++) {
-					flash_program_byte(program_addr,fatbuf [i]);//每次读512字节，此为fatfs定义数据长度最大值
-					program_addr++;                //采用字节长度方式写flash。地址加1
-				}
-				Res++;                             //0.5kb加1
-			} else {              //读取失败，按需加入处理函数
-				uart7_cout(UART7, fail_progm, sizeof(fail_progm));
-				break;
-			}
-			if((Res%100)==0) { //如果正好是100的倍数，即为50kb的倍数，串口发送一次状态数据，LED变化一次
-				uart7_cout(UART7, block, sizeof(block));
-				led_toggle( LED_BOOTLOADER);
-			}
-		} while(br==512);                          //当读取至文件末尾，退出
-		flash_lock();                              //打开flash写保护
-		f_close (&backupfile);                     //关闭文件
-		uart7_cout(UART7, finish, sizeof(finish));
-		f_unlink("backup.bin");
-		jump_to_app();                             //跳转至固件
-	} else {
-		uart7_cout(UART7,backupnofile, sizeof(backupnofile));
+	if (sd_state == SD_IDLE) {
+		UART7_init();
+		sd_state = Fatfs_init() ? SD_MOUNTED : SD_ABSENT;
+		trace_point((sd_state == SD_MOUNTED) ? TRACE_SD_MOUNT : TRACE_SD_ABSENT);
 	}
 
-
-	Res=f_open(&file,"fw.bin",FA_READ);         //检查是否能打开“upgrade.bin”文件，打开成功后，更新后改名old
-	if(Res==0) {
-		flash_unlock();            //关闭flash写保护
-		uart7_cout(UART7, erase_setor, sizeof(erase_setor));  //轮循擦除扇区，每擦除一个扇区，LED变化一次，并打印相应信息
-		for (unsigned i = 0; flash_func_sector_size(i) != 0; i++) {
-			flash_func_erase_sector(i);
-			led_toggle( LED_BOOTLOADER);
-			uart7_cout(UART7, block, sizeof(block));
-		}
-		uart7_cout(UART7, program, sizeof(program));      //开始写flash
-		Res=0;
-		do {
-			if(f_read(&file,fatbuf ,512,&br)==0) {//读取成功
-				for(unsigned i=0;i<br;i++) {
-					flash_program_byte(program_addr,fatbuf[i]);//每次读512字节，此为fatfs定义数据长度最大值
-					program_addr++;                //采用字节长度方式写flash。地址加1
-				}
-				Res++;                             //0.5kb加1
-			}else {//读取失败，按需加入处理函数
-				uart7_cout(UART7, fail_progm, sizeof(fail_progm));
-				break;
-			}
-			if((Res%100)==0) {//如果正好是100的倍数，即为50kb的倍数，串口发送一次状态数据，LED变化一次
-				uart7_cout(UART7, block, sizeof(block));
-				led_toggle( LED_BOOTLOADER);
-			}
-		} while(br==512);                           //当读取至文件末尾，退出
-		flash_lock();                              //打开flash写保护
-		f_close (&file);                           //关闭文件
-		uart7_cout(UART7, finish, sizeof(finish));
-		f_rename("FW.bin","old");                  //重命名固件为backup.bin
-	} else {//打开失败，则判定为不更新固件，卸载fatfs，跳转至固件
-		uart7_cout(UART7, no_file, sizeof(no_file));
-	}
+	return sd_state == SD_MOUNTED;
 }
 
-//简要流程： 挂载fatfs系统（在Fatfs初始化中完成了），创建一个名为backup.bin文件，按4字节方式从APP_LOAD_ADDRESS（0x08008000）读取芯片，至0xffffffff。
-void read_chip_to_sd()
+#if defined(BOARD_USB_MSC)
+/*
+ * Serve the card as a USB disk until the host ejects it, then mount it
+ * again: the host has changed the volume behind FatFs' back.
+ */
+static void board_usb_msc(void)
 {
-
-	uint8_t block[]={0xa1,0xf6};
-	uint8_t test1[]="Backup: creat the backup.bin file \r\n";
-	uint8_t test2[]="Backup: finish to read the chip \r\n";
-	uint8_t Res=0;
-	uint8_t unlinkflag=0;
-	flash_unlock();            //关闭flash写保护
-	Res=f_open(&backupfile,"backup.bin",FA_WRITE|FA_CREATE_NEW);//检查是否能打开“backup.bin”文件，如打开成功，则删除
-	if(Res==0) {              //backup.bin 文件创建成功
-		uart7_cout(UART7, test1, sizeof(test1));
-		for (unsigned i = 0; flash_func_sector_size(i) != 0; i++) {
-			flash_func_read_sector(i);
-			uart7_cout(UART7, block, sizeof(block));
-			if(blankFlag==1) {
-				break;       //读取至chip的末尾，跳出
-			}
-		}
+	if (!board_sd_mount()) {
+		return;
 	}
-	flash_lock();           //开启flash写保护
-	if(f_size(&backupfile)==0) unlinkflag=1;   //如果文件为空就删除
-	f_close(&backupfile);
-	if(unlinkflag==1) f_unlink("backup.bin");
-	uart7_cout(UART7, test2, sizeof(test2));
+
+	usb_msc_run();
+	f_mount(&Fatfs, "", 1);
 }
+#endif
 
 int main(void)
 {
@@ -883,15 +878,20 @@ int main(void)
 	/* Enable the FPU before we hit any FP instructions */
 	SCB_CPACR |= ((3UL << 10 * 2) | (3UL << 11 * 2)); /* set CP10 Full Access and set CP11 Full Access */
 
+	/* boot-phase timing, see trace.c */
+	trace_init();
 
 	/* configure the clock for bootloader activity */
 	clock_init();   //初始化时钟
+	trace_clock(board_info.systick_mhz);
+	trace_point(TRACE_CLOCK);
 	//初始化串口7，用作SD卡更新的输出;初始化SD，挂载文件系统
 	//UART7_init();
 	//Fatfs_init();
 	/* do board-specific initialisation */
 		board_init();   //初始化串口时钟，串口IO时钟，开启复用功能
 		                //初始化串口7，SD卡，挂载文件系统
+		trace_point(TRACE_BOARD);
 		//read_chip_to_sd();
 	//初始化串口7，用作SD卡更新的输出;初始化SD，挂载文件系统
 	/*
@@ -918,6 +918,29 @@ int main(void)
 		board_set_rtc_signature(0);
 	}
 
+#if defined(BOARD_USB_MSC)
+
+	/*
+	 * USB disk mode: the host copies fw.bin onto the card, and once it
+	 * ejects the disk the update is applied and the app booted.
+	 */
+	if (board_get_rtc_signature() == MSC_RTC_SIGNATURE
+#if defined(BOARD_USB_MSC_FORCE_PIN)
+	    || (board_test_force_pin() && gpio_get(GPIOA, GPIO9) != 0)
+#endif
+	   ) {
+		board_set_rtc_signature(0);
+		board_usb_msc();
+		SD_upload();
+		jump_to_app();
+
+		/* nothing to boot, stay in the bootloader */
+		try_boot = false;
+		timeout = 0;
+	}
+
+#endif
+
 #ifdef BOOT_DELAY_ADDRESS
 	{
 		/*
@@ -995,7 +1018,20 @@ int main(void)
 #endif
 
 		/* try to boot immediately */
+#if defined(BOARD_SD_LAZY_BOOT)
+
+		/* only touch the card when the app asked for an update */
+		if (board_test_update_pending()) {
+			SD_upload();
+		}
+
+		jump_to_app();
+
+		/* no app: an interrupted update is restored from backup.bin */
+		SD_upload();
+#else
 		SD_upload();
+#endif
 		jump_to_app();
 
 		// If it failed to boot, reset the boot signature and stay in bootloader
@@ -0,0 +1,1500 @@
+/*
+ * Host simulation board for the bootloader.
+ *
+ * Flash is mapped at its real STM32F4 address so bl.c and sd_upload.c run
+ * unmodified; the SD card is an image file behind SD_ReadDisk() and
+ * SD_WriteDisk() under the real diskio.c, the bootloader link is a pty
+ * and UART7 goes to stderr.  Every emulated operation is
+ * charged a nominal on-target cost so CI can compare update timings per
+ * phase (erase, program, verify, CRC, ...) between revisions.
+ */
+
+#define _GNU_SOURCE
+
+#include "hw_config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/dwt.h>
+
+#include "bl.h"
+#include "crc32.h"
+#include "msc.h"
+#include "trace.h"
+#include "uart.h"
+#include "ff.h"
+#include "diskio.h"
+#include "SD_Card.h"
+
+#define SIM_FLASH_BASE		0x08000000
+#define SIM_BANK2_BASE		0x08100000
+#define SIM_SD_BLOCK		512
+
+/* flash parameters, as in main_f4.c */
+static struct {
+	uint32_t	sector_number;
+	uint32_t	size;
+} flash_sectors[] = {
+	{0x02, 16 * 1024},
+	{0x03, 16 * 1024},
+	{0x04, 64 * 1024},
+	{0x05, 128 * 1024},
+	{0x06, 128 * 1024},
+	{0x07, 128 * 1024},
+	{0x08, 128 * 1024},
+	{0x09, 128 * 1024},
+	{0x0a, 128 * 1024},
+	{0x0b, 128 * 1024},
+	{0x10, 16 * 1024},
+	{0x11, 16 * 1024},
+	{0x12, 16 * 1024},
+	{0x13, 16 * 1024},
+	{0x14, 64 * 1024},
+	{0x15, 128 * 1024},
+	{0x16, 128 * 1024},
+	{0x17, 128 * 1024},
+	{0x18, 128 * 1024},
+	{0x19, 128 * 1024},
+	{0x1a, 128 * 1024},
+	{0x1b, 128 * 1024},
+};
+#define BOOTLOADER_RESERVATION_SIZE	(32 * 1024)
+
+#define APP_SIZE_MAX			(BOARD_FLASH_SIZE - BOOTLOADER_RESERVATION_SIZE)
+
+struct boardinfo board_info = {
+	.board_type	= BOARD_TYPE,
+	.board_rev	= 0,
+	.fw_size	= APP_SIZE_MAX,
+
+	.systick_mhz	= 168,
+};
+
+/*
+ * Simulated costs, in ns per operation.  Defaults are typical F427 / class 10
+ * card figures; override any of them with -C name=ns.
+ */
+enum sim_cost {
+	COST_PROGRAM,		/* one flash_program_* operation */
+	COST_ERASE_16K,
+	COST_ERASE_64K,
+	COST_ERASE_128K,
+	COST_READ_WORD,		/* one flash word read by the CPU */
+	COST_READ_BLOCK,	/* one word of a flash.c block access */
+	COST_SHA256,		/* one 64 byte block hashed in C at 168MHz */
+	COST_SD_CMD,		/* command overhead of one disk_read/disk_write */
+	COST_SD_BLOCK,		/* one 512 byte block on a 4-bit 24MHz bus */
+	COST_SD_BUSY,		/* card programming busy after a write */
+	COST_SD_INIT,		/* SD_Init(), identification at 400kHz */
+	COST_CONSOLE_BYTE,	/* UART7 at 57600 */
+	COST_LINK_BYTE,		/* bootloader USART at 921600 */
+	COST_LINK_TURN,		/* host turnaround per command */
+	COST_USB_BYTE,		/* USB full speed bulk, msc command */
+	COST_COUNT
+};
+
+static struct {
+	const char	*name;
+	uint64_t	ns;
+} sim_costs[COST_COUNT] = {
+	[COST_PROGRAM]		= {"program",		16000},
+	[COST_ERASE_16K]	= {"erase16k",		250000000},
+	[COST_ERASE_64K]	= {"erase64k",		500000000},
+	[COST_ERASE_128K]	= {"erase128k",		1000000000},
+	[COST_READ_WORD]	= {"read",		60},
+	[COST_READ_BLOCK]	= {"readblock",		15},
+	[COST_SHA256]		= {"sha256",		18000},	/* 600: the F43x HASH processor */
+	[COST_SD_CMD]		= {"sdcmd",		250000},
+	[COST_SD_BLOCK]		= {"sdblock",		42700},
+	[COST_SD_BUSY]		= {"sdbusy",		1000000},
+	[COST_SD_INIT]		= {"sdinit",		200000000},
+	[COST_CONSOLE_BYTE]	= {"console",		173600},
+	[COST_LINK_BYTE]	= {"link",		10850},
+	[COST_LINK_TURN]	= {"turnaround",	1000000},
+	[COST_USB_BYTE]		= {"usb",		1000},
+};
+
+enum sim_phase {
+	PHASE_OTHER,
+	PHASE_ERASE,
+	PHASE_PROGRAM,
+	PHASE_VERIFY,
+	PHASE_CRC,
+	PHASE_DIGEST,
+	PHASE_SD,
+	PHASE_CONSOLE,
+	PHASE_LINK,
+	PHASE_COUNT
+};
+
+static struct {
+	const char	*name;
+	uint64_t	ops;
+	uint64_t	sim_ns;
+	uint64_t	host_ns;
+} sim_phases[PHASE_COUNT] = {
+	[PHASE_OTHER]	= {"other"},
+	[PHASE_ERASE]	= {"erase"},
+	[PHASE_PROGRAM]	= {"program"},
+	[PHASE_VERIFY]	= {"verify"},
+	[PHASE_CRC]	= {"crc"},
+	[PHASE_DIGEST]	= {"digest"},
+	[PHASE_SD]	= {"sd"},
+	[PHASE_CONSOLE]	= {"console"},
+	[PHASE_LINK]	= {"link"},
+};
+
+static struct {
+	uint64_t	flash_bytes;	/* bytes programmed */
+	uint64_t	flash_erases;
+	uint64_t	flash_bad;	/* programs needing a 0->1 transition */
+	uint64_t	flash_locked;	/* programs/erases while locked */
+	uint64_t	sd_reads;	/* disk_read calls */
+	uint64_t	sd_writes;	/* disk_write calls */
+	uint64_t	sd_rblocks;
+	uint64_t	sd_wblocks;
+	uint64_t	jumps;
+} sim_stats;
+
+static bool		sim_counting;	/* off for card setup and put/get */
+static uint64_t		sim_now;	/* simulated ns since start */
+static uint64_t		sim_window;	/* card transfer time still free for overlap */
+static uint64_t		sim_hidden;	/* simulated ns hidden behind card transfers */
+static enum sim_phase	cur_phase = PHASE_OTHER;
+static uint64_t		phase_start;
+static uint8_t		*flash_mem;
+static bool		flash_locked = true;
+static bool		in_erase;
+static bool		erase_async;	/* flash_func_start_erase() is erasing */
+static uint64_t		erase_done;	/* sim_cpu_now() when that erase completes */
+static int		card_fd = -1;
+static uint32_t		card_blocks;
+static int		link_fd = -1;
+static const char	*link_path;
+static bool		expect_opcode = true;
+static uint8_t		last_opcode;
+static uint8_t		last_out[2];
+static jmp_buf		cmd_jmp;
+static FATFS		Fatfs;
+
+static uint64_t
+host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* switch the phase that host time is charged to */
+static void
+sim_enter(enum sim_phase phase)
+{
+	uint64_t now = host_ns();
+
+	sim_phases[cur_phase].host_ns += now - phase_start;
+	phase_start = now;
+	cur_phase = phase;
+}
+
+static void
+sim_spend(enum sim_phase phase, uint64_t ns, unsigned count)
+{
+	if (!sim_counting) {
+		return;
+	}
+
+	if (phase != cur_phase) {
+		sim_enter(phase);
+	}
+
+	/* work done from SD_WaitHook runs while the card is transferring */
+	if (sim_window > 0) {
+		uint64_t hidden = (ns < sim_window) ? ns : sim_window;
+
+		sim_window -= hidden;
+		sim_hidden += hidden;
+		ns -= hidden;
+	}
+
+	sim_phases[phase].ops += count;
+	sim_phases[phase].sim_ns += ns;
+	sim_now += ns;
+}
+
+/*
+ * Where the CPU is: sim_now less the transfer time it has not used yet,
+ * which later work spends as if it had run during the transfer.
+ */
+static uint64_t
+sim_cpu_now(void)
+{
+	return (sim_window < sim_now) ? sim_now - sim_window : 0;
+}
+
+static void
+sim_charge(enum sim_phase phase, enum sim_cost cost, unsigned count)
+{
+	sim_spend(phase, sim_costs[cost].ns * count, count);
+}
+
+/* flash reads are verify unless we are erasing or answering GET_CRC */
+static enum sim_phase
+sim_read_phase(void)
+{
+	if (in_erase) {
+		return PHASE_ERASE;
+	}
+
+	return (last_opcode == 0x29) ? PHASE_CRC : PHASE_VERIFY;
+}
+
+static void
+sim_report(void)
+{
+	uint64_t sim_total = 0, host_total = 0;
+
+	sim_enter(PHASE_OTHER);
+	printf("%-10s %12s %12s %12s\n", "phase", "ops", "sim_ms", "host_ms");
+
+	for (unsigned i = 0; i < PHASE_COUNT; i++) {
+		printf("%-10s %12" PRIu64 " %12.3f %12.3f\n", sim_phases[i].name, sim_phases[i].ops,
+		       sim_phases[i].sim_ns / 1e6, sim_phases[i].host_ns / 1e6);
+		sim_total += sim_phases[i].sim_ns;
+		host_total += sim_phases[i].host_ns;
+	}
+
+	printf("%-10s %12s %12.3f %12.3f\n", "total", "", sim_total / 1e6, host_total / 1e6);
+	printf("overlap: %.3f ms hidden behind card and link transfers\n", sim_hidden / 1e6);
+	printf("flash: %" PRIu64 " bytes programmed, %" PRIu64 " erases, %" PRIu64 " bad, %" PRIu64 " locked\n",
+	       sim_stats.flash_bytes, sim_stats.flash_erases, sim_stats.flash_bad, sim_stats.flash_locked);
+	printf("card: %" PRIu64 " reads (%" PRIu64 " blocks), %" PRIu64 " writes (%" PRIu64 " blocks), %" PRIu32
+	       " bounced\n", sim_stats.sd_reads, sim_stats.sd_rblocks, sim_stats.sd_writes, sim_stats.sd_wblocks,
+	       SD_BounceReads + SD_BounceWrites);
+	printf("card errors: %" PRIu32 " retries, %" PRIu32 " slowdowns, %" PRIu32 " reinits%s\n",
+	       disk_stats.retries, disk_stats.slowdowns, disk_stats.reinits, disk_stats.failed ? ", given up" : "");
+	printf("jumps: %" PRIu64 "\n", sim_stats.jumps);
+}
+
+/*
+ * libopencm3 flash and systick substitutes
+ */
+
+void
+flash_unlock(void)
+{
+	flash_locked = false;
+}
+
+void
+flash_lock(void)
+{
+	flash_locked = true;
+}
+
+static void
+sim_program(uint32_t address, const void *data, unsigned len)
+{
+	uint8_t *p = flash_mem + (address - SIM_FLASH_BASE);
+	const uint8_t *d = data;
+
+	sim_charge(PHASE_PROGRAM, COST_PROGRAM, 1);
+
+	if (flash_locked) {
+		sim_stats.flash_locked++;
+		return;
+	}
+
+	if (address < SIM_FLASH_BASE || address + len > SIM_FLASH_BASE + BOARD_FLASH_SIZE
+	    || (address & (len - 1))) {
+		sim_stats.flash_bad++;
+		return;
+	}
+
+	for (unsigned i = 0; i < len; i++) {
+		if ((p[i] & d[i]) != d[i]) {
+			sim_stats.flash_bad++;
+		}
+
+		p[i] &= d[i];
+	}
+
+	sim_stats.flash_bytes += len;
+}
+
+void
+flash_program_byte(uint32_t address, uint8_t data)
+{
+	sim_program(address, &data, sizeof(data));
+}
+
+void
+flash_program_half_word(uint32_t address, uint16_t data)
+{
+	sim_program(address, &data, sizeof(data));
+}
+
+void
+flash_program_word(uint32_t address, uint32_t data)
+{
+	sim_program(address, &data, sizeof(data));
+}
+
+void
+flash_program_double_word(uint32_t address, uint64_t data)
+{
+	sim_program(address, &data, sizeof(data));
+}
+
+void
+flash_erase_sector(uint8_t sector, uint32_t program_size)
+{
+	static const uint32_t bank_sizes[] = {16, 16, 16, 16, 64, 128, 128, 128, 128, 128, 128, 128};
+	uint32_t address = (sector & 0x10) ? SIM_BANK2_BASE : SIM_FLASH_BASE;
+	unsigned n = sector & 0x0f;
+	enum sim_cost cost;
+
+	if (n >= arraySize(bank_sizes)) {
+		return;
+	}
+
+	for (unsigned i = 0; i < n; i++) {
+		address += bank_sizes[i] * 1024;
+	}
+
+	switch (bank_sizes[n]) {
+	case 16:
+		cost = COST_ERASE_16K;
+		break;
+
+	case 64:
+		cost = COST_ERASE_64K;
+		break;
+
+	default:
+		cost = COST_ERASE_128K;
+		break;
+	}
+
+	if (erase_async) {
+		/* the time is spent polling flash_func_busy() */
+		sim_spend(PHASE_ERASE, 0, 1);
+		erase_done = sim_counting ? sim_cpu_now() + sim_costs[cost].ns : 0;
+
+	} else {
+		sim_charge(PHASE_ERASE, cost, 1);
+	}
+
+	if (flash_locked) {
+		sim_stats.flash_locked++;
+		return;
+	}
+
+	memset(flash_mem + (address - SIM_FLASH_BASE), 0xff, bank_sizes[n] * 1024);
+	sim_stats.flash_erases++;
+}
+
+/* the cycle counter follows simulated time */
+bool
+dwt_enable_cycle_counter(void)
+{
+	return true;
+}
+
+uint32_t
+dwt_read_cycle_counter(void)
+{
+	return (uint32_t)(sim_now * board_info.systick_mhz / 1000);
+}
+
+static bool systick_irq, systick_run;
+
+static void
+sim_tick(int sig)
+{
+	(void)sig;
+
+	if (systick_irq && systick_run) {
+		sys_tick_handler();
+	}
+}
+
+void
+systick_set_reload(uint32_t value)
+{
+	(void)value;
+}
+
+void
+systick_set_clocksource(uint8_t clocksource)
+{
+	(void)clocksource;
+}
+
+void
+systick_interrupt_enable(void)
+{
+	systick_irq = true;
+}
+
+void
+systick_interrupt_disable(void)
+{
+	systick_irq = false;
+}
+
+void
+systick_counter_enable(void)
+{
+	systick_run = true;
+}
+
+void
+systick_counter_disable(void)
+{
+	systick_run = false;
+}
+
+/*
+ * board functions
+ */
+
+uint32_t
+flash_func_sector_size(unsigned sector)
+{
+	if (sector < flash_slot.sectors && flash_slot.first + sector < (BOARD_FLASH_SECTORS)) {
+		return flash_sectors[flash_slot.first + sector].size;
+	}
+
+	return 0;
+}
+
+void
+flash_func_erase_sector(unsigned sector)
+{
+	if (flash_func_sector_size(sector) == 0) {
+		return;
+	}
+
+	uint32_t address = 0;
+
+	for (unsigned i = 0; i < sector; i++) {
+		address += flash_func_sector_size(i);
+	}
+
+	/* blank-check the sector */
+	in_erase = true;
+	bool blank = flash_func_is_blank(address, flash_func_sector_size(sector));
+	in_erase = false;
+
+	if (!blank) {
+		flash_erase_sector(flash_sectors[flash_slot.first + sector].sector_number, FLASH_CR_PROGRAM_X32);
+	}
+}
+
+void
+flash_func_start_erase(unsigned sector)
+{
+	erase_async = true;
+	flash_func_erase_sector(sector);
+	erase_async = false;
+}
+
+void
+flash_func_write_word(uint32_t address, uint32_t word)
+{
+	flash_program_word(address + flash_slot.base, word);
+}
+
+void
+flash_func_start_word(uint32_t address, uint32_t word)
+{
+	flash_program_word(address + flash_slot.base, word);
+}
+
+/*
+ * An erase runs on in CPU time; polling spends what is left of it in
+ * steps, hidden behind link bytes received meanwhile.
+ */
+bool
+flash_func_busy(void)
+{
+	if (sim_cpu_now() >= erase_done) {
+		return false;
+	}
+
+	uint64_t left = erase_done - sim_cpu_now();
+
+	sim_spend(PHASE_ERASE, (left < 10000) ? left : 10000, 0);
+	return true;
+}
+
+/* flash.c kernels read the mapped flash directly and report here */
+void
+sim_flash_read(unsigned words)
+{
+	sim_charge(sim_read_phase(), COST_READ_BLOCK, words);
+}
+
+/* sha256.c reports each block it hashes */
+void
+sim_hash(unsigned blocks)
+{
+	sim_charge(PHASE_DIGEST, COST_SHA256, blocks);
+}
+
+uint32_t
+flash_func_read_word(uint32_t address)
+{
+	if (address & 3) {
+		return 0;
+	}
+
+	sim_charge(sim_read_phase(), COST_READ_WORD, 1);
+	return *(uint32_t *)(uintptr_t)(address + flash_slot.base);
+}
+
+uint32_t
+flash_func_read_otp(uint32_t address)
+{
+	(void)address;
+	return 0xffffffff;
+}
+
+uint32_t
+flash_func_read_sn(uint32_t address)
+{
+	/* fixed, recognisable serial number */
+	return 0x53494d00 | (address & 0xff);
+}
+
+uint32_t
+get_mcu_id(void)
+{
+	return 0x20016419;	/* STM32F42x rev 3 */
+}
+
+int
+get_mcu_desc(int max, uint8_t *revstr)
+{
+	static const char desc[] = "STM32F42x,3";
+	int len = (max < (int)sizeof(desc) - 1) ? max : (int)sizeof(desc) - 1;
+
+	memcpy(revstr, desc, len);
+	return len;
+}
+
+int
+check_silicon(void)
+{
+	return 0;
+}
+
+void
+led_on(unsigned led)
+{
+	(void)led;
+}
+
+void
+led_off(unsigned led)
+{
+	(void)led;
+}
+
+void
+led_toggle(unsigned led)
+{
+	(void)led;
+}
+
+void
+board_deinit(void)
+{
+}
+
+void
+clock_deinit(void)
+{
+}
+
+/* RTC backup register 2, see slots.c; the commands of one run share it */
+uint32_t sim_slot_reg;
+
+/* RTC backup register 3, see image.c */
+uint32_t sim_image_reg;
+
+void
+sim_jump(const uint32_t *vectors)
+{
+	sim_stats.jumps++;
+	fprintf(stderr, "sim: jump to app in slot %c, sp 0x%08" PRIx32 " pc 0x%08" PRIx32 "\n",
+		((uintptr_t)vectors == APP_LOAD_ADDRESS) ? 'A' : 'B', vectors[0], vectors[1]);
+	longjmp(cmd_jmp, 1);
+}
+
+/*
+ * UART7 console and bootloader link
+ */
+
+void
+uart7_cout(uint32_t whichUsart, uint8_t *buf, unsigned len)
+{
+	(void)whichUsart;
+	sim_charge(PHASE_CONSOLE, COST_CONSOLE_BYTE, len);
+	fwrite(buf, 1, len, stderr);
+}
+
+static void
+link_open(void)
+{
+	struct termios tio;
+
+	if (link_fd >= 0) {
+		return;
+	}
+
+	link_fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (link_fd < 0 || grantpt(link_fd) || unlockpt(link_fd)) {
+		perror("sim: pty");
+		exit(1);
+	}
+
+	/* keep the pty raw so protocol bytes pass untouched */
+	tcgetattr(link_fd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(link_fd, TCSANOW, &tio);
+	fcntl(link_fd, F_SETFL, fcntl(link_fd, F_GETFL) | O_NONBLOCK);
+
+	if (link_path) {
+		unlink(link_path);
+
+		if (symlink(ptsname(link_fd), link_path)) {
+			perror("sim: symlink");
+			exit(1);
+		}
+	}
+
+	fprintf(stderr, "sim: link on %s\n", ptsname(link_fd));
+}
+
+void
+uart_cinit(void *config)
+{
+	(void)config;
+	link_open();
+}
+
+void
+uart_cfini(void)
+{
+	/* the pty stays open so the host tool can reconnect */
+}
+
+int
+uart_cin(void)
+{
+	struct pollfd pfd = { .fd = link_fd, .events = POLLIN };
+	uint8_t c;
+
+	if (link_fd < 0) {
+		return -1;
+	}
+
+	/* don't spin the host while the bootloader waits for input, unless it has frames to program */
+	if (poll(&pfd, 1, (last_opcode == 0x35) ? 0 : 1) <= 0 || read(link_fd, &c, 1) != 1) {
+		return -1;
+	}
+
+	if (expect_opcode) {
+		expect_opcode = false;
+
+		/* streamed frames don't wait for the previous ack */
+		if (c != 0x35 || last_opcode != 0x35) {
+			sim_charge(PHASE_LINK, COST_LINK_TURN, 1);
+			sim_window = 0;
+		}
+
+		last_opcode = c;
+	}
+
+	/* while frames stream in, queued ones are programmed in the gaps */
+	if (last_opcode == 0x35) {
+		uint64_t window = sim_window;
+
+		sim_window = 0;
+		sim_charge(PHASE_LINK, COST_LINK_BYTE, 1);
+		sim_window = window + sim_costs[COST_LINK_BYTE].ns;
+
+	} else {
+		sim_charge(PHASE_LINK, COST_LINK_BYTE, 1);
+	}
+
+	return c;
+}
+
+void
+uart_cout(uint8_t *buf, unsigned len)
+{
+	unsigned done = 0;
+
+	sim_charge(PHASE_LINK, COST_LINK_BYTE, len);
+
+	while (done < len) {
+		ssize_t n = write(link_fd, buf + done, len - done);
+
+		if (n > 0) {
+			done += n;
+
+		} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			break;
+		}
+	}
+
+	/* a status pair ends the command; the next byte in is an opcode */
+	for (unsigned i = 0; i < len; i++) {
+		last_out[0] = last_out[1];
+		last_out[1] = buf[i];
+	}
+
+	if (last_out[0] == 0x12 && (last_out[1] == 0x10 || last_out[1] == 0x11 || last_out[1] == 0x13)) {
+		expect_opcode = true;
+	}
+}
+
+/*
+ * SD card image
+ */
+
+int (*SD_WaitHook)(void);
+
+/* as SD_ReadDisk()/SD_WriteDisk(), blocks of misaligned buffers */
+uint32_t SD_BounceReads;
+uint32_t SD_BounceWrites;
+
+/* SD_Card.c transfer mode; with DMA the CPU is free for the whole command */
+static uint32_t sd_mode = SD_POLLING_MODE;
+
+SD_Error
+SD_SetDeviceMode(uint32_t mode)
+{
+	if (mode != SD_DMA_MODE && mode != SD_POLLING_MODE) {
+		return SD_INVALID_PARAMETER;
+	}
+
+	sd_mode = mode;
+	return SD_OK;
+}
+
+uint32_t
+SD_GetDeviceMode(void)
+{
+	return sd_mode;
+}
+
+/*
+ * SD_Card.c substitutes under the real diskio.c, so its retry policy runs
+ * as on target; -E fails a range of card accesses to exercise it.
+ */
+SD_CardInfo SDCardInfo;
+
+static unsigned		sd_step;	/* SD_ClockStepDown() calls, each halves the bus clock */
+static uint64_t		sd_accesses;	/* SD_ReadDisk/SD_WriteDisk calls while counting */
+static uint64_t		fault_first;
+static uint64_t		fault_count;
+static SD_Error		fault_code = SD_DATA_CRC_FAIL;
+
+SD_Error
+SD_Init(void)
+{
+	sim_charge(PHASE_SD, COST_SD_INIT, 1);
+	return (card_fd >= 0) ? SD_OK : SD_ERROR;
+}
+
+uint8_t
+SD_ClockStepDown(void)
+{
+	if (sd_step + 1 >= SD_CLOCK_STEPS) {
+		return 0;
+	}
+
+	sd_step++;
+	return 1;
+}
+
+/* command and block time of one access; true if -E fails it */
+static bool
+sd_access(uint32_t sector, uint8_t cnt)
+{
+	sim_charge(PHASE_SD, COST_SD_CMD, 1);
+
+	if (sim_counting) {
+		uint64_t n = sd_accesses++;
+
+		if (n >= fault_first && n - fault_first < fault_count) {
+			return true;
+		}
+	}
+
+	sim_charge(PHASE_SD, COST_SD_BLOCK, cnt << sd_step);
+	return false;
+}
+
+uint8_t
+SD_ReadDisk(uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+	if (sector + cnt > card_blocks) {
+		return SD_ADDR_OUT_OF_RANGE;
+	}
+
+	if (sd_access(sector, cnt)) {
+		return fault_code;
+	}
+
+	sim_stats.sd_reads++;
+	sim_stats.sd_rblocks += cnt;
+
+	if ((uintptr_t)buf & 3) {
+		SD_BounceReads += cnt;
+	}
+
+	/*
+	 * The hook runs while DMA streams the blocks in, command time included;
+	 * SD_Card.c does not call it from the polled FIFO loop.
+	 */
+	if (SD_WaitHook && sd_mode == SD_DMA_MODE) {
+		sim_window = (sim_costs[COST_SD_BLOCK].ns * cnt) << sd_step;
+		sim_window += sim_costs[COST_SD_CMD].ns;
+
+		while (sim_window > 0 && SD_WaitHook());
+
+		sim_window = 0;
+	}
+
+	if (pread(card_fd, buf, cnt * SIM_SD_BLOCK, (off_t)sector * SIM_SD_BLOCK) != cnt * SIM_SD_BLOCK) {
+		return SD_ERROR;
+	}
+
+	return SD_OK;
+}
+
+uint8_t
+SD_WriteDisk(uint8_t *buf, uint32_t sector, uint8_t cnt)
+{
+	if (sector + cnt > card_blocks) {
+		return SD_ADDR_OUT_OF_RANGE;
+	}
+
+	if (sd_access(sector, cnt)) {
+		return fault_code;
+	}
+
+	sim_charge(PHASE_SD, COST_SD_BUSY, 1);
+	sim_stats.sd_writes++;
+	sim_stats.sd_wblocks += cnt;
+
+	if ((uintptr_t)buf & 3) {
+		SD_BounceWrites += cnt;
+	}
+
+	if (pwrite(card_fd, buf, cnt * SIM_SD_BLOCK, (off_t)sector * SIM_SD_BLOCK) != cnt * SIM_SD_BLOCK) {
+		return SD_ERROR;
+	}
+
+	return SD_OK;
+}
+
+/* -E first[:count[:code]] */
+static void
+set_fault(const char *arg)
+{
+	char *end;
+
+	fault_first = strtoull(arg, &end, 0);
+	fault_count = 1;
+
+	if (*end == ':') {
+		fault_count = strtoull(end + 1, &end, 0);
+	}
+
+	if (*end == ':') {
+		fault_code = strtoul(end + 1, &end, 0);
+	}
+}
+
+/* the card is mounted by card_open() */
+bool
+board_sd_mount(void)
+{
+	return card_fd >= 0;
+}
+
+static void
+card_open(const char *path, unsigned size_mb)
+{
+	struct stat st;
+	bool fresh = stat(path, &st) != 0;
+
+	card_fd = open(path, O_RDWR | O_CREAT, 0644);
+
+	if (card_fd < 0) {
+		perror(path);
+		exit(1);
+	}
+
+	if (fresh) {
+		if (ftruncate(card_fd, (off_t)size_mb * 1024 * 1024)) {
+			perror(path);
+			exit(1);
+		}
+
+		fstat(card_fd, &st);
+	}
+
+	card_blocks = st.st_size / SIM_SD_BLOCK;
+	SDCardInfo.CardCapacity = (uint64_t)card_blocks * SIM_SD_BLOCK;
+	SDCardInfo.CardBlockSize = 8;
+
+	/* register the work area first, f_mkfs() needs it */
+	f_mount(&Fatfs, "", 0);
+
+	if (fresh && f_mkfs("", 0, 0) != FR_OK) {
+		fprintf(stderr, "sim: f_mkfs failed on %s\n", path);
+		exit(1);
+	}
+
+	/* as Fatfs_init() in main_f4.c */
+	SD_SetDeviceMode(SD_DMA_MODE);
+
+	if (f_mount(&Fatfs, "", 1) != FR_OK) {
+		fprintf(stderr, "sim: cannot mount %s\n", path);
+		exit(1);
+	}
+}
+
+/*
+ * USB disk mode: msc.c on the pty instead of USB endpoints, until the
+ * host ejects the disk; then the volume is mounted again as on F4.
+ */
+static void
+sim_msc(void)
+{
+	uint8_t in[4096], out[4096];
+	unsigned have = 0, used = 0;
+
+	link_open();
+	msc_init();
+
+	while (!msc_ejected()) {
+		struct pollfd pfd = { .fd = link_fd, .events = POLLIN };
+		unsigned n;
+
+		if (used == have && msc_rx_ready()) {
+			ssize_t got;
+
+			poll(&pfd, 1, 1);
+			got = read(link_fd, in, sizeof(in));
+			have = (got > 0) ? got : 0;
+			used = 0;
+			sim_charge(PHASE_LINK, COST_USB_BYTE, have);
+		}
+
+		used += msc_rx(&in[used], have - used);
+		msc_poll();
+
+		while ((n = msc_tx(out, sizeof(out))) > 0) {
+			sim_charge(PHASE_LINK, COST_USB_BYTE, n);
+
+			for (unsigned done = 0; done < n;) {
+				ssize_t w = write(link_fd, &out[done], n - done);
+
+				if (w > 0) {
+					done += w;
+
+				} else if (w < 0 && errno != EAGAIN && errno != EINTR) {
+					return;
+				}
+			}
+
+			msc_poll();
+		}
+	}
+
+	/*
+	 * The CSW of the eject may still sit in the pty; wait for the host to
+	 * read it and close its end (POLLHUP), so an early exit cannot cut it
+	 * off.  A host that keeps the link open is given 2 s.
+	 */
+	struct pollfd hup = { .fd = link_fd, .events = 0 };
+
+	poll(&hup, 1, 2000);
+
+	if (f_mount(&Fatfs, "", 1) != FR_OK) {
+		fprintf(stderr, "sim: cannot mount the card after eject\n");
+	}
+}
+
+static void
+flash_open(const char *path)
+{
+	size_t size = BOARD_FLASH_SIZE;
+	int fd = -1;
+	bool fresh = true;
+
+	if (path) {
+		struct stat st;
+
+		fresh = stat(path, &st) != 0;
+		fd = open(path, O_RDWR | O_CREAT, 0644);
+
+		if (fd < 0 || ftruncate(fd, size)) {
+			perror(path);
+			exit(1);
+		}
+	}
+
+#ifndef MAP_FIXED_NOREPLACE
+# define MAP_FIXED_NOREPLACE MAP_FIXED
+#endif
+	flash_mem = mmap((void *)SIM_FLASH_BASE, size, PROT_READ | PROT_WRITE,
+			 MAP_FIXED_NOREPLACE | (path ? MAP_SHARED : (MAP_PRIVATE | MAP_ANONYMOUS)), fd, 0);
+
+	if (flash_mem == MAP_FAILED) {
+		perror("sim: flash mmap");
+		exit(1);
+	}
+
+	if (fresh) {
+		memset(flash_mem, 0xff, size);
+	}
+}
+
+/*
+ * host side file transfer
+ */
+
+static int
+copy_to_card(const char *host, const char *card)
+{
+	FIL f;
+	UINT bw;
+	uint8_t buf[4096];
+	size_t n;
+	FILE *in = fopen(host, "rb");
+
+	if (!in) {
+		perror(host);
+		return -1;
+	}
+
+	if (f_open(&f, card, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+		fclose(in);
+		return -1;
+	}
+
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (f_write(&f, buf, n, &bw) != FR_OK || bw != n) {
+			break;
+		}
+	}
+
+	fclose(in);
+	return (f_close(&f) == FR_OK) ? 0 : -1;
+}
+
+static int
+copy_from_card(const char *card, const char *host)
+{
+	FIL f;
+	UINT br;
+	uint8_t buf[4096];
+	FILE *out;
+
+	if (f_open(&f, card, FA_READ) != FR_OK) {
+		fprintf(stderr, "sim: %s not on card\n", card);
+		return -1;
+	}
+
+	out = fopen(host, "wb");
+
+	if (!out) {
+		perror(host);
+		f_close(&f);
+		return -1;
+	}
+
+	while (f_read(&f, buf, sizeof(buf), &br) == FR_OK && br > 0) {
+		fwrite(buf, 1, br, out);
+	}
+
+	fclose(out);
+	f_close(&f);
+	return 0;
+}
+
+/*
+ * Host benchmark of the GET_CRC kernels over the flash image: the byte loop
+ * bl.c used before, slice-by-4 on the words, and crc32_flash() with the
+ * erased tail folded in closed form.
+ */
+static uint32_t
+crc_bytewise(const uint8_t *src, unsigned len, uint32_t state)
+{
+	static uint32_t tab[256];
+
+	if (tab[1] == 0) {
+		for (unsigned i = 0; i < 256; i++) {
+			uint32_t c = i;
+
+			for (unsigned j = 0; j < 8; j++) {
+				c = (c & 1) ? (0xedb88320U ^ (c >> 1)) : (c >> 1);
+			}
+
+			tab[i] = c;
+		}
+	}
+
+	for (unsigned i = 0; i < len; i++) {
+		state = tab[(state ^ src[i]) & 0xff] ^ (state >> 8);
+	}
+
+	return state;
+}
+
+static void
+crc_bench(unsigned rounds)
+{
+	const unsigned len = board_info.fw_size;
+	const char *names[] = { "per-byte", "slice-by-4", "crc32_flash" };
+	uint32_t result[3];
+	uint64_t ns[3];
+
+	sim_counting = false;
+
+	for (unsigned k = 0; k < 3; k++) {
+		uint64_t start = host_ns();
+
+		for (unsigned r = 0; r < rounds; r++) {
+			uint32_t sum = 0;
+
+			switch (k) {
+			case 0:
+				for (unsigned p = 0; p < len; p += 4) {
+					uint32_t bytes = flash_func_read_word(p);
+
+					sum = crc_bytewise((uint8_t *)&bytes, sizeof(bytes), sum);
+				}
+
+				break;
+
+			case 1:
+				sum = crc32(flash_mem + (APP_LOAD_ADDRESS - SIM_FLASH_BASE), len, 0);
+				break;
+
+			case 2:
+				sum = crc32_flash(0, len, 0);
+				break;
+			}
+
+			result[k] = sum;
+		}
+
+		ns[k] = (host_ns() - start) / rounds;
+	}
+
+	for (unsigned k = 0; k < 3; k++) {
+		printf("crc %-12s 0x%08" PRIx32 " %8.3f ms  x%.1f\n", names[k], result[k],
+		       ns[k] / 1e6, (double)ns[0] / ns[k]);
+	}
+
+	if (result[1] != result[0] || result[2] != result[0]) {
+		printf("crc MISMATCH\n");
+		exit(1);
+	}
+}
+
+static void
+flash_bench(unsigned rounds)
+{
+	const unsigned len = board_info.fw_size;
+	const char *names[] = { "blank", "compare", "read" };
+	uint32_t *copy = malloc(len);
+	uint32_t result[3][2];
+	uint64_t ns[3][2];
+
+	sim_counting = false;
+	memcpy(copy, flash_mem + (APP_LOAD_ADDRESS - SIM_FLASH_BASE), len);
+
+	/* k: operation, b: per-word flash_func_read_word() or flash.c block */
+	for (unsigned k = 0; k < 3; k++) {
+		for (unsigned b = 0; b < 2; b++) {
+			uint64_t start = host_ns();
+
+			for (unsigned r = 0; r < rounds; r++) {
+				uint32_t res = 1;
+
+				switch (k * 2 + b) {
+				case 0:
+					for (unsigned p = 0; res && p < len; p += 4) {
+						res = (flash_func_read_word(p) == 0xffffffff);
+					}
+
+					break;
+
+				case 1:
+					res = flash_func_is_blank(0, len);
+					break;
+
+				case 2:
+					for (unsigned p = 0; res && p < len; p += 4) {
+						res = (flash_func_read_word(p) == copy[p / 4]);
+					}
+
+					break;
+
+				case 3:
+					res = flash_func_compare(0, copy, len);
+					break;
+
+				case 4:
+					for (unsigned p = 0; p < len; p += 4) {
+						copy[p / 4] = flash_func_read_word(p);
+					}
+
+					break;
+
+				case 5:
+					flash_func_read_block(0, copy, len);
+					break;
+				}
+
+				result[k][b] = res;
+			}
+
+			ns[k][b] = (host_ns() - start) / rounds;
+
+			if (k == 2) {
+				/* what was read, checked outside the timing */
+				result[k][b] = crc32((uint8_t *)copy, len, 0);
+			}
+		}
+	}
+
+	free(copy);
+
+	for (unsigned k = 0; k < 3; k++) {
+		printf("flash %-8s 0x%08" PRIx32 " word %8.3f ms  block %8.3f ms  x%.1f\n", names[k], result[k][1],
+		       ns[k][0] / 1e6, ns[k][1] / 1e6, (double)ns[k][0] / ns[k][1]);
+
+		if (result[k][0] != result[k][1]) {
+			printf("flash %s MISMATCH\n", names[k]);
+			exit(1);
+		}
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+		"usage: px4sim_bl.elf [-f flash.bin] [-c card.img] [-s card_mb] [-p link] [-C cost=ns]...\n"
+		"                    [-E first[:count[:code]]] command...\n"
+		"commands:\n"
+		"  put <host> <card>   copy a host file onto the card\n"
+		"  get <card> <host>   copy a card file to the host\n"
+		"  boot                reset, SD_upload() then jump_to_app()\n"
+		"  backup              read_chip_to_sd()\n"
+		"  bl [timeout_ms]     reset, run the bootloader on the pty, then jump_to_app()\n"
+		"  confirm             the app confirms the slot it runs from\n"
+		"  msc                 serve the card as a USB disk on the pty until ejected\n"
+		"  crc [rounds]        benchmark the GET_CRC kernels on the host\n"
+		"  flash [rounds]      benchmark per-word against block flash access on the host\n"
+		"-E fails card accesses first.. with SD_Error code (default SD_DATA_CRC_FAIL)\n"
+		"costs:");
+
+	for (unsigned i = 0; i < COST_COUNT; i++) {
+		fprintf(stderr, " %s=%" PRIu64, sim_costs[i].name, sim_costs[i].ns);
+	}
+
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static void
+set_cost(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+
+	for (unsigned i = 0; eq && i < COST_COUNT; i++) {
+		if (strlen(sim_costs[i].name) == (size_t)(eq - arg) && !strncmp(arg, sim_costs[i].name, eq - arg)) {
+			sim_costs[i].ns = strtoull(eq + 1, NULL, 0);
+			return;
+		}
+	}
+
+	usage();
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *flash_path = NULL, *card_path = "card.img";
+	unsigned card_mb = 256;
+	struct sigaction sa;
+	struct itimerval it = { .it_interval = { 0, 1000 }, .it_value = { 0, 1000 } };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:c:s:p:C:E:")) != -1) {
+		switch (opt) {
+		case 'f':
+			flash_path = optarg;
+			break;
+
+		case 'c':
+			card_path = optarg;
+			break;
+
+		case 's':
+			card_mb = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'p':
+			link_path = optarg;
+			break;
+
+		case 'C':
+			set_cost(optarg);
+			break;
+
+		case 'E':
+			set_fault(optarg);
+			break;
+
+		default:
+			usage();
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	phase_start = host_ns();
+	trace_init();
+	trace_clock(board_info.systick_mhz);
+	flash_open(flash_path);
+	slots_init();
+	card_open(card_path, card_mb);
+	trace_point(TRACE_SD_MOUNT);
+	atexit(sim_report);
+
+	/* 1ms systick */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sim_tick;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+	setitimer(ITIMER_REAL, &it, NULL);
+
+	for (int i = optind; i < argc; i++) {
+		const char *cmd = argv[i];
+
+		sim_enter(PHASE_OTHER);
+		sim_counting = true;
+
+		if (!strcmp(cmd, "put") && i + 2 < argc) {
+			sim_counting = false;
+
+			if (copy_to_card(argv[i + 1], argv[i + 2])) {
+				return 1;
+			}
+
+			i += 2;
+
+		} else if (!strcmp(cmd, "get") && i + 2 < argc) {
+			sim_counting = false;
+
+			if (copy_from_card(argv[i + 1], argv[i + 2])) {
+				return 1;
+			}
+
+			i += 2;
+
+		} else if (!strcmp(cmd, "boot")) {
+			if (!setjmp(cmd_jmp)) {
+				slots_init();
+				SD_upload();
+				jump_to_app();
+				fprintf(stderr, "sim: no valid app\n");
+			}
+
+		} else if (!strcmp(cmd, "confirm")) {
+			sim_slot_reg = SLOT_CONFIRM_SIGNATURE;
+
+		} else if (!strcmp(cmd, "msc")) {
+			sim_msc();
+
+		} else if (!strcmp(cmd, "backup")) {
+			read_chip_to_sd();
+
+		} else if (!strcmp(cmd, "crc")) {
+			unsigned rounds = 4;
+
+			if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+				rounds = strtoul(argv[++i], NULL, 0);
+			}
+
+			crc_bench(rounds);
+
+		} else if (!strcmp(cmd, "flash")) {
+			unsigned rounds = 4;
+
+			if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+				rounds = strtoul(argv[++i], NULL, 0);
+			}
+
+			flash_bench(rounds);
+
+		} else if (!strcmp(cmd, "bl")) {
+			unsigned timeout = 0;
+
+			if (i + 1 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9') {
+				timeout = strtoul(argv[++i], NULL, 0);
+			}
+
+			if (!setjmp(cmd_jmp)) {
+				slots_init();
+				cinit(NULL, USART);
+				expect_opcode = true;
+				bootloader(timeout);
+				jump_to_app();
+				fprintf(stderr, "sim: no valid app\n");
+			}
+
+		} else {
+			usage();
+		}
+	}
+
+	f_mount(NULL, "", 0);
+	return 0;
+}
@@ -0,0 +1,699 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * USB mass storage mode: the SD card as a USB disk, so fw.bin can be
+ * copied on at USB speed; SD_upload() runs once the host ejects it.
+ *
+ * Bulk-only transport with the handful of SCSI commands hosts use for a
+ * removable disk.  READ(10) and WRITE(10) move up to MSC_BUFFER_BLOCKS
+ * blocks per disk_read()/disk_write(), so the card sees multi-block
+ * transfers rather than one command per 512 byte sector.  Data phases
+ * always run to the length the host asked for, padded or drained, and
+ * the residue says how much of it was real.
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bl.h"
+#include "msc.h"
+#include "ff.h"
+#include "diskio.h"
+
+#define MSC_BLOCK		512
+#define MSC_BUFFER_BLOCKS	16
+
+#define MSC_CBW_SIGNATURE	0x43425355	/* "USBC" */
+#define MSC_CSW_SIGNATURE	0x53425355	/* "USBS" */
+#define MSC_CBW_LEN		31
+#define MSC_CSW_LEN		13
+
+#define SCSI_TEST_UNIT_READY	0x00
+#define SCSI_REQUEST_SENSE	0x03
+#define SCSI_INQUIRY		0x12
+#define SCSI_MODE_SENSE_6	0x1a
+#define SCSI_START_STOP_UNIT	0x1b
+#define SCSI_PREVENT_ALLOW	0x1e
+#define SCSI_READ_FORMAT_CAP	0x23
+#define SCSI_READ_CAPACITY_10	0x25
+#define SCSI_READ_10		0x28
+#define SCSI_WRITE_10		0x2a
+#define SCSI_VERIFY_10		0x2f
+#define SCSI_SYNCHRONIZE_CACHE	0x35
+#define SCSI_MODE_SENSE_10	0x5a
+
+#define SENSE_NOT_READY		0x02
+#define SENSE_MEDIUM_ERROR	0x03
+#define SENSE_ILLEGAL_REQUEST	0x05
+#define ASC_READ_ERROR		0x11
+#define ASC_WRITE_ERROR		0x0c
+#define ASC_INVALID_COMMAND	0x20
+#define ASC_LBA_OUT_OF_RANGE	0x21
+#define ASC_INVALID_FIELD	0x24
+#define ASC_MEDIUM_NOT_PRESENT	0x3a
+
+enum msc_state {
+	MSC_IDLE = 0,		/* waiting for a CBW */
+	MSC_DATA_IN,		/* sending the buffer, then padding */
+	MSC_READ,		/* buffer drained, more blocks to read */
+	MSC_DATA_OUT,		/* filling the buffer, then draining */
+	MSC_WRITE,		/* buffer full, to be written */
+	MSC_STATUS,		/* CSW to send */
+};
+
+static struct {
+	enum msc_state	state;
+	uint8_t		cbw[MSC_CBW_LEN];
+	unsigned	cbw_len;
+	uint32_t	tag;
+	uint32_t	residue;	/* bytes of the data phase not really transferred */
+	uint8_t		status;		/* CSW status: 0 passed, 1 failed */
+	uint32_t	lba;		/* next block of a READ or WRITE */
+	uint32_t	blocks;		/* blocks of it not yet in the buffer */
+	unsigned	pos;		/* buffer bytes sent or received */
+	unsigned	len;		/* buffer bytes in this round */
+	uint32_t	extra;		/* pad to send or bytes to drop after the buffer */
+	uint32_t	card_blocks;
+	uint8_t		sense_key;
+	uint8_t		sense_asc;
+	bool		ejected;
+} msc;
+
+static uint8_t msc_buf[MSC_BUFFER_BLOCKS * MSC_BLOCK] __attribute__((aligned(4)));
+
+static uint32_t
+le32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t
+be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+msc_fail(uint8_t key, uint8_t asc)
+{
+	msc.status = 1;
+	msc.sense_key = key;
+	msc.sense_asc = asc;
+}
+
+/* start the data-in phase with len bytes of msc_buf, of host_len asked for */
+static void
+msc_data_in(unsigned len, uint32_t host_len)
+{
+	if (len > host_len) {
+		len = host_len;
+	}
+
+	msc.pos = 0;
+	msc.len = len;
+	msc.extra = host_len - len;
+	msc.state = MSC_DATA_IN;
+}
+
+/* start the next round of the data-out phase */
+static void
+msc_data_out(void)
+{
+	unsigned n = (msc.blocks < MSC_BUFFER_BLOCKS) ? msc.blocks : MSC_BUFFER_BLOCKS;
+
+	msc.pos = 0;
+	msc.len = n * MSC_BLOCK;
+	msc.state = (msc.len || msc.extra) ? MSC_DATA_OUT : MSC_STATUS;
+}
+
+static void
+msc_command(void)
+{
+	const uint8_t *cb = &msc.cbw[15];
+	uint32_t host_len;
+	bool in;
+	uint32_t count;
+
+	if (le32(&msc.cbw[0]) != MSC_CBW_SIGNATURE) {
+		/* out of step; wait for the next valid CBW */
+		return;
+	}
+
+	msc.tag = le32(&msc.cbw[4]);
+	host_len = le32(&msc.cbw[8]);
+	in = (msc.cbw[12] & 0x80) != 0;
+	msc.residue = host_len;
+	msc.status = 0;
+	msc.blocks = 0;
+	memset(msc_buf, 0, 36);
+
+	switch (cb[0]) {
+	case SCSI_TEST_UNIT_READY:
+		if (msc.ejected) {
+			msc_fail(SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+		}
+
+		break;
+
+	case SCSI_REQUEST_SENSE:
+		msc_buf[0] = 0x70;
+		msc_buf[2] = msc.sense_key;
+		msc_buf[7] = 10;
+		msc_buf[12] = msc.sense_asc;
+		msc.sense_key = 0;
+		msc.sense_asc = 0;
+		msc_data_in(18, host_len);
+		msc.residue -= msc.len;
+		return;
+
+	case SCSI_INQUIRY:
+		if (cb[1] & 1) {
+			/* no vital product data pages */
+			msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			break;
+		}
+
+		msc_buf[1] = 0x80;		/* removable */
+		msc_buf[2] = 0x02;
+		msc_buf[3] = 0x02;
+		msc_buf[4] = 36 - 5;
+		memcpy(&msc_buf[8], "PX4     SD bootloader   1.0 ", 28);
+		msc_data_in(36, host_len);
+		msc.residue -= msc.len;
+		return;
+
+	case SCSI_MODE_SENSE_6:
+		msc_buf[0] = 3;
+		msc_data_in(4, host_len);
+		msc.residue -= msc.len;
+		return;
+
+	case SCSI_MODE_SENSE_10:
+		msc_buf[1] = 6;
+		msc_data_in(8, host_len);
+		msc.residue -= msc.len;
+		return;
+
+	case SCSI_READ_FORMAT_CAP:
+		msc_buf[3] = 8;
+		put_be32(&msc_buf[4], msc.card_blocks);
+		put_be32(&msc_buf[8], MSC_BLOCK);
+		msc_buf[8] = 0x02;		/* formatted media */
+		msc_data_in(12, host_len);
+		msc.residue -= msc.len;
+		return;
+
+	case SCSI_READ_CAPACITY_10:
+		put_be32(&msc_buf[0], msc.card_blocks - 1);
+		put_be32(&msc_buf[4], MSC_BLOCK);
+		msc_data_in(8, host_len);
+		msc.residue -= msc.len;
+		return;
+
+	case SCSI_START_STOP_UNIT:
+		/* LoEj without Start: the host is done with the card */
+		if ((cb[4] & 3) == 2) {
+			disk_ioctl(0, CTRL_SYNC, 0);
+			msc.ejected = true;
+		}
+
+		break;
+
+	case SCSI_PREVENT_ALLOW:
+	case SCSI_VERIFY_10:
+		break;
+
+	case SCSI_SYNCHRONIZE_CACHE:
+		/* writes are not cached */
+		disk_ioctl(0, CTRL_SYNC, 0);
+		break;
+
+	case SCSI_READ_10:
+	case SCSI_WRITE_10:
+		msc.lba = be32(&cb[2]);
+		count = ((uint32_t)cb[7] << 8) | cb[8];
+
+		if (count > host_len / MSC_BLOCK) {
+			count = host_len / MSC_BLOCK;
+		}
+
+		if (msc.ejected) {
+			msc_fail(SENSE_NOT_READY, ASC_MEDIUM_NOT_PRESENT);
+
+		} else if (msc.lba > msc.card_blocks || count > msc.card_blocks - msc.lba) {
+			msc_fail(SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+
+		} else {
+			msc.blocks = count;
+		}
+
+		msc.extra = host_len - msc.blocks * MSC_BLOCK;
+
+		if (cb[0] == SCSI_READ_10) {
+			msc.pos = msc.len = 0;
+			msc.state = msc.blocks ? MSC_READ : MSC_DATA_IN;
+
+		} else {
+			msc_data_out();
+		}
+
+		return;
+
+	default:
+		msc_fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+		break;
+	}
+
+	/* no data of ours: pad or drain whatever the host expects */
+	msc.pos = msc.len = 0;
+	msc.extra = host_len;
+
+	if (host_len == 0) {
+		msc.state = MSC_STATUS;
+
+	} else {
+		msc.state = in ? MSC_DATA_IN : MSC_DATA_OUT;
+	}
+}
+
+void
+msc_init(void)
+{
+	DWORD blocks = 0;
+
+	memset(&msc, 0, sizeof(msc));
+
+	if (disk_ioctl(0, GET_SECTOR_COUNT, &blocks) == RES_OK) {
+		msc.card_blocks = blocks;
+	}
+}
+
+unsigned
+msc_rx(const uint8_t *buf, unsigned len)
+{
+	unsigned n = 0;
+
+	while (n < len) {
+		unsigned k = len - n;
+
+		if (msc.state == MSC_IDLE) {
+			if (k > MSC_CBW_LEN - msc.cbw_len) {
+				k = MSC_CBW_LEN - msc.cbw_len;
+			}
+
+			memcpy(&msc.cbw[msc.cbw_len], &buf[n], k);
+			msc.cbw_len += k;
+
+			if (msc.cbw_len == MSC_CBW_LEN) {
+				msc.cbw_len = 0;
+				msc_command();
+			}
+
+		} else if (msc.state == MSC_DATA_OUT && msc.pos < msc.len) {
+			if (k > msc.len - msc.pos) {
+				k = msc.len - msc.pos;
+			}
+
+			memcpy(&msc_buf[msc.pos], &buf[n], k);
+			msc.pos += k;
+
+			if (msc.pos == msc.len) {
+				msc.state = MSC_WRITE;
+			}
+
+		} else if (msc.state == MSC_DATA_OUT) {
+			if (k > msc.extra) {
+				k = msc.extra;
+			}
+
+			msc.extra -= k;
+
+			if (msc.extra == 0) {
+				msc.state = MSC_STATUS;
+			}
+
+		} else {
+			break;
+		}
+
+		n += k;
+	}
+
+	return n;
+}
+
+bool
+msc_rx_ready(void)
+{
+	return msc.state == MSC_IDLE || msc.state == MSC_DATA_OUT;
+}
+
+unsigned
+msc_tx(uint8_t *buf, unsigned max)
+{
+	unsigned n = 0;
+
+	while (msc.state == MSC_DATA_IN && n < max) {
+		unsigned k = max - n;
+
+		if (msc.pos < msc.len) {
+			if (k > msc.len - msc.pos) {
+				k = msc.len - msc.pos;
+			}
+
+			memcpy(&buf[n], &msc_buf[msc.pos], k);
+			msc.pos += k;
+
+		} else if (msc.blocks) {
+			msc.state = MSC_READ;
+			break;
+
+		} else if (msc.extra) {
+			if (k > msc.extra) {
+				k = msc.extra;
+			}
+
+			memset(&buf[n], 0, k);
+			msc.extra -= k;
+
+		} else {
+			msc.state = MSC_STATUS;
+			break;
+		}
+
+		n += k;
+	}
+
+	/* a data phase that ends on a full buffer moves on with the next call */
+	if (msc.state == MSC_DATA_IN && msc.pos == msc.len && !msc.blocks && !msc.extra) {
+		msc.state = MSC_STATUS;
+	}
+
+	if (n > 0 || msc.state != MSC_STATUS || max < MSC_CSW_LEN) {
+		return n;
+	}
+
+	uint32_t csw[3] = { MSC_CSW_SIGNATURE, msc.tag, msc.residue };
+
+	memcpy(buf, csw, sizeof(csw));
+	buf[12] = msc.status;
+	msc.state = MSC_IDLE;
+	return MSC_CSW_LEN;
+}
+
+void
+msc_poll(void)
+{
+	unsigned n = (msc.blocks < MSC_BUFFER_BLOCKS) ? msc.blocks : MSC_BUFFER_BLOCKS;
+
+	if (msc.state == MSC_READ) {
+		if (disk_read(0, msc_buf, msc.lba, n) != RES_OK) {
+			/* pad out the rest */
+			msc_fail(SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+			msc.extra += msc.blocks * MSC_BLOCK;
+			msc.blocks = 0;
+			msc_data_in(0, msc.extra);
+			return;
+		}
+
+		msc.lba += n;
+		msc.blocks -= n;
+		msc.residue -= n * MSC_BLOCK;
+		msc.pos = 0;
+		msc.len = n * MSC_BLOCK;
+		msc.state = MSC_DATA_IN;
+
+	} else if (msc.state == MSC_WRITE) {
+		if (disk_write(0, msc_buf, msc.lba, msc.len / MSC_BLOCK) != RES_OK) {
+			/* drain the rest */
+			msc_fail(SENSE_MEDIUM_ERROR, ASC_WRITE_ERROR);
+			msc.extra += (msc.blocks - msc.len / MSC_BLOCK) * MSC_BLOCK;
+			msc.blocks = 0;
+			msc_data_out();
+			return;
+		}
+
+		msc.lba += msc.len / MSC_BLOCK;
+		msc.blocks -= msc.len / MSC_BLOCK;
+		msc.residue -= msc.len;
+		msc_data_out();
+	}
+}
+
+bool
+msc_ejected(void)
+{
+	return msc.ejected && msc.state == MSC_IDLE;
+}
+
+#if defined(BOARD_USB_MSC)
+
+/*
+ * USB side, on the OTG FS port.  The device is polled from usb_msc_run()
+ * rather than from otg_fs_isr(), which belongs to the CDC interface, and
+ * the OUT endpoint is NAKed while a full buffer is written to the card.
+ */
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/msc.h>
+
+#ifndef USB_MSC_PRODUCTID
+# define USB_MSC_PRODUCTID	(USBPRODUCTID | 0x1000)	/* not the CDC one, hosts cache the class */
+#endif
+
+#define MSC_EP_OUT		0x01
+#define MSC_EP_IN		0x82
+#define MSC_EP_SIZE		64
+
+static const char *msc_strings[] = {
+	"3D Robotics",
+	USBDEVICESTRING,
+	"0",
+};
+
+static const struct usb_device_descriptor msc_dev = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0,			/* given by the interface */
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x26AC,
+	.idProduct = USB_MSC_PRODUCTID,
+	.bcdDevice = 0x0101,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 3,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor msc_endp[] = {{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = MSC_EP_OUT,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = MSC_EP_SIZE,
+		.bInterval = 0,
+	}, {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = MSC_EP_IN,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = MSC_EP_SIZE,
+		.bInterval = 0,
+	}
+};
+
+static const struct usb_interface_descriptor msc_iface[] = {{
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_CLASS_MSC,
+		.bInterfaceSubClass = USB_MSC_SUBCLASS_SCSI,
+		.bInterfaceProtocol = USB_MSC_PROTOCOL_BBB,
+		.iInterface = 0,
+		.endpoint = msc_endp,
+	}
+};
+
+static const struct usb_interface msc_ifaces[] = {{
+		.num_altsetting = 1,
+		.altsetting = msc_iface,
+	}
+};
+
+static const struct usb_config_descriptor msc_config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = 0,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.iConfiguration = 0,
+	.bmAttributes = 0x80,
+	.bMaxPower = 0xFA,
+	.interface = msc_ifaces,
+};
+
+static uint8_t msc_control_buffer[128];
+static bool msc_tx_busy;
+static bool msc_rx_naked;
+
+static int
+msc_control_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf, uint16_t *len,
+		    void (**complete)(usbd_device *dev, struct usb_setup_data *req))
+{
+	static uint8_t max_lun = 0;
+
+	(void)dev;
+	(void)complete;
+
+	switch (req->bRequest) {
+	case USB_MSC_REQ_BULK_ONLY_RESET:
+		/* an eject stays an eject */
+		msc.state = MSC_IDLE;
+		msc.cbw_len = 0;
+		return 1;
+
+	case USB_MSC_REQ_GET_MAX_LUN:
+		*buf = &max_lun;
+		*len = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+msc_rx_cb(usbd_device *dev, uint8_t ep)
+{
+	uint8_t pkt[MSC_EP_SIZE];
+	unsigned len = usbd_ep_read_packet(dev, ep, pkt, sizeof(pkt));
+
+	msc_rx(pkt, len);
+
+	/* hold the host off until the buffer is on the card */
+	if (!msc_rx_ready()) {
+		usbd_ep_nak_set(dev, ep, 1);
+		msc_rx_naked = true;
+	}
+}
+
+static void
+msc_tx_cb(usbd_device *dev, uint8_t ep)
+{
+	(void)dev;
+	(void)ep;
+	msc_tx_busy = false;
+}
+
+static void
+msc_set_config(usbd_device *dev, uint16_t wValue)
+{
+	(void)wValue;
+
+	usbd_ep_setup(dev, MSC_EP_OUT, USB_ENDPOINT_ATTR_BULK, MSC_EP_SIZE, msc_rx_cb);
+	usbd_ep_setup(dev, MSC_EP_IN, USB_ENDPOINT_ATTR_BULK, MSC_EP_SIZE, msc_tx_cb);
+	usbd_register_control_callback(dev,
+				       USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				       USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				       msc_control_request);
+}
+
+void
+usb_msc_run(void)
+{
+	usbd_device *dev;
+	uint8_t pkt[MSC_EP_SIZE];
+
+	msc_init();
+	msc_tx_busy = false;
+	msc_rx_naked = false;
+
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, RCC_AHB1ENR_IOPAEN);
+	rcc_peripheral_enable_clock(&RCC_AHB2ENR, RCC_AHB2ENR_OTGFSEN);
+	gpio_mode_setup(GPIOA, GPIO_MODE_AF, GPIO_PUPD_NONE, GPIO9 | GPIO11 | GPIO12);
+	gpio_set_af(GPIOA, GPIO_AF10, GPIO9 | GPIO11 | GPIO12);
+
+	dev = usbd_init(&otgfs_usb_driver, &msc_dev, &msc_config, msc_strings, 3,
+			msc_control_buffer, sizeof(msc_control_buffer));
+	usbd_register_set_config_callback(dev, msc_set_config);
+	led_on(LED_BOOTLOADER);
+
+	/* until ejected, or the cable is pulled (VBUS on PA9) */
+	while (!(msc_ejected() && !msc_tx_busy) && gpio_get(GPIOA, GPIO9)) {
+		usbd_poll(dev);
+		msc_poll();
+
+		if (msc_rx_naked && msc_rx_ready()) {
+			msc_rx_naked = false;
+			usbd_ep_nak_set(dev, MSC_EP_OUT, 0);
+		}
+
+		if (!msc_tx_busy) {
+			unsigned len = msc_tx(pkt, sizeof(pkt));
+
+			if (len > 0) {
+				msc_tx_busy = true;
+				usbd_ep_write_packet(dev, MSC_EP_IN, pkt, len);
+			}
+		}
+	}
+
+	led_off(LED_BOOTLOADER);
+	usbd_disconnect(dev, true);
+	gpio_mode_setup(GPIOA, GPIO_MODE_INPUT, GPIO_PUPD_NONE, GPIO9 | GPIO11 | GPIO12);
+	rcc_peripheral_disable_clock(&RCC_AHB2ENR, RCC_AHB2ENR_OTGFSEN);
+}
+
+#endif
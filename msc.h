@@ -0,0 +1,69 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/**
+ * @file msc.h
+ *
+ * USB mass storage (bulk-only transport, SCSI) exposing the SD card.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Transport-independent core: the host's bulk OUT bytes go to msc_rx(),
+ * bulk IN bytes come from msc_tx() and msc_poll() does the card I/O
+ * outside the USB callbacks.  The host simulation drives the same core
+ * over its pty.
+ */
+extern void msc_init(void);
+
+/* take up to len bytes from the host; returns how many were taken */
+extern unsigned msc_rx(const uint8_t *buf, unsigned len);
+
+/* false while a full buffer waits to be written to the card */
+extern bool msc_rx_ready(void);
+
+/* next bytes for the host, at most max (at least 13 for a status) */
+extern unsigned msc_tx(uint8_t *buf, unsigned max);
+
+extern void msc_poll(void);
+
+/* the host has ejected the card and its last command is answered */
+extern bool msc_ejected(void);
+
+/* enumerate as a USB disk and serve the card until it is ejected */
+extern void usb_msc_run(void);
@@ -0,0 +1,159 @@
+#!/usr/bin/env python
+############################################################################
+#
+#   Copyright (C) 2016 PX4 Development Team. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in
+#    the documentation and/or other materials provided with the
+#    distribution.
+# 3. Neither the name PX4 nor the names of its contributors may be
+#    used to endorse or promote products derived from this software
+#    without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+# FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+# COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+# OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+# AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+# ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+# POSSIBILITY OF SUCH DAMAGE.
+#
+############################################################################
+
+#
+# LZ codec for PX4 firmware images (see lz.h): px_mkfw.py --lz writes SD
+# update files with it and Tools/sim_upload.py --compress uses the raw
+# stream for PROG_COMPRESSED.
+#
+# Sequences of LZ4 block format, match offsets limited to the 4KB window
+# the bootloader keeps.
+#
+
+import struct
+import zlib
+
+LZ_MAGIC		= b'PXLZ'
+LZ_WINDOW_BITS		= 12
+LZ_WINDOW		= 1 << LZ_WINDOW_BITS
+LZ_BLOCK_BITS		= 14
+LZ_BLOCK		= 1 << LZ_BLOCK_BITS
+LZ_MIN_MATCH		= 4
+LZ_CANDIDATES		= 16
+
+def lz_crc32(data):
+	# bl.c starts from 0 and does not invert
+	return zlib.crc32(data, 0xffffffff) ^ 0xffffffff
+
+def lz_length(out, n):
+	while n >= 255:
+		out.append(255)
+		n -= 255
+	out.append(n)
+
+def lz_sequence(out, literals, match, offset):
+	ml = match - LZ_MIN_MATCH if match else 0
+	out.append((min(len(literals), 15) << 4) | min(ml, 15))
+	if len(literals) >= 15:
+		lz_length(out, len(literals) - 15)
+	out += literals
+	if match:
+		out += struct.pack('<H', offset)
+		if ml >= 15:
+			lz_length(out, ml - 15)
+
+def lz_match_length(data, i, j):
+	# longest common run at i and j, by doubling then bisecting slice compares
+	n = len(data) - i
+	lo, step = LZ_MIN_MATCH, LZ_MIN_MATCH
+	while lo + step <= n and data[i + lo:i + lo + step] == data[j + lo:j + lo + step]:
+		lo += step
+		step *= 2
+	hi = min(lo + step, n)
+	while lo < hi:
+		mid = (lo + hi + 1) // 2
+		if data[i + lo:i + mid] == data[j + lo:j + mid]:
+			lo = mid
+		else:
+			hi = mid - 1
+	return lo
+
+def lz_compress(data):
+	out = bytearray()
+	chains = {}
+	start = 0
+	i = 0
+	while i + LZ_MIN_MATCH <= len(data):
+		key = data[i:i + LZ_MIN_MATCH]
+		chain = chains.setdefault(key, [])
+		best, offset = 0, 0
+		for j in reversed(chain[-LZ_CANDIDATES:]):
+			if i - j > LZ_WINDOW:
+				break
+			n = lz_match_length(data, i, j)
+			if n > best:
+				best, offset = n, i - j
+		if best:
+			lz_sequence(out, data[start:i], best, offset)
+			for k in range(i, min(i + best, len(data) - LZ_MIN_MATCH + 1)):
+				chains.setdefault(data[k:k + LZ_MIN_MATCH], []).append(k)
+			i += best
+			start = i
+		else:
+			chain.append(i)
+			i += 1
+	lz_sequence(out, data[start:], 0, 0)
+	return bytes(out)
+
+def lz_decompress(data, size):
+	out = bytearray()
+	i = 0
+	while len(out) < size:
+		token = data[i]
+		i += 1
+		n = token >> 4
+		if n == 15:
+			while data[i] == 255:
+				n += 255
+				i += 1
+			n += data[i]
+			i += 1
+		out += data[i:i + n]
+		i += n
+		if len(out) >= size:
+			break
+		offset = struct.unpack_from('<H', data, i)[0]
+		i += 2
+		n = (token & 15) + LZ_MIN_MATCH
+		if token & 15 == 15:
+			while data[i] == 255:
+				n += 255
+				i += 1
+			n += data[i]
+			i += 1
+		if offset == 0 or offset > LZ_WINDOW or offset > len(out):
+			raise ValueError("bad match offset")
+		for k in range(n):
+			out.append(out[-offset])
+	return bytes(out)
+
+def mklz(image):
+	body = lz_compress(image)
+	if lz_decompress(body, len(image)) != image:
+		raise RuntimeError("LZ round trip failed")
+	header = struct.pack('<4sIBB2x', LZ_MAGIC, len(image), LZ_WINDOW_BITS, LZ_BLOCK_BITS)
+	for offset in range(0, len(image), LZ_BLOCK):
+		block = image[offset:offset + LZ_BLOCK]
+		header += struct.pack('<I', lz_crc32(block + b'\xff' * (LZ_BLOCK - len(block))))
+	return header + body
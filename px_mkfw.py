@@ -38,6 +38,18 @@
 # The PX4 firmware file is a JSON-encoded Python object, containing
 # metadata fields and a zlib-compressed base64-encoded firmware image.
 #
+# With --lz the image is also written as a compressed SD update file
+# (fw.lz), which the bootloader decodes while it reads the card: a
+# <"PXLZ"><size:4><window_bits:1><block_bits:1><0:2> header, the CRC-32 of
+# every 16KB block of the image padded with 0xff, then LZ4 block sequences
+# whose match offsets stay within the 4KB window (see lz.h).
+#
+# With --digest the image gets a trailer the bootloader checks before it
+# boots it (image.c): padded to a word, its length goes into the first
+# reserved exception vector (offset 0x1c) and <"PXSH"><length:4><SHA-256 of
+# the first length bytes:32> is appended.  The other outputs carry the
+# same image.
+#
 
 import sys
 import argparse
@@ -46,6 +58,10 @@ import base64
 import zlib
 import time
 import subprocess
+import hashlib
+import struct
+
+from px_lz import mklz
 
 #
 # Construct a basic firmware description
@@ -64,6 +80,16 @@ def mkdesc():
 	proto['image_size']	= 0
 	return proto
 
+#
+# Append the digest trailer; the boot delay word (0x1a0), which SET_DELAY
+# programs after the upload, is hashed as erased
+#
+def mkdigest(image):
+	image += b'\xff' * (-len(image) % 4)
+	image = image[:0x1c] + struct.pack('<I', len(image)) + image[0x20:]
+	hashed = image[:0x1a0] + b'\xff' * len(image[0x1a0:0x1a4]) + image[0x1a4:]
+	return image + struct.pack('<4sI', b'PXSH', len(image)) + hashlib.sha256(hashed).digest()
+
 # Parse commandline
 parser = argparse.ArgumentParser(description="Firmware generator for the PX autopilot system.")
 parser.add_argument("--prototype",	action="store", help="read a prototype description from a file")
@@ -74,6 +100,8 @@ parser.add_argument("--summary",	action="store", help="set a brief description")
 parser.add_argument("--description",	action="store", help="set a longer description")
 parser.add_argument("--git_identity",	action="store", help="the working directory to check for git identity")
 parser.add_argument("--image",		action="store", help="the firmware image")
+parser.add_argument("--digest",		action="store", help="also write the image with a SHA-256 trailer (fw.bin) and use it for the other outputs")
+parser.add_argument("--lz",		action="store", help="also write the image as a compressed SD update file (fw.lz)")
 args = parser.parse_args()
 
 # Fetch the firmware descriptor prototype if specified
@@ -104,7 +132,16 @@ if args.git_identity != None:
 if args.image != None:
 	f = open(args.image, "rb")
 	bytes = f.read()
+	if args.digest != None:
+		bytes = mkdigest(bytes)
+		f = open(args.digest, "wb")
+		f.write(bytes)
+		f.close()
 	desc['image_size'] = len(bytes)
 	desc['image'] = base64.b64encode(zlib.compress(bytes,9)).decode('utf-8')
+	if args.lz != None:
+		f = open(args.lz, "wb")
+		f.write(mklz(bytes))
+		f.close()
 
 print(json.dumps(desc, indent=4))
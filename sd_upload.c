@@ -0,0 +1,1136 @@
+/*
+ * SD card firmware update and backup for the bootloader.
+ *
+ * Shared by the STM32F4 boards and the host simulation (main_sim.c); only
+ * the flash_func_* helpers, libopencm3 flash programming and uart7_cout()
+ * are needed from the board.
+ */
+
+#include "hw_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/cm3/dwt.h>
+
+#include "bl.h"
+#include "uart.h"
+#include "crc32.h"
+#include "lz.h"
+#include "trace.h"
+#include "ff.h"
+#include "diskio.h"
+#include "SD_Card.h"
+
+FIL backupfile;
+FIL file;
+FIL oldfile;
+
+/*
+ * Bytes written per flash_program_* call when restoring from the card:
+ * 1, 2, 4 or 8, matching the PSIZE the supply voltage allows (8 needs VPP).
+ */
+#ifndef BOARD_FLASH_PROGRAM_WIDTH
+# define BOARD_FLASH_PROGRAM_WIDTH	1
+#endif
+
+/*
+ * Program len bytes from buf at address, BOARD_FLASH_PROGRAM_WIDTH at a
+ * time while both are aligned; any remaining tail is written bytewise.
+ */
+static void
+sd_program(uint32_t address, const uint8_t *buf, unsigned len)
+{
+	unsigned i = 0;
+
+#if BOARD_FLASH_PROGRAM_WIDTH == 8
+	/* the update engine may leave us word but not double-word aligned */
+	if ((address & 7) == 4 && !((uintptr_t)buf & 3) && len >= 4) {
+		flash_program_word(address, *(const uint32_t *)buf);
+		i = 4;
+	}
+
+	if (!((address + i) & 7) && !((uintptr_t)&buf[i] & 7)) {
+		for (; i + 8 <= len; i += 8) {
+			flash_program_double_word(address + i, *(const uint64_t *)&buf[i]);
+		}
+	}
+#elif BOARD_FLASH_PROGRAM_WIDTH == 4
+	if (!(address & 3) && !((uintptr_t)buf & 3)) {
+		for (; i + 4 <= len; i += 4) {
+			flash_program_word(address + i, *(const uint32_t *)&buf[i]);
+		}
+	}
+#elif BOARD_FLASH_PROGRAM_WIDTH == 2
+	if (!(address & 1) && !((uintptr_t)buf & 1)) {
+		for (; i + 2 <= len; i += 2) {
+			flash_program_half_word(address + i, *(const uint16_t *)&buf[i]);
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		flash_program_byte(address + i, buf[i]);
+	}
+}
+
+/*
+ * Bytes per f_read() of the update engine; with the aligned buffers below
+ * FatFs hands each chunk to disk_read() as one multi-block read.
+ */
+#define SD_UPLOAD_CHUNK		(8 * 512)
+
+/* per-sector bitmaps are 32 bits; F4 parts have at most 23 app sectors */
+#define SD_MAX_SECTORS		32
+
+static uint8_t sd_buf[2][SD_UPLOAD_CHUNK] __attribute__((aligned(8)));
+
+/* words of the previous chunk still to be programmed */
+static struct {
+	uint32_t	address;
+	const uint32_t	*src;
+	unsigned	words;
+} sd_pipe;
+
+/*
+ * Called from the SDIO polling loop while the card streams the next chunk:
+ * start the next word whenever the flash controller is idle.
+ */
+static int
+sd_pipe_poll(void)
+{
+	if (flash_func_busy()) {
+		return 1;
+	}
+
+	if (sd_pipe.words == 0) {
+		return 0;
+	}
+
+	flash_func_start_word(sd_pipe.address - flash_slot.base, *sd_pipe.src++);
+	sd_pipe.address += sizeof(uint32_t);
+	sd_pipe.words--;
+	return 1;
+}
+
+static void
+sd_print_num(uint32_t n)
+{
+	uint8_t buf[10];
+	unsigned i = sizeof(buf);
+
+	do {
+		buf[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	uart7_cout(UART7, &buf[i], sizeof(buf) - i);
+}
+
+/* programming rate of the update engine, reported by sd_print_rate() */
+static struct {
+	uint32_t	bytes;
+	uint32_t	us;
+} sd_rate;
+
+static void
+sd_print_rate(void)
+{
+	uint8_t rate[]="\r\nThroughput  : ";
+	uint8_t kbps[]=" KB/s";
+
+	if (sd_rate.us > 0) {
+		uart7_cout(UART7, rate, sizeof(rate) - 1);
+		sd_print_num((uint64_t)sd_rate.bytes * 1000000 / 1024 / sd_rate.us);
+		uart7_cout(UART7, kbps, sizeof(kbps) - 1);
+	}
+
+	/* blocks copied through SDIO_DATA_BUFFER; nonzero means a misaligned buffer */
+	if (SD_BounceReads + SD_BounceWrites > 0) {
+		uint8_t bounced[]="\r\nBounced     : ";
+		uint8_t blocks[]=" blocks";
+
+		uart7_cout(UART7, bounced, sizeof(bounced) - 1);
+		sd_print_num(SD_BounceReads + SD_BounceWrites);
+		uart7_cout(UART7, blocks, sizeof(blocks) - 1);
+	}
+}
+
+/*
+ * Cluster link map of the file being updated from (_USE_FASTSEEK): FatFs
+ * takes clusters from it instead of walking the FAT, and a file in one
+ * fragment is read with disk_read() from its first sector on, one
+ * multi-block command per chunk wherever the cluster boundaries fall.
+ */
+#define SD_CLMT_WORDS		32		/* up to 15 fragments */
+
+/* blocks per disk_write() of sd_fwrite(); SD_WriteDisk() counts them in a byte */
+#define SD_BURST_BLOCKS		128
+
+static DWORD sd_clmt[SD_CLMT_WORDS];
+
+static struct {
+	FIL		*fp;		/* contiguous file, or 0 */
+	DWORD		sector;		/* card sector of its first byte */
+} sd_contig;
+
+static void
+sd_map(FIL *fp)
+{
+	sd_contig.fp = 0;
+	fp->cltbl = sd_clmt;
+	sd_clmt[0] = SD_CLMT_WORDS;
+
+	if (f_lseek(fp, CREATE_LINKMAP) != FR_OK) {
+		/* too fragmented, follow the FAT as before */
+		fp->cltbl = 0;
+		return;
+	}
+
+	/* <words used><clusters><first cluster><0> is a single fragment */
+	if (sd_clmt[0] == 4) {
+		sd_contig.fp = fp;
+		sd_contig.sector = fp->obj.fs->database + (sd_clmt[2] - 2) * fp->obj.fs->csize;
+	}
+}
+
+/* f_read(), with whole sectors of a contiguous file read straight from the card */
+static FRESULT
+sd_fread(FIL *fp, void *buf, UINT len, UINT *br)
+{
+	FSIZE_t pos = f_tell(fp);
+	UINT n, rd;
+
+	/* f_open() clears cltbl, the map does not outlive the file */
+	if (fp != sd_contig.fp || fp->cltbl != sd_clmt || pos % 512 || ((uintptr_t)buf & 3)) {
+		return f_read(fp, buf, len, br);
+	}
+
+	if (len > f_size(fp) - pos) {
+		len = f_size(fp) - pos;
+	}
+
+	n = len & ~511;
+
+	if (n > 0 && (disk_read(0, buf, sd_contig.sector + pos / 512, n / 512) != RES_OK ||
+		      f_lseek(fp, pos + n) != FR_OK)) {
+		return FR_DISK_ERR;
+	}
+
+	if (len > n) {
+		FRESULT res = f_read(fp, (uint8_t *)buf + n, len - n, &rd);
+
+		if (res) {
+			return res;
+		}
+	}
+
+	*br = len;
+	return FR_OK;
+}
+
+/*
+ * f_write() inside the allocated size of the file; whole sectors of a
+ * contiguous file go to the card in bursts of up to 64KB, from wherever buf
+ * is, flash included.
+ */
+static FRESULT
+sd_fwrite(FIL *fp, const void *buf, UINT len, UINT *bw)
+{
+	FSIZE_t pos = f_tell(fp);
+	const uint8_t *src = buf;
+	UINT n, done, wr;
+
+	if (fp != sd_contig.fp || fp->cltbl != sd_clmt || pos % 512 || ((uintptr_t)buf & 3) ||
+	    len > f_size(fp) - pos || (fp->flag & _FA_DIRTY)) {
+		return f_write(fp, buf, len, bw);
+	}
+
+	n = len & ~511;
+
+	for (done = 0; done < n; done += SD_BURST_BLOCKS * 512) {
+		UINT blocks = (n - done) / 512;
+		DWORD sector = sd_contig.sector + (pos + done) / 512;
+
+		if (blocks > SD_BURST_BLOCKS) {
+			blocks = SD_BURST_BLOCKS;
+		}
+
+		/* fp->buf must not keep an old copy of a sector written around it */
+		if (fp->sect - sector < blocks) {
+			fp->sect = 0;
+		}
+
+		if (disk_write(0, &src[done], sector, blocks) != RES_OK) {
+			return FR_DISK_ERR;
+		}
+	}
+
+	if (f_lseek(fp, pos + n) != FR_OK) {
+		return FR_DISK_ERR;
+	}
+
+	if (len > n) {
+		FRESULT res = f_write(fp, &src[n], len - n, &wr);
+
+		if (res) {
+			return res;
+		}
+	}
+
+	*bw = len;
+	return FR_OK;
+}
+
+/*
+ * Compressed update file (fw.lz): a header with the CRC of every block of
+ * the image, then an lz.c stream of the image.  The block CRCs tell which
+ * sectors differ from the flash without decoding anything; the stream is
+ * decoded as it is read and every block is checked against its CRC, so
+ * sd_read(), sd_seek() and sd_size() stand in for FatFs and the update
+ * engine sees the plain image.  Seeking forward decodes and drops, seeking
+ * back starts over; the update engine only goes back once, to sector 0.
+ */
+#define SD_LZ_MAGIC		0x5a4c5850	/* "PXLZ" */
+#define SD_LZ_HEADER		12
+#define SD_LZ_BLOCKS		128		/* 2MB of 16KB blocks */
+
+static struct {
+	FIL		*fp;		/* file being decoded, or 0 */
+	const uint8_t	*in;
+	const uint8_t	*end;
+	uint32_t	size;		/* of the image */
+	uint32_t	block;		/* bytes per block CRC */
+	uint32_t	pos;		/* image bytes decoded */
+	uint32_t	sum;		/* crc32() of the current block so far */
+	uint32_t	crc[SD_LZ_BLOCKS];	/* of each block, padded with 0xff */
+	struct lz_state	lz;
+} sd_lz;
+
+/* multiple of the sector size, so FatFs reads straight into it */
+static uint8_t sd_lz_in[4 * 512] __attribute__((aligned(4)));
+
+/*
+ * Read the header and restart decoding at the beginning of the image:
+ * <"PXLZ"><size:4><window_bits:1><block_bits:1><0:2><crc:4>...
+ */
+static int
+sd_lz_rewind(void)
+{
+	const uint32_t *header = (const uint32_t *)sd_lz_in;
+	unsigned blocks;
+	UINT br;
+
+	if (f_lseek(sd_lz.fp, 0) || sd_fread(sd_lz.fp, sd_lz_in, sizeof(sd_lz_in), &br) ||
+	    br < SD_LZ_HEADER || header[0] != SD_LZ_MAGIC ||
+	    sd_lz_in[8] > LZ_WINDOW_BITS || sd_lz_in[9] < 10 || sd_lz_in[9] > 14) {
+		return -1;
+	}
+
+	sd_lz.size = header[1];
+	sd_lz.block = 1U << sd_lz_in[9];
+	blocks = (sd_lz.size + sd_lz.block - 1) / sd_lz.block;
+
+	if (blocks > SD_LZ_BLOCKS || br < SD_LZ_HEADER + blocks * sizeof(uint32_t)) {
+		return -1;
+	}
+
+	memcpy(sd_lz.crc, &header[3], blocks * sizeof(uint32_t));
+	sd_lz.in = sd_lz_in + SD_LZ_HEADER + blocks * sizeof(uint32_t);
+	sd_lz.end = sd_lz_in + br;
+	sd_lz.pos = 0;
+	sd_lz.sum = 0;
+	lz_init(&sd_lz.lz);
+	return 0;
+}
+
+/* open a compressed update file; FR_OK or an error as f_open() */
+static FRESULT
+sd_lz_open(FIL *fp, const TCHAR *path)
+{
+	FRESULT res = f_open(fp, path, FA_READ);
+
+	if (res == FR_OK) {
+		sd_map(fp);
+		sd_lz.fp = fp;
+
+		if (sd_lz_rewind()) {
+			sd_lz.fp = 0;
+			f_close(fp);
+			res = FR_INVALID_OBJECT;
+		}
+	}
+
+	return res;
+}
+
+/* nonzero if the flash at address differs from the image, by block CRC */
+static int
+sd_lz_differs(uint32_t address, uint32_t len)
+{
+	for (uint32_t done = 0; done < len; done += sd_lz.block) {
+		unsigned b = (address + done) / sd_lz.block;
+		uint32_t expect = (address + done < sd_lz.size) ? sd_lz.crc[b] : crc32_erased(sd_lz.block, 0);
+
+		if (crc32_flash(address + done, sd_lz.block, 0) != expect) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* account for n decoded bytes at p; -1 if a block does not match its CRC */
+static int
+sd_lz_check(const uint8_t *p, unsigned n)
+{
+	while (n > 0) {
+		unsigned k = sd_lz.block - sd_lz.pos % sd_lz.block;
+
+		if (k > n) {
+			k = n;
+		}
+
+		sd_lz.sum = crc32(p, k, sd_lz.sum);
+		sd_lz.pos += k;
+		p += k;
+		n -= k;
+
+		if (sd_lz.pos % sd_lz.block == 0 || sd_lz.pos == sd_lz.size) {
+			uint32_t pad = -sd_lz.pos % sd_lz.block;
+
+			if (crc32_erased(pad, sd_lz.sum) != sd_lz.crc[(sd_lz.pos - 1) / sd_lz.block]) {
+				return -1;
+			}
+
+			sd_lz.sum = 0;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * buf must be word aligned and, short of the end of the file, len a multiple
+ * of the sector size read from a sector boundary: FatFs then passes buf to
+ * disk_read() and the card FIFO drains straight into it, with no copy
+ * through fp->buf or SDIO_DATA_BUFFER.  Only the partial last sector of a
+ * file goes through fp->buf.
+ */
+static FRESULT
+sd_read(FIL *fp, void *buf, UINT len, UINT *br)
+{
+	uint8_t *out = buf;
+	UINT n = 0;
+
+	if (fp != sd_lz.fp) {
+		return sd_fread(fp, buf, len, br);
+	}
+
+	if (len > sd_lz.size - sd_lz.pos) {
+		len = sd_lz.size - sd_lz.pos;
+	}
+
+	while (n < len) {
+		/* a little at a time, so flash programming keeps going meanwhile */
+		int got = lz_decode(&sd_lz.lz, &sd_lz.in, sd_lz.end, &out[n], (len - n < 256) ? len - n : 256);
+		UINT rd;
+
+		if (got < 0 || sd_lz_check(&out[n], got)) {
+			return FR_INT_ERR;
+		}
+
+		n += got;
+
+		if (SD_WaitHook) {
+			SD_WaitHook();
+		}
+
+		if (n < len && sd_lz.in == sd_lz.end) {
+			FRESULT res = sd_fread(fp, sd_lz_in, sizeof(sd_lz_in), &rd);
+
+			if (res) {
+				return res;
+			}
+
+			if (rd == 0) {
+				/* truncated */
+				return FR_INT_ERR;
+			}
+
+			sd_lz.in = sd_lz_in;
+			sd_lz.end = sd_lz_in + rd;
+		}
+	}
+
+	*br = n;
+	return FR_OK;
+}
+
+static FRESULT
+sd_seek(FIL *fp, FSIZE_t ofs)
+{
+	if (fp != sd_lz.fp) {
+		return f_lseek(fp, ofs);
+	}
+
+	if (ofs < sd_lz.pos && sd_lz_rewind()) {
+		return FR_INT_ERR;
+	}
+
+	while (sd_lz.pos < ofs && sd_lz.pos < sd_lz.size) {
+		UINT br;
+		FRESULT res = sd_read(fp, sd_buf[0], (ofs - sd_lz.pos < SD_UPLOAD_CHUNK) ? ofs - sd_lz.pos : SD_UPLOAD_CHUNK, &br);
+
+		if (res) {
+			return res;
+		}
+	}
+
+	return FR_OK;
+}
+
+static FSIZE_t
+sd_size(FIL *fp)
+{
+	return (fp == sd_lz.fp) ? sd_lz.size : f_size(fp);
+}
+
+/*
+ * Copy up to limit bytes from the current position of fp to flash from
+ * program_addr on.  Two buffers are kept so that each chunk is programmed
+ * while the card delivers the next one; whatever is left when the read
+ * returns is finished with sd_program().  Returns 0, or -1 if the file could
+ * not be read.
+ */
+static int
+sd_flash_file(FIL *fp, uint32_t program_addr, uint32_t limit)
+{
+	uint8_t block[]={0xa1,0xf6};
+	unsigned cur = 0;
+	uint32_t last = dwt_read_cycle_counter();
+	UINT len, next;
+
+	if (sd_read(fp, sd_buf[cur], (limit < SD_UPLOAD_CHUNK) ? limit : SD_UPLOAD_CHUNK, &len)) {
+		return -1;
+	}
+
+	limit -= len;
+
+	while (len > 0) {
+		FRESULT res;
+
+		sd_pipe.address = program_addr;
+		sd_pipe.src = (const uint32_t *)sd_buf[cur];
+		sd_pipe.words = len / sizeof(uint32_t);
+
+		/*
+		 * Only in DMA mode: a polled read drains the FIFO by hand, without
+		 * flow control, and fetches stall while a word programs.
+		 */
+		if (SD_GetDeviceMode() == SD_DMA_MODE) {
+			SD_WaitHook = sd_pipe_poll;
+		}
+
+		res = sd_read(fp, sd_buf[cur ^ 1], (limit < SD_UPLOAD_CHUNK) ? limit : SD_UPLOAD_CHUNK, &next);
+		SD_WaitHook = 0;
+
+		while (flash_func_busy());
+
+		sd_program(sd_pipe.address, (const uint8_t *)sd_pipe.src, program_addr + len - sd_pipe.address);
+
+		if (res) {
+			return -1;
+		}
+
+		/* a status mark and LED change every 50KB, as before */
+		if ((sd_rate.bytes + len) / 51200 != sd_rate.bytes / 51200) {
+			uart7_cout(UART7, block, sizeof(block));
+			led_toggle(LED_BOOTLOADER);
+		}
+
+		/* accumulate per chunk so the 32-bit cycle counter cannot wrap */
+		uint32_t now = dwt_read_cycle_counter();
+		sd_rate.us += (now - last) / board_info.systick_mhz;
+		last = now;
+
+		program_addr += len;
+		sd_rate.bytes += len;
+		limit -= next;
+		len = next;
+		cur ^= 1;
+	}
+
+	return 0;
+}
+
+/* nonzero if the next len bytes of fp, padded with 0xff, differ from flash at address */
+static int
+sd_sector_differs(FIL *fp, uint32_t address, uint32_t len)
+{
+	for (uint32_t done = 0; done < len; done += SD_UPLOAD_CHUNK) {
+		UINT br;
+
+		if (sd_read(fp, sd_buf[0], SD_UPLOAD_CHUNK, &br)) {
+			return -1;
+		}
+
+		memset(&sd_buf[0][br], 0xff, SD_UPLOAD_CHUNK - br);
+
+		if (!flash_func_compare(address + done, sd_buf[0], SD_UPLOAD_CHUNK)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Delta update: compare every sector with the image in fp and erase and
+ * program only the sectors that differ, so time and flash wear follow the
+ * size of the change.  Sector 0 holds the vectors; if anything changes it
+ * is erased first and programmed last, so an interrupted update leaves an
+ * image that does not boot and is retried by the next SD_upload(); so does
+ * a compressed image that fails a block CRC.
+ * Returns the number of sectors rewritten, or -1.
+ */
+static int
+sd_delta_flash(FIL *fp, uint32_t program_addr)
+{
+	uint8_t block[]={0xa1,0xf6};
+	uint8_t program[]="\r\nProgramming : ";
+	uint8_t skipped[]="Unchanged   : ";
+	uint8_t unit[]=" sectors\r\n";
+	uint8_t erasing[]="Erasing     : ";
+	uint32_t changed = 0, address = 0;
+	unsigned sectors = 0, count = 0;
+	int ret;
+
+	for (unsigned i = 0; flash_func_sector_size(i) != 0; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if (i >= SD_MAX_SECTORS) {
+			count++;
+
+		} else if (fp == sd_lz.fp) {
+			if (sd_lz_differs(address, size)) {
+				changed |= 1U << i;
+				count++;
+			}
+
+		} else if (f_lseek(fp, address) || (ret = sd_sector_differs(fp, address, size)) < 0) {
+			return -1;
+
+		} else if (ret) {
+			changed |= 1U << i;
+			count++;
+		}
+
+		address += size;
+		sectors = i + 1;
+	}
+
+	uart7_cout(UART7, skipped, sizeof(skipped) - 1);
+	sd_print_num(sectors - count);
+	uart7_cout(UART7, unit, sizeof(unit) - 1);
+
+	if (count == 0) {
+		return 0;
+	}
+
+	if (!(changed & 1)) {
+		changed |= 1;
+		count++;
+	}
+
+	sd_rate.bytes = 0;
+	sd_rate.us = 0;
+
+	uart7_cout(UART7, erasing, sizeof(erasing) - 1);
+
+	for (unsigned i = 0; i < sectors; i++) {
+		if (i < SD_MAX_SECTORS && !(changed & (1U << i))) {
+			continue;
+		}
+
+		flash_func_erase_sector(i);
+		led_toggle(LED_BOOTLOADER);
+		uart7_cout(UART7, block, sizeof(block));
+	}
+
+	uart7_cout(UART7, program, sizeof(program));
+	address = flash_func_sector_size(0);
+
+	for (unsigned i = 1; i < sectors; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if ((i >= SD_MAX_SECTORS || (changed & (1U << i))) && address < sd_size(fp)) {
+			if (sd_seek(fp, address) || sd_flash_file(fp, program_addr + address, size)) {
+				return -1;
+			}
+		}
+
+		address += size;
+	}
+
+	/* sector 0 last */
+	if (sd_seek(fp, 0) || sd_flash_file(fp, program_addr, flash_func_sector_size(0))) {
+		return -1;
+	}
+
+	sd_print_rate();
+	return count;
+}
+
+/*
+ * Card read benchmark: when the card holds "sdbench.txt", read the number of
+ * MB it names (default 4) with raw disk_read() calls, once in polling and
+ * once in DMA mode, and print the rate of each.  The file is removed so the
+ * benchmark runs only once.  Only built with SD_BENCH (the simulation, or
+ * EXTRAFLAGS=-DSD_BENCH), so update boots do not look for the file.
+ */
+#if defined(SD_BENCH)
+static void
+sd_bench(void)
+{
+	uint8_t head[]="SD bench ";
+	uint8_t mode_name[2][9]={"polling: ","DMA    : "};
+	uint8_t mbps[]=" MB/s\r\n";
+	uint32_t mode = SD_GetDeviceMode();
+	DWORD sectors = 0;
+	UINT br;
+	uint32_t mb = 0;
+
+	if (f_open(&file, "sdbench.txt", FA_READ)) {
+		return;
+	}
+
+	if (f_read(&file, sd_buf[0], 8, &br) == FR_OK) {
+		for (unsigned i = 0; i < br && sd_buf[0][i] >= '0' && sd_buf[0][i] <= '9'; i++) {
+			mb = mb * 10 + sd_buf[0][i] - '0';
+		}
+	}
+
+	f_close(&file);
+	f_unlink("sdbench.txt");
+
+	if (mb == 0) {
+		mb = 4;
+	}
+
+	disk_ioctl(0, GET_SECTOR_COUNT, &sectors);
+
+	if (sectors < mb * 2048) {
+		mb = sectors / 2048;
+	}
+
+	for (uint32_t m = SD_POLLING_MODE; m <= SD_DMA_MODE; m++) {
+		uint32_t us = 0, last = dwt_read_cycle_counter();
+		DWORD sector;
+
+		SD_SetDeviceMode(m);
+
+		for (sector = 0; sector < mb * 2048; sector += SD_UPLOAD_CHUNK / 512) {
+			if (disk_read(0, sd_buf[0], sector, SD_UPLOAD_CHUNK / 512) != RES_OK) {
+				break;
+			}
+
+			uint32_t now = dwt_read_cycle_counter();
+			us += (now - last) / board_info.systick_mhz;
+			last = now;
+		}
+
+		uart7_cout(UART7, head, sizeof(head) - 1);
+		uart7_cout(UART7, mode_name[m], sizeof(mode_name[m]));
+
+		if (us > 0) {
+			/* hundredths of MB/s, 2048 sectors per MB */
+			uint32_t rate = (uint64_t)sector * 1000000 * 100 / 2048 / us;
+			uint8_t frac[] = {'.', '0' + rate / 10 % 10, '0' + rate % 10};
+
+			sd_print_num(rate / 100);
+			uart7_cout(UART7, frac, sizeof(frac));
+		}
+
+		uart7_cout(UART7, mbps, sizeof(mbps) - 1);
+	}
+
+	SD_SetDeviceMode(mode);
+}
+#endif
+
+/*
+ * backup.crc says which sectors of backup.bin hold a current copy of the
+ * flash and what their CRCs are.  A sector's bit is cleared before it is
+ * rewritten and set again once its data is synced, so an interrupted backup
+ * resumes where it stopped and an unchanged sector is never written twice.
+ *
+ * The backup is only restored by SD_upload() while BACKUP_PENDING is set,
+ * i.e. between a PROTO_CHIP_ERASE and the PROTO_BOOT that ends the upload.
+ * A backup.bin without backup.crc is treated as pending, as it always was.
+ */
+#define BACKUP_MANIFEST_MAGIC	0x314d4b42	/* "BKM1" */
+#define BACKUP_PENDING		(1 << 0)	/* restore backup.bin at the next boot */
+
+static struct {
+	uint32_t	magic;
+	uint32_t	flags;
+	uint32_t	length;			/* bytes of backup.bin in use */
+	uint32_t	valid;			/* bit n: sector n is current */
+	uint32_t	crc[SD_MAX_SECTORS];
+} backup_manifest;
+
+static FIL manifestfile;
+
+/* read backup.crc from the open manifestfile, 0 if it is usable */
+static int
+backup_manifest_load(void)
+{
+	UINT br;
+
+	if (f_read(&manifestfile, &backup_manifest, sizeof(backup_manifest), &br) ||
+	    br != sizeof(backup_manifest) ||
+	    backup_manifest.magic != BACKUP_MANIFEST_MAGIC) {
+		memset(&backup_manifest, 0, sizeof(backup_manifest));
+		backup_manifest.magic = BACKUP_MANIFEST_MAGIC;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+backup_manifest_save(void)
+{
+	UINT bw;
+
+	if (f_lseek(&manifestfile, 0) ||
+	    f_write(&manifestfile, &backup_manifest, sizeof(backup_manifest), &bw) ||
+	    bw != sizeof(backup_manifest)) {
+		return -1;
+	}
+
+	return f_sync(&manifestfile) ? -1 : 0;
+}
+
+static bool
+backup_pending(void)
+{
+	bool pending;
+
+	if (f_open(&manifestfile, "backup.crc", FA_READ)) {
+		return true;
+	}
+
+	pending = backup_manifest_load() == 0 && (backup_manifest.flags & BACKUP_PENDING);
+	f_close(&manifestfile);
+	return pending;
+}
+
+/*
+ * The upload finished, or the backup was restored: keep backup.bin as the
+ * base for the next incremental backup but stop restoring it.
+ */
+void SD_backup_release(void)
+{
+	if (!board_sd_mount()) {
+		return;
+	}
+
+	if (f_open(&manifestfile, "backup.crc", FA_READ | FA_WRITE)) {
+		f_unlink("backup.bin");
+		return;
+	}
+
+	if (backup_manifest_load() == 0 && (backup_manifest.flags & BACKUP_PENDING)) {
+		backup_manifest.flags &= ~BACKUP_PENDING;
+		backup_manifest_save();
+	}
+
+	f_close(&manifestfile);
+}
+
+static uint32_t
+flash_sector_crc(uint32_t address, uint32_t size)
+{
+	return crc32_flash(address, size, 0);
+}
+
+/*
+ * Copy one flash sector to the same offset of backup.bin.  The flash is
+ * memory mapped, so the whole sector is handed to one write straight from
+ * the running slot, with no word-by-word copy through RAM.
+ */
+static int
+backup_write_sector(uint32_t address, uint32_t size)
+{
+	UINT bw;
+
+	if (f_lseek(&backupfile, address) ||
+	    sd_fwrite(&backupfile, (const void *)(uintptr_t)(flash_slot.base + address), size, &bw) || bw != size) {
+		return -1;
+	}
+
+	return f_sync(&backupfile) ? -1 : 0;
+}
+
+void SD_upload(void)
+{
+	uint32_t  program_addr=flash_slot.base;
+	uint8_t Res=0;
+	uint8_t backupRes=0;
+	uint8_t erase_setor[]="Find the file: fw.bin ,begin to upload this file \r\n";
+	uint8_t lz_file[]="Find the file: fw.lz ,begin to decompress and upload this file \r\n";
+	uint8_t old_file[]="Find the file:old . to delete this file  \r\n";
+	uint8_t no_file[]="Fail to find the file:fw.bin . \r\n";
+	uint8_t fail_progm[]="Fail to read the file... \r\n ";
+	uint8_t finish[]="\r\nAll finished  ...   \r\n";
+	uint8_t Init_ok[]="Check SD card  ....   \r\n";
+
+	uint8_t backuperase[]="Find the file: backup.bin ,begin to upload this file \r\n";
+	uint8_t backupnofile[]="Fail to find the file:backup.bin.\r\n";
+
+	if (!board_sd_mount()) {
+		return;
+	}
+
+	trace_point(TRACE_UPLOAD);
+	uart7_cout(UART7, Init_ok, sizeof(Init_ok));
+#if defined(SD_BENCH)
+	sd_bench();
+#endif
+	Res=f_open(&oldfile,"old",FA_READ);//检查是否能打开“old”文件，如打开成功，则删除
+	if(Res==0)
+	{
+		uart7_cout(UART7, old_file, sizeof(old_file));
+		f_close (&oldfile);
+		f_unlink("old");
+	}
+	backupRes=f_open(&backupfile,"backup.bin",FA_READ);//检查是否有未完成升级留下的“backup.bin”，如有则恢复
+	if(backupRes==0 && !backup_pending()) {
+		f_close(&backupfile);
+		backupRes=1;
+	}
+	if(backupRes==0) {
+		sd_map(&backupfile);
+		flash_unlock();            //关闭flash写保护
+		image_invalidate();        //恢复会改写固件，清除已校验标记
+		uart7_cout(UART7, backuperase, sizeof(backuperase));  //只擦除并重写有变化的扇区，每擦除一个扇区，LED变化一次，并打印相应信息
+		if(sd_delta_flash(&backupfile, program_addr)<0) {     //读取失败，按需加入处理函数
+			uart7_cout(UART7, fail_progm, sizeof(fail_progm));
+		}
+		flash_lock();                              //打开flash写保护
+		f_close (&backupfile);                     //关闭文件
+		uart7_cout(UART7, finish, sizeof(finish));
+		SD_backup_release();
+		jump_to_app();                             //跳转至固件
+	} else {
+		uart7_cout(UART7,backupnofile, sizeof(backupnofile));
+	}
+
+
+	Res=f_open(&file,"fw.bin",FA_READ);         //检查是否能打开“upgrade.bin”文件，打开成功后，更新后改名old
+	if(Res==0) {
+		sd_map(&file);
+		uart7_cout(UART7, erase_setor, sizeof(erase_setor));  //只擦除并重写有变化的扇区，每擦除一个扇区，LED变化一次，并打印相应信息
+	} else if((Res=sd_lz_open(&file,"fw.lz"))==0) {        //没有fw.bin时查找压缩固件fw.lz，边读边解压
+		uart7_cout(UART7, lz_file, sizeof(lz_file));
+	}
+	if(Res==0) {
+		flash_unlock();            //关闭flash写保护
+		slot_open();                               //A/B slot时写入未运行的slot，原固件保持可启动
+		int failed = sd_delta_flash(&file, flash_slot.base)<0;
+		if(failed) {                               //读取失败，按需加入处理函数
+			uart7_cout(UART7, fail_progm, sizeof(fail_progm));
+			slot_close(false);
+		} else {
+			slot_close(true);                      //写完整后才切换到新的slot
+		}
+		flash_lock();                              //打开flash写保护
+		f_close (&file);                           //关闭文件
+		uart7_cout(UART7, finish, sizeof(finish));
+		if(!failed) {                              //只有升级成功才重命名固件为old，失败时保留以便重试
+			f_rename(sd_lz.fp ? "fw.lz" : "FW.bin","old");
+		}
+		sd_lz.fp = 0;
+		sd_contig.fp = 0;
+	} else {//打开失败，则判定为不更新固件，卸载fatfs，跳转至固件
+		uart7_cout(UART7, no_file, sizeof(no_file));
+	}
+
+	trace_point(TRACE_UPLOAD_DONE);
+}
+
+/*
+ * Bring backup.bin up to date with the application in flash before it is
+ * erased: every sector up to the last one in use is compared against
+ * backup.crc and only those that changed, or were never completed, are
+ * written.  A pending backup is left alone, the flash may hold a partial
+ * upload.  Returns 0 if the pending backup was kept, 1 otherwise.
+ */
+int read_chip_to_sd(void)
+{
+	uint8_t block[]={0xa1,0xf6};
+	uint8_t test1[]="Backup: update the backup.bin file \r\n";
+	uint8_t test2[]="Backup: finish to read the chip, sectors written: ";
+	uint8_t fail[]="Backup: fail to write the backup.bin file \r\n";
+	uint8_t crlf[]="\r\n";
+	uint32_t crc[SD_MAX_SECTORS];
+	uint32_t length = 0, address = 0, stale = 0;
+	unsigned sectors = 0, written = 0;
+	int ret = -1;
+
+	if (!board_sd_mount()) {
+		return 1;
+	}
+
+	trace_point(TRACE_BACKUP);
+
+	if (f_open(&manifestfile, "backup.crc", FA_READ | FA_WRITE)) {
+		//没有backup.crc：已有的backup.bin来自未完成的升级，保留它
+		if (f_open(&backupfile, "backup.bin", FA_READ) == FR_OK) {
+			f_close(&backupfile);
+			return 0;
+		}
+
+		if (f_open(&manifestfile, "backup.crc", FA_READ | FA_WRITE | FA_CREATE_ALWAYS)) {
+			uart7_cout(UART7, fail, sizeof(fail));
+			return 1;
+		}
+	}
+
+	if (backup_manifest_load() == 0 && (backup_manifest.flags & BACKUP_PENDING)) {
+		f_close(&manifestfile);
+		return 0;
+	}
+
+	if (f_open(&backupfile, "backup.bin", FA_READ | FA_WRITE | FA_OPEN_ALWAYS)) {
+		f_close(&manifestfile);
+		uart7_cout(UART7, fail, sizeof(fail));
+		return 1;
+	}
+
+	/* backup.bin was replaced or cut short behind our back */
+	if (backup_manifest.length > f_size(&backupfile)) {
+		backup_manifest.valid = 0;
+	}
+
+	uart7_cout(UART7, test1, sizeof(test1));
+
+	/* the image ends with the last sector that is not blank */
+	for (unsigned i = 0; flash_func_sector_size(i) != 0; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if (!flash_func_is_blank(address, size)) {
+			sectors = i + 1;
+			length = address + size;
+		}
+
+		address += size;
+	}
+
+	/* find the stale sectors and invalidate them all with one manifest write */
+	address = 0;
+
+	for (unsigned i = 0; i < sectors; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if (i < SD_MAX_SECTORS) {
+			crc[i] = flash_sector_crc(address, size);
+
+			if (!(backup_manifest.valid & (1U << i)) || backup_manifest.crc[i] != crc[i]) {
+				stale |= 1U << i;
+			}
+		}
+
+		address += size;
+	}
+
+	/* sectors past the end of the image are no longer part of the backup */
+	if (sectors < SD_MAX_SECTORS) {
+		stale |= ~((1U << sectors) - 1);
+	}
+
+	/* a new backup.bin in one piece, so that restoring it reads contiguously */
+	if (f_size(&backupfile) == 0 && length > 0) {
+		f_expand(&backupfile, length, 1);
+	}
+
+	/* fast seek cannot grow a file, only map one that is big enough */
+	if (f_size(&backupfile) >= length) {
+		sd_map(&backupfile);
+	}
+
+	backup_manifest.valid &= ~stale;
+	backup_manifest.length = length;
+	backup_manifest.flags &= ~BACKUP_PENDING;
+
+	if (backup_manifest_save()) {
+		goto out;
+	}
+
+	address = 0;
+
+	for (unsigned i = 0; i < sectors; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if (i >= SD_MAX_SECTORS || (stale & (1U << i))) {
+			if (backup_write_sector(address, size)) {
+				goto out;
+			}
+
+			if (i < SD_MAX_SECTORS) {
+				backup_manifest.crc[i] = crc[i];
+				backup_manifest.valid |= 1U << i;
+
+				if (backup_manifest_save()) {
+					goto out;
+				}
+			}
+
+			written++;
+			uart7_cout(UART7, block, sizeof(block));
+			led_toggle(LED_BOOTLOADER);
+		}
+
+		address += size;
+	}
+
+	/* drop whatever an older, longer image left behind */
+	if (f_size(&backupfile) > length) {
+		backupfile.cltbl = 0;
+
+		if (f_lseek(&backupfile, length) || f_truncate(&backupfile)) {
+			goto out;
+		}
+	}
+
+	/* an empty chip has nothing worth restoring */
+	if (sectors > 0) {
+		backup_manifest.flags |= BACKUP_PENDING;
+
+		if (backup_manifest_save()) {
+			goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	sd_contig.fp = 0;
+	f_close(&manifestfile);
+	f_close(&backupfile);
+
+	if (ret < 0) {
+		uart7_cout(UART7, fail, sizeof(fail));
+
+	} else {
+		uart7_cout(UART7, test2, sizeof(test2) - 1);
+		sd_print_num(written);
+		uart7_cout(UART7, crlf, sizeof(crlf) - 1);
+	}
+
+	trace_point(TRACE_BACKUP_DONE);
+	return 1;
+}
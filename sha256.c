@@ -0,0 +1,233 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * SHA-256 engine for the image digest check.
+ *
+ * Flash is read through flash.c a buffer at a time and hashed by 64-byte
+ * blocks.  On parts with the HASH processor (F437/F439, BOARD_HASH) the
+ * words go to it instead: it takes a block in 66 cycles, against a few
+ * thousand for the rounds below.  libopencm3 only knows SHA-1 and MD5, so
+ * the SHA-256 algorithm bits and digest registers are defined here.
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "bl.h"
+#include "sha256.h"
+
+#if !defined(SHA256_USE_HW) && defined(BOARD_HASH) && !defined(TARGET_HW_PX4_SIM)
+# define SHA256_USE_HW
+#endif
+
+#ifdef SHA256_USE_HW
+# include <libopencm3/stm32/rcc.h>
+# include <libopencm3/stm32/hash.h>
+
+# define HASH_ALGO_SHA256	((1 << 18) | (1 << 7))	/* ALGO[1:0] = 11, F43x only */
+# define HASH_HR_SHA256		(&MMIO32(HASH + 0x310))	/* HASH_HR0..7 */
+#endif
+
+#if defined(TARGET_HW_PX4_SIM)
+# define SHA256_BLOCKS_DONE(n)	sim_hash(n)
+#else
+# define SHA256_BLOCKS_DONE(n)
+#endif
+
+#define SHA256_BLOCK		64
+#define SHA256_FLASH_BLOCK	256		/* sha256_flash() stack buffer, bytes */
+
+#ifndef SHA256_USE_HW
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/* one block of little-endian words, as they sit in flash */
+static void
+sha256_block(uint32_t state[8], const uint32_t *data)
+{
+	uint32_t w[16];		/* the message schedule, rolling */
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+	for (unsigned i = 0; i < 64; i++) {
+		uint32_t x;
+
+		if (i < 16) {
+			x = w[i] = __builtin_bswap32(data[i]);
+
+		} else {
+			uint32_t w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+
+			x = w[i & 15] += (ROR(w15, 7) ^ ROR(w15, 18) ^ (w15 >> 3)) + w[(i - 7) & 15] +
+					 (ROR(w2, 17) ^ ROR(w2, 19) ^ (w2 >> 10));
+		}
+
+		uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + x;
+		uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+
+	SHA256_BLOCKS_DONE(1);
+}
+
+#endif
+
+/* read len bytes of flash, the word at skip (if in range) as erased */
+static void
+sha256_read(uint32_t address, uint32_t *buf, unsigned len, uint32_t skip)
+{
+	flash_func_read_block(address, buf, len);
+
+	if (skip - address < len) {
+		buf[(skip - address) / 4] = 0xffffffff;
+	}
+}
+
+void
+sha256_flash(uint32_t address, unsigned len, uint32_t skip, uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	uint32_t buf[SHA256_FLASH_BLOCK / 4];
+	uint32_t end = address + len;
+
+#ifdef SHA256_USE_HW
+
+	rcc_peripheral_enable_clock(&RCC_AHB2ENR, RCC_AHB2ENR_HASHEN);
+	hash_set_mode(HASH_MODE_HASH);
+	hash_set_data_type(HASH_DATA_8BIT);		/* bytes in flash order */
+	HASH_CR |= HASH_ALGO_SHA256;
+	hash_init();
+
+	for (uint32_t p = address; p < end; p += sizeof(buf)) {
+		unsigned n = (end - p < sizeof(buf)) ? end - p : sizeof(buf);
+
+		sha256_read(p, buf, n, skip);
+
+		/* writes wait on the bus while the core works on a full block */
+		for (unsigned i = 0; i < n / 4; i++) {
+			HASH_DIN = buf[i];
+		}
+	}
+
+	hash_set_last_word_valid_bits(0);		/* len is whole words */
+	hash_digest();
+
+	while (HASH_SR & HASH_SR_BUSY);
+
+	for (unsigned i = 0; i < 8; i++) {
+		uint32_t v = HASH_HR_SHA256[i];
+
+		digest[4 * i] = v >> 24;
+		digest[4 * i + 1] = v >> 16;
+		digest[4 * i + 2] = v >> 8;
+		digest[4 * i + 3] = v;
+	}
+
+#else
+
+	uint32_t state[8];
+	uint32_t body = address + (len & ~(SHA256_BLOCK - 1));
+	uint8_t *tail = (uint8_t *)buf;
+	unsigned n = end - body;
+
+	memcpy(state, sha256_init, sizeof(state));
+
+	for (uint32_t p = address; p < body; p += sizeof(buf)) {
+		unsigned m = (body - p < sizeof(buf)) ? body - p : sizeof(buf);
+
+		sha256_read(p, buf, m, skip);
+
+		for (unsigned i = 0; i < m / 4; i += SHA256_BLOCK / 4) {
+			sha256_block(state, &buf[i]);
+		}
+	}
+
+	/* the last partial block, 0x80, zeros and the length in bits, big-endian */
+	sha256_read(body, buf, n, skip);
+	memset(tail + n, 0, 2 * SHA256_BLOCK - n);
+	tail[n] = 0x80;
+	n = (n + 9 <= SHA256_BLOCK) ? SHA256_BLOCK : 2 * SHA256_BLOCK;
+
+	for (unsigned i = 0; i < 8; i++) {
+		tail[n - 1 - i] = (uint8_t)((uint64_t)len * 8 >> (8 * i));
+	}
+
+	for (unsigned i = 0; i < n / 4; i += SHA256_BLOCK / 4) {
+		sha256_block(state, &buf[i]);
+	}
+
+	for (unsigned i = 0; i < 8; i++) {
+		digest[4 * i] = state[i] >> 24;
+		digest[4 * i + 1] = state[i] >> 16;
+		digest[4 * i + 2] = state[i] >> 8;
+		digest[4 * i + 3] = state[i];
+	}
+
+#endif
+}
@@ -0,0 +1,433 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * A/B firmware slots on 2 MB F42x parts (BOARD_AB_SLOTS).
+ *
+ * Slot A is the usual application area in bank 1, slot B the same sectors
+ * of bank 2, 1 MB up.  Both hold images linked for APP_LOAD_ADDRESS: slot
+ * B is started with the banks swapped (SYSCFG FB_MODE), so it runs where
+ * it was linked.  An upload goes to the slot that is not running and the
+ * slot record only flips once it is complete, so the old image stays
+ * bootable throughout; rolling back is another flip.
+ *
+ * flash_slot tells the flash_func_*() helpers which slot they work on: the
+ * running one, or the open one during an upload.  Without BOARD_AB_SLOTS
+ * there is one slot at APP_LOAD_ADDRESS and the rest are no-ops.
+ *
+ * Records are appended to bank 2 sector 0x10, opposite the bootloader,
+ * which neither slot uses; the last complete one wins.  Without one, the
+ * slot that has vectors boots, A first, as the single-slot bootloader did.
+ *
+ * A committed slot is on trial for BOARD_AB_BOOT_ATTEMPTS boots, counted in
+ * RTC backup register 2; the app ends the trial by writing
+ * SLOT_CONFIRM_SIGNATURE there, otherwise the previous slot comes back.
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libopencm3/stm32/flash.h>
+
+#if defined(BOARD_AB_SLOTS) && !defined(TARGET_HW_PX4_SIM)
+# include <libopencm3/stm32/rcc.h>
+# include <libopencm3/stm32/pwr.h>
+# include <libopencm3/stm32/syscfg.h>
+#endif
+
+#include "bl.h"
+
+struct flash_slot flash_slot = {
+	.base		= APP_LOAD_ADDRESS,
+	.first		= 0,
+	.sectors	= ~0u,		/* all of flash_sectors[] */
+};
+
+#if defined(BOARD_AB_SLOTS)
+
+#define SLOT_FLASH_BASE		0x08000000
+#define SLOT_BANK_SIZE		(1024 * 1024)
+#define SLOT_SIZE		(SLOT_FLASH_BASE + SLOT_BANK_SIZE - APP_LOAD_ADDRESS)
+
+#define SLOT_RECORD_BASE	(SLOT_FLASH_BASE + SLOT_BANK_SIZE)
+#define SLOT_RECORD_SECTOR	0x10
+#define SLOT_RECORD_SIZE	(16 * 1024)
+#define SLOT_RECORD_MAGIC	0x534c5400	/* "SLT", <record:4> <~record:4> */
+#define SLOT_RECORD_B		(1 << 0)	/* slot B boots */
+#define SLOT_RECORD_TRIAL	(1 << 1)	/* not confirmed by the app yet */
+
+#define SLOT_TRIAL_SIGNATURE	0x7a1a0000	/* | boots of the slot on trial */
+
+#define SYSCFG_MEMRM_FB_MODE	(1 << 8)	/* bank 2 at 0x08000000 */
+#define SLOT_TRIAL_REG		MMIO32(RTC_BASE + 0x58)	/* RTC backup register 2 */
+
+#ifndef BOARD_AB_BOOT_ATTEMPTS
+# define BOARD_AB_BOOT_ATTEMPTS	0		/* a committed slot is confirmed at once */
+#endif
+
+static bool slots;			/* both banks in use */
+static unsigned slot_b_first;		/* flash_sectors[] entry of slot B */
+static unsigned slot_booted;		/* 0: A, 1: B */
+static bool slot_trial;
+
+#if defined(TARGET_HW_PX4_SIM)
+# define slot_trial_get()	(sim_slot_reg)
+# define slot_trial_set(v)	(sim_slot_reg = (v))
+#else
+static uint32_t
+slot_trial_get(void)
+{
+	/* enable the backup registers */
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	uint32_t value = SLOT_TRIAL_REG;
+
+	PWR_CR &= ~PWR_CR_DBP;
+	return value;
+}
+
+static void
+slot_trial_set(uint32_t value)
+{
+	PWR_CR |= PWR_CR_DBP;
+	RCC_BDCR |= RCC_BDCR_RTCEN;
+
+	SLOT_TRIAL_REG = value;
+
+	PWR_CR &= ~PWR_CR_DBP;
+}
+#endif
+
+static uint32_t
+slot_address(unsigned slot)
+{
+	return APP_LOAD_ADDRESS + slot * SLOT_BANK_SIZE;
+}
+
+/* the first word is programmed last, as jump_to_app() expects */
+static bool
+slot_bootable(unsigned slot)
+{
+	return *(const uint32_t *)(uintptr_t)slot_address(slot) != 0xffffffff;
+}
+
+static void
+slot_point(unsigned slot)
+{
+	flash_slot.base = slot_address(slot);
+	flash_slot.first = slot ? slot_b_first : 0;
+}
+
+/* the last complete record, 0 if none; *next is where the next one goes */
+static uint32_t
+slot_record_find(const uint32_t **next)
+{
+	const uint32_t *p = (const uint32_t *)(uintptr_t)SLOT_RECORD_BASE;
+	const uint32_t *end = p + SLOT_RECORD_SIZE / sizeof(uint32_t);
+	uint32_t record = 0;
+
+	/* a record cut short by a reset is skipped, not written over */
+	for (; p < end && (p[0] != 0xffffffff || p[1] != 0xffffffff); p += 2) {
+		if ((p[0] & 0xffffff00) == SLOT_RECORD_MAGIC && p[1] == ~p[0]) {
+			record = p[0];
+		}
+	}
+
+	*next = p;
+	return record;
+}
+
+static void
+slot_record_write(unsigned slot, bool trial)
+{
+	uint32_t record = SLOT_RECORD_MAGIC | (slot ? SLOT_RECORD_B : 0) | (trial ? SLOT_RECORD_TRIAL : 0);
+	const uint32_t *next;
+
+	slot_record_find(&next);
+	flash_unlock();
+
+	/* full: start over, a reset before the new record falls back on the vectors */
+	if (next >= (const uint32_t *)(uintptr_t)(SLOT_RECORD_BASE + SLOT_RECORD_SIZE)) {
+		flash_erase_sector(SLOT_RECORD_SECTOR, FLASH_CR_PROGRAM_X32);
+		next = (const uint32_t *)(uintptr_t)SLOT_RECORD_BASE;
+	}
+
+	flash_program_word((uint32_t)(uintptr_t)next, record);
+	flash_program_word((uint32_t)(uintptr_t)next + 4, ~record);
+	flash_lock();
+}
+
+/*
+ * Called at every reset, once the board knows its flash size: split the
+ * flash into slots if both banks are usable (not on early F42x silicon),
+ * pick the slot to boot and end or roll back a trial.
+ */
+void
+slots_init(void)
+{
+	if (!slots) {
+		uint32_t offset = 0;
+		unsigned i = 0, sectors;
+
+		if (board_info.fw_size != SLOT_SIZE + SLOT_BANK_SIZE) {
+			return;
+		}
+
+		/* slot A ends with bank 1, slot B starts 1 MB on */
+		while (offset < SLOT_SIZE && flash_func_sector_size(i) != 0) {
+			offset += flash_func_sector_size(i++);
+		}
+
+		sectors = i;
+
+		while (offset < SLOT_BANK_SIZE && flash_func_sector_size(i) != 0) {
+			offset += flash_func_sector_size(i++);
+		}
+
+		if (offset != SLOT_BANK_SIZE) {
+			return;
+		}
+
+		slot_b_first = i;
+		flash_slot.sectors = sectors;
+		board_info.fw_size = SLOT_SIZE;
+		slots = true;
+	}
+
+	const uint32_t *next;
+	uint32_t record = slot_record_find(&next);
+	unsigned slot = (record & SLOT_RECORD_B) ? 1 : 0;
+
+	slot_trial = (record & SLOT_RECORD_TRIAL) != 0;
+
+	/* an empty slot cannot boot, whatever the record says */
+	if (!slot_bootable(slot) && slot_bootable(!slot)) {
+		slot = !slot;
+		slot_trial = false;
+	}
+
+	if (slot_trial) {
+		uint32_t trial = slot_trial_get();
+
+		if (trial == SLOT_CONFIRM_SIGNATURE) {
+			slot_record_write(slot, false);
+			slot_trial = false;
+			slot_trial_set(0);
+
+		} else if ((trial & 0xffff0000) == SLOT_TRIAL_SIGNATURE &&
+			   (trial & 0xffff) >= BOARD_AB_BOOT_ATTEMPTS && slot_bootable(!slot)) {
+			/* never confirmed: back to the image before it */
+			slot = !slot;
+			slot_record_write(slot, false);
+			slot_trial = false;
+			slot_trial_set(0);
+		}
+	}
+
+	slot_booted = slot;
+	slot_point(slot);
+}
+
+/*
+ * Point flash_func_*() at the slot that is not running, for an upload, and
+ * forget the digest check of what it held.
+ */
+void
+slot_open(void)
+{
+	image_invalidate();
+
+	if (slots) {
+		slot_point(!slot_booted);
+	}
+}
+
+/*
+ * A delta upload only erases the sectors that differ from the running
+ * image; copy the others, those not in written, into the open slot.
+ */
+void
+slot_fill(uint32_t written)
+{
+	if (!slots || flash_slot.base == slot_address(slot_booted)) {
+		return;
+	}
+
+	const uint32_t *src = (const uint32_t *)(uintptr_t)slot_address(slot_booted);
+	uint32_t address = 0;
+
+	for (unsigned i = 0; flash_func_sector_size(i) != 0; i++) {
+		uint32_t size = flash_func_sector_size(i);
+
+		if (!(i < 32 && (written & (1U << i))) && !flash_func_compare(address, &src[address / 4], size)) {
+			flash_func_erase_sector(i);
+
+			for (uint32_t p = address; p < address + size; p += 4) {
+				if (src[p / 4] != 0xffffffff) {
+					flash_func_write_word(p, src[p / 4]);
+				}
+			}
+		}
+
+		address += size;
+	}
+}
+
+/* end an upload: with commit, and vectors in place, the open slot boots next */
+void
+slot_close(bool commit)
+{
+	if (!slots || flash_slot.base == slot_address(slot_booted)) {
+		return;
+	}
+
+	if (commit && slot_bootable(!slot_booted)) {
+		slot_booted = !slot_booted;
+		slot_trial = BOARD_AB_BOOT_ATTEMPTS > 0;
+		slot_record_write(slot_booted, slot_trial);
+		slot_trial_set(0);
+	}
+
+	slot_point(slot_booted);
+}
+
+/* address of the vectors to boot; an upload still open is dropped */
+uint32_t
+slot_boot(void)
+{
+	slot_close(false);
+	return flash_slot.base;
+}
+
+/* jump_to_app() is going: one more boot of a slot on trial */
+void
+slot_count_boot(void)
+{
+	if (slot_trial) {
+		uint32_t trial = slot_trial_get();
+
+		if ((trial & 0xffff0000) != SLOT_TRIAL_SIGNATURE) {
+			trial = SLOT_TRIAL_SIGNATURE;
+		}
+
+		slot_trial_set(trial + 1);
+	}
+}
+
+#if !defined(TARGET_HW_PX4_SIM)
+extern uint32_t _ramfunc, _eramfunc, _ramfunc_loadaddr;	/* stm32f4.ld */
+
+static void slot_swap_jump(uint32_t stacktop, uint32_t entrypoint)
+__attribute__((section(".ramfunc"), long_call, noinline, noreturn));
+
+/*
+ * Enter slot B with the banks swapped.  The swap runs from RAM, as the
+ * flash under the bootloader changes with FB_MODE, and the ART caches
+ * still hold lines of bank 1; the startup code only copies .data, so the
+ * .ramfunc section is copied in here first.
+ */
+void
+slot_jump(uint32_t stacktop, uint32_t entrypoint)
+{
+	const uint32_t *src = &_ramfunc_loadaddr;
+
+	for (uint32_t *dst = &_ramfunc; dst < &_eramfunc;) {
+		*dst++ = *src++;
+	}
+
+	slot_swap_jump(stacktop, entrypoint);
+}
+
+static void
+slot_swap_jump(uint32_t stacktop, uint32_t entrypoint)
+{
+	RCC_APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+	SYSCFG_MEMRM |= SYSCFG_MEMRM_FB_MODE;
+
+	FLASH_ACR &= ~(FLASH_ACR_ICE | FLASH_ACR_DCE);
+	FLASH_ACR |= FLASH_ACR_ICRST | FLASH_ACR_DCRST;
+	FLASH_ACR &= ~(FLASH_ACR_ICRST | FLASH_ACR_DCRST);
+	FLASH_ACR |= FLASH_ACR_ICE | FLASH_ACR_DCE;
+
+	asm volatile(
+		"dsb		\n"
+		"isb		\n"
+		"msr msp, %0	\n"
+		"bx	%1	\n"
+		: : "r"(stacktop), "r"(entrypoint) :);
+
+	for (;;) ;
+}
+#endif
+
+#else
+
+void
+slots_init(void)
+{
+}
+
+void
+slot_open(void)
+{
+	image_invalidate();
+}
+
+void
+slot_fill(uint32_t written)
+{
+	(void)written;
+}
+
+void
+slot_close(bool commit)
+{
+	(void)commit;
+}
+
+uint32_t
+slot_boot(void)
+{
+	return APP_LOAD_ADDRESS;
+}
+
+void
+slot_count_boot(void)
+{
+}
+
+#endif
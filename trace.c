@@ -0,0 +1,178 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/*
+ * Boot-phase tracepoints.
+ *
+ * Each entry holds the DWT cycle count, the phase id, the core clock and
+ * the boot it belongs to.  On F4 the ring lives at the top of the 4 KB
+ * backup SRAM, so it survives resets and the app can read it too; the
+ * cycle counter is restarted at every boot.
+ *
+ * Layout, little-endian:
+ *	header:	<magic:4> <boot:2> <head:2> <count:2> <size:2> <reserved:4>
+ *	entry:	<cycles:4> <id:1> <mhz:1> <boot:2>
+ */
+
+#include "hw_config.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libopencm3/cm3/dwt.h>
+
+#include "trace.h"
+
+#if defined(STM32F4) && !defined(TARGET_HW_PX4_SIM)
+# include <libopencm3/stm32/rcc.h>
+# include <libopencm3/stm32/pwr.h>
+# define TRACE_BKPSRAM
+#endif
+
+#define TRACE_MAGIC	0x42544231	/* "1BTB" */
+#define TRACE_ENTRIES	62
+
+struct trace_entry {
+	uint32_t	cycles;
+	uint8_t		id;
+	uint8_t		mhz;
+	uint16_t	boot;
+};
+
+struct trace_ring {
+	uint32_t	magic;
+	uint16_t	boot;
+	uint16_t	head;		/* next entry to write */
+	uint16_t	count;
+	uint16_t	size;
+	uint32_t	reserved;
+	struct trace_entry entry[TRACE_ENTRIES];
+};
+
+#ifdef TRACE_BKPSRAM
+# ifndef BOARD_TRACE_ADDRESS
+#  define BOARD_TRACE_ADDRESS	(BKPSRAM_BASE + 4096 - sizeof(struct trace_ring))
+# endif
+# define ring	((struct trace_ring *)(BOARD_TRACE_ADDRESS))
+#else
+static struct trace_ring trace_ram;
+# define ring	(&trace_ram)
+#endif
+
+static uint8_t trace_mhz = 16;		/* HSI until clock_init() */
+
+/* backup SRAM writes need the backup domain unlocked */
+static inline uint32_t
+trace_unlock(void)
+{
+#ifdef TRACE_BKPSRAM
+	uint32_t cr = PWR_CR;
+
+	PWR_CR = cr | PWR_CR_DBP;
+	return cr;
+#else
+	return 0;
+#endif
+}
+
+static inline void
+trace_lock(uint32_t cr)
+{
+#ifdef TRACE_BKPSRAM
+	PWR_CR = cr;
+#else
+	(void)cr;
+#endif
+}
+
+void
+trace_init(void)
+{
+#ifdef TRACE_BKPSRAM
+	rcc_peripheral_enable_clock(&RCC_APB1ENR, RCC_APB1ENR_PWREN);
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, RCC_AHB1ENR_BKPSRAMEN);
+#endif
+	/* the DWT ignores writes until TRCENA is set, so zero CYCCNT after */
+	dwt_enable_cycle_counter();
+#ifdef TRACE_BKPSRAM
+	DWT_CYCCNT = 0;
+#endif
+
+	uint32_t cr = trace_unlock();
+
+	if (ring->magic != TRACE_MAGIC || ring->size != TRACE_ENTRIES ||
+	    ring->head >= TRACE_ENTRIES || ring->count > TRACE_ENTRIES) {
+		memset(ring, 0, sizeof(*ring));
+		ring->magic = TRACE_MAGIC;
+		ring->size = TRACE_ENTRIES;
+	}
+
+	ring->boot++;
+	trace_lock(cr);
+
+	trace_point(TRACE_RESET);
+}
+
+void
+trace_clock(unsigned mhz)
+{
+	trace_mhz = mhz;
+}
+
+void
+trace_point(enum trace_id id)
+{
+	uint32_t cycles = dwt_read_cycle_counter();
+	uint32_t cr = trace_unlock();
+	struct trace_entry *e = &ring->entry[ring->head];
+
+	e->cycles = cycles;
+	e->id = id;
+	e->mhz = trace_mhz;
+	e->boot = ring->boot;
+
+	ring->head = (ring->head + 1) % TRACE_ENTRIES;
+
+	if (ring->count < TRACE_ENTRIES) {
+		ring->count++;
+	}
+
+	trace_lock(cr);
+}
+
+const uint8_t *
+trace_buffer(uint32_t *len)
+{
+	*len = sizeof(*ring);
+	return (const uint8_t *)ring;
+}
@@ -0,0 +1,71 @@
+/****************************************************************************
+ *
+ *   Copyright (c) 2016 PX4 Development Team. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name PX4 nor the names of its contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ ****************************************************************************/
+
+/**
+ * @file trace.h
+ *
+ * Boot-phase tracepoints, timestamped with the DWT cycle counter.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* phase ids; Tools/bl_trace.py has the matching names */
+enum trace_id {
+	TRACE_RESET = 1,	/* main() entered, cycle counter restarted */
+	TRACE_CLOCK,		/* clock_init() done */
+	TRACE_BOARD,		/* board_init() done */
+	TRACE_SD_POWER,		/* SD_Init() started */
+	TRACE_SD_INIT,		/* card identified */
+	TRACE_SD_MOUNT,		/* FatFs mounted */
+	TRACE_SD_ABSENT,	/* no card, or the mount failed */
+	TRACE_UPLOAD,		/* SD_upload() started */
+	TRACE_UPLOAD_DONE,	/* SD_upload() found nothing more to do */
+	TRACE_BACKUP,		/* read_chip_to_sd() started */
+	TRACE_BACKUP_DONE,	/* read_chip_to_sd() finished */
+	TRACE_BOOTLOADER,	/* bootloader() entered */
+	TRACE_JUMP,		/* leaving for the app */
+	TRACE_VERIFY,		/* image_verify() hashing the image */
+};
+
+/* start a new boot in the ring; call first thing in main() */
+extern void trace_init(void);
+
+/* core clock in MHz from now on, for converting cycles */
+extern void trace_clock(unsigned mhz);
+
+extern void trace_point(enum trace_id id);
+
+/* the ring as sent by GET_DEVICE/TRACE */
+extern const uint8_t *trace_buffer(uint32_t *len);
@@ -39,6 +39,16 @@
 
 #pragma once
 
+#ifdef BOARD_USART_DMA
+/*
+ * DMA receive ring (usart.c).  Nothing reads it while an erase stalls the
+ * CPU, so it has to hold everything the host may send before it waits for
+ * a reply: a full PROG_STREAM window of frames with their headers.  bl.c
+ * checks this against the protocol limits.
+ */
+# define UART_RX_RING		(17 * 1024)
+#endif
+
 extern void uart_cinit(void *config);
 extern void uart_cfini(void);
 extern int uart_cin(void);
@@ -35,11 +35,91 @@
 
 #include <libopencm3/stm32/usart.h>
 
+#include <string.h>
+
 #include "bl.h"
 #include "uart.h"
 
 uint32_t usart;
 
+#ifdef BOARD_USART_DMA
+/*
+ * Boards that name DMA streams for the bootloader USART receive into a
+ * circular DMA ring and transmit from a DMA buffer, so replies go out in
+ * the background and input keeps arriving while the CPU is stalled on a
+ * flash erase.  The ring does not detect laps; it is sized (uart.h) for
+ * all the data the protocol lets the host send unacknowledged, which is
+ * what bounds how far the DMA can get ahead.  The others keep polling the
+ * data register.
+ */
+# include <libopencm3/stm32/dma.h>
+
+# define UART_TX_BUF		256
+
+static uint8_t uart_rx_ring[UART_RX_RING];
+static unsigned uart_rx_tail;
+static uint8_t uart_tx_buf[UART_TX_BUF];
+
+static void
+uart_dma_init(void)
+{
+	rcc_peripheral_enable_clock(&RCC_AHB1ENR, BOARD_USART_DMA_CLOCK_BIT);
+
+	/* RX: circular, the ring head is derived from NDTR */
+	dma_stream_reset(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+	dma_channel_select(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, BOARD_USART_DMA_CHANNEL);
+	dma_set_peripheral_address(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, (uint32_t)&USART_DR(usart));
+	dma_set_memory_address(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, (uint32_t)uart_rx_ring);
+	dma_set_number_of_data(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, UART_RX_RING);
+	dma_set_transfer_mode(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, DMA_SxCR_DIR_PERIPHERAL_TO_MEM);
+	dma_enable_memory_increment_mode(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+	dma_enable_circular_mode(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+	dma_set_peripheral_size(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, DMA_SxCR_PSIZE_8BIT);
+	dma_set_memory_size(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_set_priority(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM, DMA_SxCR_PL_HIGH);
+	dma_enable_stream(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+	uart_rx_tail = 0;
+
+	/* TX: one uart_tx_buf per transfer, armed by uart_cout() */
+	dma_stream_reset(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM);
+	dma_channel_select(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, BOARD_USART_DMA_CHANNEL);
+	dma_set_peripheral_address(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, (uint32_t)&USART_DR(usart));
+	dma_set_memory_address(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, (uint32_t)uart_tx_buf);
+	dma_set_transfer_mode(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, DMA_SxCR_DIR_MEM_TO_PERIPHERAL);
+	dma_enable_memory_increment_mode(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM);
+	dma_set_peripheral_size(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, DMA_SxCR_PSIZE_8BIT);
+	dma_set_memory_size(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, DMA_SxCR_MSIZE_8BIT);
+	dma_set_priority(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, DMA_SxCR_PL_MEDIUM);
+
+	usart_enable_rx_dma(usart);
+	usart_enable_tx_dma(usart);
+}
+
+/* wait for the previous transmission to leave uart_tx_buf */
+static void
+uart_tx_wait(void)
+{
+	while (DMA_SCR(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM) & DMA_SxCR_EN);
+}
+
+static void
+uart_dma_fini(void)
+{
+	uart_tx_wait();
+
+	while (!(USART_SR(usart) & USART_SR_TC));
+
+	usart_disable_rx_dma(usart);
+	usart_disable_tx_dma(usart);
+	dma_disable_stream(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+
+	while (DMA_SCR(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM) & DMA_SxCR_EN);
+
+	dma_stream_reset(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+	dma_stream_reset(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM);
+}
+#endif
+
 void uart_cinit(void *config)
 {
 	usart = (uint32_t)config;
@@ -58,6 +138,9 @@ void uart_cinit(void *config)
 	/* and enable */
 	usart_enable(usart);
 
+#ifdef BOARD_USART_DMA
+	uart_dma_init();
+#endif
 
 #if 0
 	usart_send_blocking(usart, 'B');
@@ -111,6 +194,9 @@ void uart7_cinit(uint32_t whichUsart)
 
 void uart_cfini(void)
 {
+#ifdef BOARD_USART_DMA
+	uart_dma_fini();
+#endif
 	usart_disable(usart);
 }
 
@@ -123,10 +209,21 @@ int uart_cin(void)
 {
 	int c = -1;
 
+#ifdef BOARD_USART_DMA
+	unsigned head = UART_RX_RING - DMA_SNDTR(BOARD_USART_DMA, BOARD_USART_DMA_RX_STREAM);
+
+	if (uart_rx_tail != head % UART_RX_RING) {
+		c = uart_rx_ring[uart_rx_tail];
+		uart_rx_tail = (uart_rx_tail + 1) % UART_RX_RING;
+	}
+
+#else
+
 	if (USART_SR(usart) & USART_SR_RXNE) {
 		c = usart_recv(usart);
 	}
 
+#endif
 	return c;
 }
 
@@ -141,10 +238,29 @@ int uart7_cin(uint32_t whichUsart)
 
 void uart_cout(uint8_t *buf, unsigned len)
 {
-	//
+#ifdef BOARD_USART_DMA
+
+	/* copied, as replies are often built on the caller's stack */
+	while (len > 0) {
+		unsigned n = (len < UART_TX_BUF) ? len : UART_TX_BUF;
+
+		uart_tx_wait();
+		memcpy(uart_tx_buf, buf, n);
+		dma_clear_interrupt_flags(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM,
+					  DMA_TCIF | DMA_HTIF | DMA_TEIF | DMA_DMEIF | DMA_FEIF);
+		dma_set_number_of_data(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM, n);
+		dma_enable_stream(BOARD_USART_DMA, BOARD_USART_DMA_TX_STREAM);
+		buf += n;
+		len -= n;
+	}
+
+#else
+
 	while (len--) {
 		usart_send_blocking(usart, *buf++);
 	}
+
+#endif
 }
 
 void uart7_cout(uint32_t whichUsart,uint8_t *buf,unsigned len)